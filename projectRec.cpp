@@ -6,6 +6,46 @@
 #include <cmath>
 #include <random>
 #include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <queue>
+#include <deque>
+#include <memory>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cerrno>
+#include <csignal>
+#include <functional>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "recsys.h"
 
 using namespace std;
 
@@ -51,6 +91,34 @@ namespace RecSys {
         double weightTags;       // вес оценки на основе тегов (например, 1.0 для полной важности)
     };
 
+    // Запрос на рекомендации — всё содержимое входных данных.
+    // works — произведения из секции WORKS (при работе с бинарным каталогом секция может быть пустой).
+    struct Request {
+        UserProfile user;
+        vector<Work> works;
+        vector<SimilarUser> similarUsers;
+        int numRecommendations = 0;
+        double randomFactor = 0;
+        MetricsConfig config { false, 0, 0, 1.0 };
+        double contentWeight = 0.5;      // коэффициенты объединения (секция COMBINE_WEIGHTS)
+        double collabWeight = 0.5;
+        vector<string> excludedWorks;    // уже просмотренные или запрещённые работы (секция EXCLUDE)
+        string userId;                   // для истории показов (секция USER_ID)
+        vector<string> requiredTags;     // в выдаче только работы со всеми этими тегами (REQUIRED_TAGS)
+        vector<string> forbiddenTags;    // и без любого из этих (FORBIDDEN_TAGS)
+        string diversity;                // режим этапа разнообразия (секция DIVERSITY), пусто — без него
+        double diversityLambda = 0.7;
+        int diversityTop = 100;
+        int nearDuplicateDistance = -1;  // порог расстояния Хэмминга SimHash (NEAR_DUPLICATES), -1 — без подавления
+        int maxPerPrimaryTag = 0;        // квоты выдачи (секция QUOTAS): не больше работ на основной тег, 0 — без
+        int minFresh = 0;                // ограничения; не меньше свежих работ
+        double freshMaxViews = 0;        // работа свежая, если просмотров не больше
+        int pageSize = 0;                // постраничная выдача сервера (секция PAGE), 0 — без неё
+        string cursor;                   // курсор следующей страницы, пусто — первая страница
+        uint64_t randomSeed = 0;         // зерно рандомизации, 0 — случайное
+        double deadlineMs = 0;           // бюджет времени на оценку (секция DEADLINE), 0 — без ограничения
+    };
+
     // --- Функции для вычисления оценок рекомендаций ---
 
     // Функция вычисления косинусного сходства между профилем пользователя и произведением по тегам.
@@ -167,12 +235,14 @@ namespace RecSys {
     // Вход:
     //   - recs: исходный отсортированный список рекомендаций;
     //   - numRecommendations: требуемое число рекомендаций;
-    //   - randomFactor: доля случайных рекомендаций (например, 0.2 означает 20% случайных).
+    //   - randomFactor: доля случайных рекомендаций (например, 0.2 означает 20% случайных);
+    //   - seed: зерно перемешивания, 0 — случайное (при заданном выдача воспроизводима).
     // Выход: итоговый вектор пар (идентификатор работы, оценка).
     vector<pair<string, double>> getRandomizedRecommendations(
         const vector<pair<string, double>> &recs,
         int numRecommendations,
-        double randomFactor)
+        double randomFactor,
+        uint64_t seed = 0)
     {
         if (numRecommendations <= 0) return {};
         int numRandom = static_cast<int>(numRecommendations * randomFactor);
@@ -183,165 +253,7355 @@ namespace RecSys {
         for (size_t i = 0; i < static_cast<size_t>(numTop) && i < recs.size(); i++) {
             finalRecs.push_back(recs[i]);
         }
-        // Остальные рекомендации для случайного выбора.
-        vector<pair<string, double>> remaining;
-        for (int i = 0; i < numTop && i < static_cast<int>(recs.size()); i++) {
-            remaining.push_back(recs[i]);
-        }
+        // Остальные рекомендации (после первых numTop) для случайного выбора: частичное перемешивание
+        // номеров выбирает numRandom из них без повторов.
+        vector<size_t> remaining;
+        for (size_t i = static_cast<size_t>(numTop); i < recs.size(); i++) remaining.push_back(i);
         random_device rd;
-        mt19937 g(rd());
-        shuffle(remaining.begin(), remaining.end(), g);
-        for (int i = 0; i < numRandom && i < static_cast<int>(remaining.size()); i++) {
-            finalRecs.push_back(remaining[i]);
+        mt19937 g(seed != 0 ? static_cast<mt19937::result_type>(seed) : rd());
+        for (size_t i = 0; i < static_cast<size_t>(numRandom) && i < remaining.size(); i++) {
+            uniform_int_distribution<size_t> pick(i, remaining.size() - 1);
+            swap(remaining[i], remaining[pick(g)]);
+            finalRecs.push_back(recs[remaining[i]]);
         }
         shuffle(finalRecs.begin(), finalRecs.end(), g);
         return finalRecs;
     }
 
-} // namespace RecSys
+    // --- Сжатые множества номеров работ ---
+    //
+    // Множество 32‑битных номеров в духе Roaring: номера разбиты на блоки по старшим 16 битам, блок
+    // хранится отсортированным массивом младших половин (до kArrayLimit элементов) или битовой картой
+    // на 65536 бит. Небольшие списки исключений занимают несколько байт на работу, плотные (политики
+    // на большую часть каталога) — не больше 8 КиБ на блок; проверка — двоичный поиск блока и
+    // поиск в массиве или один бит.
+    class RoaringBitmap {
+    public:
+        void add(uint32_t x) {
+            uint16_t key = static_cast<uint16_t>(x >> 16), low = static_cast<uint16_t>(x);
+            auto it = lower_bound(containers.begin(), containers.end(), key,
+                                  [](const Container &c, uint16_t k) { return c.key < k; });
+            if (it == containers.end() || it->key != key) {
+                it = containers.insert(it, Container());
+                it->key = key;
+            }
+            Container &c = *it;
+            if (!c.bits.empty()) {
+                uint64_t bit = 1ULL << (low & 63);
+                if (!(c.bits[low >> 6] & bit)) {
+                    c.bits[low >> 6] |= bit;
+                    c.cardinality++;
+                }
+                return;
+            }
+            auto pos = lower_bound(c.array.begin(), c.array.end(), low);
+            if (pos != c.array.end() && *pos == low) return;
+            c.array.insert(pos, low);
+            c.cardinality++;
+            if (c.array.size() > kArrayLimit) {
+                c.bits.assign(1024, 0);
+                for (uint16_t v : c.array) c.bits[v >> 6] |= 1ULL << (v & 63);
+                vector<uint16_t>().swap(c.array);
+            }
+        }
 
-// --- Вспомогательная функция для удаления пробелов в начале и конце строки.
-string trim(const string &s) {
-    size_t start = s.find_first_not_of(" \t\r\n");
-    if (start == string::npos) return "";
-    size_t end = s.find_last_not_of(" \t\r\n");
-    return s.substr(start, end - start + 1);
-}
+        bool contains(uint32_t x) const {
+            uint16_t key = static_cast<uint16_t>(x >> 16), low = static_cast<uint16_t>(x);
+            auto it = lower_bound(containers.begin(), containers.end(), key,
+                                  [](const Container &c, uint16_t k) { return c.key < k; });
+            if (it == containers.end() || it->key != key) return false;
+            if (!it->bits.empty()) return (it->bits[low >> 6] >> (low & 63)) & 1;
+            return binary_search(it->array.begin(), it->array.end(), low);
+        }
 
-//
-// --- Основной блок чтения входных данных ---
-//
-// Формат входных данных (через стандартный ввод):
-//
-// USER_PROFILE
-// <число тегов пользователя>
-// Для каждого тега: <имя_тега> <значение>
-//
-// WORKS
-// <число произведений>
-// Для каждого произведения:
-//   <идентификатор работы>
-//   <число тегов>
-//   Для каждого тега: <имя_тега> <значение>
-//   <viewCount> <interactionTime>   (метрики – число просмотров и время взаимодействия)
-//
-// SIMILAR_USERS
-// <число похожих пользователей>
-// Для каждого похожего пользователя:
-//   <идентификатор пользователя>
-//   <коэффициент сходства>
-//   <число понравившихся работ>
-//   Для каждого: <идентификатор работы>
-//
-// PARAMS
-// <число рекомендаций> <random_factor>
-// METRICS_CONFIG
-// <use_metrics(0/1)> <weight_views> <weight_time> <weight_tags>
-//
+        bool empty() const { return containers.empty(); }
 
-int main() {
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
+        size_t size() const {
+            size_t total = 0;
+            for (const auto &c : containers) total += c.cardinality;
+            return total;
+        }
 
-    string line;
+    private:
+        static const size_t kArrayLimit = 4096;
+
+        struct Container {
+            uint16_t key = 0;
+            uint32_t cardinality = 0;
+            vector<uint16_t> array;      // отсортированные младшие половины (пока блок разрежен)
+            vector<uint64_t> bits;       // битовая карта 65536 бит (когда блок плотный)
+        };
+        vector<Container> containers;    // по возрастанию key
+    };
 
-    // Чтение секции USER_PROFILE
-    while(getline(cin, line)) {
-        if(trim(line) == "USER_PROFILE") break;
+    // Эталон фильтрации: удаление исключённых запросом работ из готового списка.
+    vector<pair<string, double>> removeExcluded(const vector<pair<string, double>> &recs,
+                                                const vector<string> &excluded) {
+        if (excluded.empty()) return recs;
+        unordered_set<string> skip(excluded.begin(), excluded.end());
+        vector<pair<string, double>> kept;
+        for (const auto &p : recs) {
+            if (!skip.count(p.first)) kept.push_back(p);
+        }
+        return kept;
     }
-    int numUserTags;
-    cin >> numUserTags;
-    vector<RecSys::Tag> userTags;
-    for (int i = 0; i < numUserTags; i++) {
-        string tagName;
-        double tagValue;
-        cin >> tagName >> tagValue;
-        userTags.push_back({tagName, tagValue});
+
+    // Эталон ограничений по тегам: есть все обязательные теги и нет запрещённых.
+    bool satisfiesTags(const Work &work, const vector<string> &required, const vector<string> &forbidden) {
+        auto has = [&](const string &name) {
+            for (const auto &tag : work.tags) {
+                if (tag.name == name) return true;
+            }
+            return false;
+        };
+        for (const auto &name : required) {
+            if (!has(name)) return false;
+        }
+        for (const auto &name : forbidden) {
+            if (has(name)) return false;
+        }
+        return true;
     }
-    RecSys::UserProfile userProfile { userTags };
 
-    // Чтение секции WORKS
-    while(getline(cin, line)) {
-        if(trim(line) == "WORKS") break;
+    // Эталон фильтрации по тегам: работы вне списка works (теги неизвестны) остаются, только если
+    // обязательных тегов нет.
+    vector<pair<string, double>> removeConstrained(const vector<pair<string, double>> &recs, const Request &request,
+                                                   const vector<Work> &works) {
+        if (request.requiredTags.empty() && request.forbiddenTags.empty()) return recs;
+        unordered_map<string, const Work *> byId;
+        for (const auto &work : works) byId.emplace(work.id, &work);
+        vector<pair<string, double>> kept;
+        for (const auto &p : recs) {
+            auto it = byId.find(p.first);
+            bool ok = it != byId.end() ? satisfiesTags(*it->second, request.requiredTags, request.forbiddenTags)
+                                       : request.requiredTags.empty();
+            if (ok) kept.push_back(p);
+        }
+        return kept;
     }
-    int numWorks;
-    cin >> numWorks;
-    vector<RecSys::Work> works;
-    for (int i = 0; i < numWorks; i++) {
-        string workId;
-        cin >> workId;
-        int numTags;
-        cin >> numTags;
-        vector<RecSys::Tag> tags;
-        for (int j = 0; j < numTags; j++) {
-            string tagName;
-            double tagValue;
-            cin >> tagName >> tagValue;
-            tags.push_back({tagName, tagValue});
-        }
-        double viewCount, interactionTime;
-        cin >> viewCount >> interactionTime;
-        works.push_back({workId, tags, viewCount, interactionTime});
-    }
-
-    // Чтение секции SIMILAR_USERS
-    while(getline(cin, line)) {
-        if(trim(line) == "SIMILAR_USERS") break;
-    }
-    int numSimilarUsers;
-    cin >> numSimilarUsers;
-    vector<RecSys::SimilarUser> similarUsers;
-    for (int i = 0; i < numSimilarUsers; i++) {
-        string simUserId;
-        cin >> simUserId;
-        double simWeight;
-        cin >> simWeight;
-        int numLiked;
-        cin >> numLiked;
-        vector<string> likedWorks;
-        for (int j = 0; j < numLiked; j++) {
-            string workId;
-            cin >> workId;
-            likedWorks.push_back(workId);
+
+    // Полный цикл получения рекомендаций для запроса по заданному каталогу произведений.
+    vector<pair<string, double>> recommend(const Request &request, const vector<Work> &works) {
+        // 1. Контент‑бейзед (с учетом тегов и метрик).
+        auto contentRecs = recommendContentBased(request.user, works, request.config);
+        // 2. Коллаборативная фильтрация.
+        auto collabRecs = recommendCollaborative(request.similarUsers);
+        // 3. Объединение рекомендаций (по умолчанию коэффициенты равные) без исключённых работ
+        //    и работ, не подходящих под ограничения по тегам.
+        auto combinedRecs = removeConstrained(removeExcluded(combineRecommendations(contentRecs, collabRecs,
+                                                                                    request.contentWeight,
+                                                                                    request.collabWeight),
+                                                             request.excludedWorks),
+                                              request, works);
+        // 4. Рандомизация итогового списка.
+        return getRandomizedRecommendations(combinedRecs, request.numRecommendations, request.randomFactor,
+                                            request.randomSeed);
+    }
+
+    // --- Индексированный каталог ---
+    //
+    // Для резидентного каталога имена тегов заменяются номерами один раз при загрузке:
+    // у каждой работы хранится разреженный вектор тегов и заранее посчитанная норма,
+    // для каждого тега — список работ, в которых он встречается (posting list, по возрастанию номера работы).
+    // Тогда скалярные произведения с профилем считаются проходом по спискам тегов пользователя,
+    // без сравнения строк и без обхода работ, не имеющих общих тегов с профилем.
+    struct Catalog {
+        vector<Work> works;                        // исходные произведения (id и метрики)
+        unordered_map<string, uint32_t> workIndex;  // id работы -> номер
+        unordered_map<string, uint32_t> tagIndex;   // имя тега -> номер
+        vector<string> tagNames;
+        vector<uint32_t> tagOffsets;               // теги работы i — [tagOffsets[i], tagOffsets[i + 1])
+        vector<uint32_t> tagIds;
+        vector<double> tagValues;
+        vector<double> norms;                      // норма вектора тегов работы
+        vector<uint32_t> postingOffsets;           // работы тега t — [postingOffsets[t], postingOffsets[t + 1])
+        vector<uint32_t> postingWorks;
+        vector<double> postingValues;              // значение тега t у соответствующей работы
+        vector<uint32_t> impactWorks;              // те же списки, упорядоченные по убыванию вклада value / norm
+        vector<double> normViews;                  // viewCount / maxViews — общий для всех пользователей столбец
+        vector<double> normTimes;                  // interactionTime / maxTime
+        vector<uint32_t> popularWorks;             // до kPopularPrefix работ по убыванию просмотров
+        vector<uint64_t> simhashes;                // 64-битный SimHash вектора тегов работы
+        vector<uint32_t> primaryTags;              // тег с наибольшим весом у работы, UINT32_MAX — без тегов
+        vector<uint32_t> staticOrder;              // все работы по убыванию просмотров (априорная популярность)
+        vector<double> blockMaxViews;              // наибольшие normViews и normTimes в блоках staticOrder
+        vector<double> blockMaxTimes;              // по kStaticBlock работ (границы для оценки с дедлайном)
+        RoaringBitmap blocked;                     // работы, запрещённые политикой (blockWorks)
+        double maxViews = 0;
+        double maxTime = 0;
+    };
+
+    // Сколько самых просматриваемых работ хранит popularWorks (для генератора популярных кандидатов).
+    const size_t kPopularPrefix = 65536;
+    // Размер блока staticOrder: между блоками оценка с дедлайном проверяет время.
+    const size_t kStaticBlock = 1024;
+
+    // 64-битный хеш имени тега для SimHash: FNV-1a с перемешиванием splitmix64, не зависит от реализации
+    // std::hash, так что подписи одинаковы во всех сборках.
+    uint64_t tagHash(const string &name) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (unsigned char c : name) h = (h ^ c) * 0x100000001b3ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+
+    // SimHash работы: каждый тег добавляет свой вес к разрядам, где его хеш равен 1, и вычитает там,
+    // где 0; разряд подписи — знак суммы. Близкие векторы тегов дают подписи с малым расстоянием Хэмминга.
+    uint64_t simhash(const uint32_t *tagIds, const double *tagValues, size_t count, const vector<uint64_t> &hashes) {
+        double sums[64] = {};
+        for (size_t j = 0; j < count; j++) {
+            uint64_t h = hashes[tagIds[j]];
+            for (int b = 0; b < 64; b++) sums[b] += ((h >> b) & 1) ? tagValues[j] : -tagValues[j];
+        }
+        uint64_t signature = 0;
+        for (int b = 0; b < 64; b++) {
+            if (sums[b] > 0) signature |= 1ULL << b;
+        }
+        return signature;
+    }
+
+    Catalog buildCatalog(vector<Work> works) {
+        Catalog catalog;
+        catalog.works = move(works);
+        size_t n = catalog.works.size();
+        catalog.tagOffsets.reserve(n + 1);
+        catalog.tagOffsets.push_back(0);
+        catalog.norms.reserve(n);
+        for (uint32_t i = 0; i < n; i++) {
+            const Work &work = catalog.works[i];
+            catalog.workIndex.emplace(work.id, i);
+            if (work.viewCount > catalog.maxViews) catalog.maxViews = work.viewCount;
+            if (work.interactionTime > catalog.maxTime) catalog.maxTime = work.interactionTime;
+            double norm = 0;
+            for (const auto &tag : work.tags) {
+                auto it = catalog.tagIndex.emplace(tag.name, static_cast<uint32_t>(catalog.tagNames.size())).first;
+                if (it->second == catalog.tagNames.size()) catalog.tagNames.push_back(tag.name);
+                catalog.tagIds.push_back(it->second);
+                catalog.tagValues.push_back(tag.value);
+                norm += tag.value * tag.value;
+            }
+            catalog.tagOffsets.push_back(static_cast<uint32_t>(catalog.tagIds.size()));
+            catalog.norms.push_back(sqrt(norm));
+        }
+        catalog.normViews.reserve(n);
+        catalog.normTimes.reserve(n);
+        for (const auto &work : catalog.works) {
+            catalog.normViews.push_back((catalog.maxViews > 0) ? work.viewCount / catalog.maxViews : 0);
+            catalog.normTimes.push_back((catalog.maxTime > 0) ? work.interactionTime / catalog.maxTime : 0);
+        }
+        catalog.staticOrder.resize(n);
+        for (uint32_t i = 0; i < n; i++) catalog.staticOrder[i] = i;
+        sort(catalog.staticOrder.begin(), catalog.staticOrder.end(), [&](uint32_t a, uint32_t b) {
+            return catalog.normViews[a] != catalog.normViews[b] ? catalog.normViews[a] > catalog.normViews[b] : a < b;
+        });
+        catalog.popularWorks.assign(catalog.staticOrder.begin(), catalog.staticOrder.begin() + min(n, kPopularPrefix));
+        for (size_t begin = 0; begin < n; begin += kStaticBlock) {
+            double maxViews = 0, maxTime = 0;
+            for (size_t j = begin; j < min(n, begin + kStaticBlock); j++) {
+                maxViews = max(maxViews, catalog.normViews[catalog.staticOrder[j]]);
+                maxTime = max(maxTime, catalog.normTimes[catalog.staticOrder[j]]);
+            }
+            catalog.blockMaxViews.push_back(maxViews);
+            catalog.blockMaxTimes.push_back(maxTime);
         }
-        similarUsers.push_back({simUserId, simWeight, likedWorks});
+        vector<uint64_t> hashes;
+        hashes.reserve(catalog.tagNames.size());
+        for (const auto &name : catalog.tagNames) hashes.push_back(tagHash(name));
+        catalog.simhashes.resize(n);
+        catalog.primaryTags.assign(n, UINT32_MAX);
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t begin = catalog.tagOffsets[i];
+            catalog.simhashes[i] = simhash(&catalog.tagIds[begin], &catalog.tagValues[begin],
+                                           catalog.tagOffsets[i + 1] - begin, hashes);
+            uint32_t best = begin;
+            for (uint32_t j = begin + 1; j < catalog.tagOffsets[i + 1]; j++) {
+                if (catalog.tagValues[j] > catalog.tagValues[best]) best = j;
+            }
+            if (best < catalog.tagOffsets[i + 1]) catalog.primaryTags[i] = catalog.tagIds[best];
+        }
+        // Posting lists подсчётом: работы перебираются по возрастанию, поэтому списки уже отсортированы.
+        size_t numTags = catalog.tagNames.size();
+        catalog.postingOffsets.assign(numTags + 1, 0);
+        for (uint32_t t : catalog.tagIds) catalog.postingOffsets[t + 1]++;
+        for (size_t t = 0; t < numTags; t++) catalog.postingOffsets[t + 1] += catalog.postingOffsets[t];
+        catalog.postingWorks.resize(catalog.tagIds.size());
+        catalog.postingValues.resize(catalog.tagIds.size());
+        vector<uint32_t> fill(catalog.postingOffsets.begin(), catalog.postingOffsets.end() - 1);
+        for (uint32_t i = 0; i < n; i++) {
+            for (uint32_t j = catalog.tagOffsets[i]; j < catalog.tagOffsets[i + 1]; j++) {
+                uint32_t pos = fill[catalog.tagIds[j]]++;
+                catalog.postingWorks[pos] = i;
+                catalog.postingValues[pos] = catalog.tagValues[j];
+            }
+        }
+        // Порядок по вкладу в косинус: первые работы списка дают наибольшее слагаемое скалярного произведения.
+        catalog.impactWorks = catalog.postingWorks;
+        for (size_t t = 0; t < numTags; t++) {
+            vector<pair<double, uint32_t>> order;
+            for (uint32_t p = catalog.postingOffsets[t]; p < catalog.postingOffsets[t + 1]; p++) {
+                uint32_t w = catalog.postingWorks[p];
+                double norm = catalog.norms[w];
+                order.push_back({ norm > 0 ? catalog.postingValues[p] / norm : 0, w });
+            }
+            stable_sort(order.begin(), order.end(), [](auto &a, auto &b) { return a.first > b.first; });
+            for (size_t j = 0; j < order.size(); j++) catalog.impactWorks[catalog.postingOffsets[t] + j] = order[j].second;
+        }
+        return catalog;
     }
 
-    // Чтение секции PARAMS
-    while(getline(cin, line)) {
-        if(trim(line) == "PARAMS") break;
+    // --- Пересечение posting lists ---
+    //
+    // Списки отсортированы по возрастанию номера работы (работа с повторённым тегом встречается дважды,
+    // повторы в результате отбрасываются). Сильно различающиеся по длине списки пересекаются галопом:
+    // для каждого элемента короткого списка экспоненциальный, затем двоичный поиск в длинном от
+    // предыдущей позиции — O(m log(n / m)). Близкие по длине — слиянием, где длинный список
+    // пропускается блоками по 4 элемента и сравнивается одной SSE2-инструкцией.
+
+    // Во сколько раз длинный список должен превосходить короткий, чтобы выбрать галоп.
+    const size_t kGallopRatio = 32;
+
+    void intersectGalloping(const uint32_t *small, size_t m, const uint32_t *large, size_t n, vector<uint32_t> &out) {
+        size_t pos = 0;
+        for (size_t i = 0; i < m && pos < n; i++) {
+            uint32_t x = small[i];
+            if (i > 0 && x == small[i - 1]) continue;
+            size_t step = 1, hi = pos;
+            while (hi < n && large[hi] < x) {
+                pos = hi + 1;
+                hi += step;
+                step *= 2;
+            }
+            pos = static_cast<size_t>(lower_bound(large + pos, large + min(hi + 1, n), x) - large);
+            if (pos < n && large[pos] == x) out.push_back(x);
+        }
     }
-    int numRecommendations;
-    double randomFactor;
-    cin >> numRecommendations >> randomFactor;
 
-    // Чтение секции METRICS_CONFIG
-    while(getline(cin, line)) {
-        if(trim(line) == "METRICS_CONFIG") break;
+    void intersectMerge(const uint32_t *a, size_t m, const uint32_t *b, size_t n, vector<uint32_t> &out) {
+        size_t j = 0;
+        for (size_t i = 0; i < m && j < n; i++) {
+            uint32_t x = a[i];
+            if (i > 0 && x == a[i - 1]) continue;
+#ifdef __SSE2__
+            // Пропуск блоков b, целиком меньших x; затем сравнение x сразу с четырьмя элементами.
+            while (j + 4 <= n && b[j + 3] < x) j += 4;
+            if (j + 4 <= n) {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi32(block, _mm_set1_epi32(static_cast<int>(x))))) out.push_back(x);
+                while (j < n && b[j] < x) j++;
+                continue;
+            }
+#endif
+            while (j < n && b[j] < x) j++;
+            if (j < n && b[j] == x) out.push_back(x);
+        }
     }
-    int useMetricsInt;
-    double weightViews, weightTime, weightTags;
-    cin >> useMetricsInt >> weightViews >> weightTime >> weightTags;
-    RecSys::MetricsConfig metricsConfig { useMetricsInt != 0, weightViews, weightTime, weightTags };
 
-    // Получение рекомендаций:
-    // 1. Контент‑бейзед (с учетом тегов и метрик).
-    auto contentRecs = RecSys::recommendContentBased(userProfile, works, metricsConfig);
-    // 2. Коллаборативная фильтрация.
-    auto collabRecs = RecSys::recommendCollaborative(similarUsers);
-    // 3. Объединение рекомендаций (коэффициенты задаются равномерно для примера).
-    auto combinedRecs = RecSys::combineRecommendations(contentRecs, collabRecs, 0.5, 0.5);
-    // 4. Рандомизация итогового списка.
-    auto finalRecs = RecSys::getRandomizedRecommendations(combinedRecs, numRecommendations, randomFactor);
+    // Пересечение двух отсортированных списков с выбором способа по соотношению длин.
+    void intersectSorted(const uint32_t *a, size_t m, const uint32_t *b, size_t n, vector<uint32_t> &out) {
+        out.clear();
+        if (m > n) {
+            swap(a, b);
+            swap(m, n);
+        }
+        if (n > m * kGallopRatio) intersectGalloping(a, m, b, n, out);
+        else intersectMerge(a, m, b, n, out);
+    }
 
-    // Вывод результата в формате JSON.
-    cout << "{\n  \"recommendations\": [\n";
-    for (size_t i = 0; i < finalRecs.size(); i++) {
-        cout << "    { \"id\": \"" << finalRecs[i].first << "\", \"score\": " << finalRecs[i].second << " }";
-        if(i < finalRecs.size() - 1) cout << ",";
-        cout << "\n";
+    // Работы, у которых есть все теги tagIds: пересечение списков от самого короткого к длинным,
+    // время пропорционально длине самого короткого списка и размеру промежуточных пересечений.
+    vector<uint32_t> worksWithAllTags(const Catalog &catalog, vector<uint32_t> tagIds) {
+        auto length = [&](uint32_t t) { return catalog.postingOffsets[t + 1] - catalog.postingOffsets[t]; };
+        sort(tagIds.begin(), tagIds.end(), [&](uint32_t a, uint32_t b) { return length(a) < length(b); });
+        vector<uint32_t> result, next;
+        if (tagIds.empty()) return result;
+        const uint32_t *first = catalog.postingWorks.data() + catalog.postingOffsets[tagIds[0]];
+        for (uint32_t j = 0; j < length(tagIds[0]); j++) {
+            if (j == 0 || first[j] != first[j - 1]) result.push_back(first[j]);
+        }
+        for (size_t t = 1; t < tagIds.size() && !result.empty(); t++) {
+            intersectSorted(result.data(), result.size(),
+                            catalog.postingWorks.data() + catalog.postingOffsets[tagIds[t]], length(tagIds[t]), next);
+            result.swap(next);
+        }
+        return result;
+    }
+
+    // Запрет работ политикой: они исключаются из всех запросов к каталогу. Неизвестные идентификаторы пропускаются.
+    void blockWorks(Catalog &catalog, const vector<string> &ids) {
+        for (const auto &id : ids) {
+            auto it = catalog.workIndex.find(id);
+            if (it != catalog.workIndex.end()) catalog.blocked.add(it->second);
+        }
+    }
+
+    // Массив в анонимной разделяемой памяти: процессы, порождённые fork после его создания, видят и меняют
+    // одни и те же элементы. Элементы — атомарные счётчики и им подобные, память изначально обнулена.
+    template <typename T>
+    class SharedArray {
+    public:
+        explicit SharedArray(size_t count) : bytes(max<size_t>(count * sizeof(T), 1)) {
+            void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) throw bad_alloc();
+            items = static_cast<T *>(p);
+        }
+        ~SharedArray() { munmap(items, bytes); }
+        SharedArray(const SharedArray &) = delete;
+        SharedArray &operator=(const SharedArray &) = delete;
+
+        T &operator[](size_t i) const { return items[i]; }
+
+    private:
+        T *items;
+        size_t bytes;
+    };
+
+    // --- История показов для ограничения частоты ---
+    //
+    // Хранилище фиксированного размера: пользователь по хешу идентификатора попадает в один из slots
+    // слотов, у слота windows окон-фильтров Блума по bitsPerWindow бит. Окно покрывает windowSeconds
+    // секунд; окно с номером эпохи e лежит в ячейке e % windows и при первой записи новой эпохи
+    // очищается (ротация), так что помнятся показы за последние windows окон. Память — slots * windows *
+    // (bitsPerWindow / 8 + 4) байт независимо от числа пользователей; пользователи с общим слотом делят
+    // фильтры (это лишь повышает долю ложных срабатываний).
+    // Запись и чтение без блокировок: биты ставятся атомарным fetch_or, ротацию выполняет поток,
+    // выигравший compare_exchange метки эпохи. Показ, записанный одновременно с очисткой своего окна,
+    // может потеряться — для ограничения частоты это допустимо.
+    // Фильтры лежат в разделяемой памяти, поэтому процессы пре-форк сервера пишут и читают одну историю.
+    class ImpressionStore {
+    public:
+        ImpressionStore(size_t slots, int windows, uint32_t windowSeconds, int bitsPerWindow = 512, int hashes = 3)
+            : slots(max<size_t>(slots, 1)), windows(max(windows, 1)), windowSeconds(max<uint32_t>(windowSeconds, 1)),
+              words(static_cast<size_t>(max(bitsPerWindow, 64)) / 64), hashes(max(hashes, 1)),
+              bits(this->slots * this->windows * words), epochs(this->slots * this->windows) {
+            for (size_t i = 0; i < this->slots * this->windows * words; i++) bits[i].store(0, memory_order_relaxed);
+            for (size_t i = 0; i < this->slots * this->windows; i++) epochs[i].store(kNoEpoch, memory_order_relaxed);
+        }
+
+        // Показы одного пользователя на момент запроса: проверка работы — только чтение битов.
+        class History {
+        public:
+            bool contains(uint32_t work) const {
+                if (!store) return false;
+                for (int w = 0; w < store->windows; w++) {
+                    size_t window = slot * store->windows + w;
+                    uint32_t tag = store->epochs[window].load(memory_order_acquire);
+                    if (tag == kNoEpoch || tag > epoch || epoch - tag >= static_cast<uint32_t>(store->windows)) continue;
+                    if (store->test(window, userHash, work)) return true;
+                }
+                return false;
+            }
+            bool empty() const { return store == nullptr; }
+
+        private:
+            friend class ImpressionStore;
+            const ImpressionStore *store = nullptr;
+            size_t slot = 0;
+            uint64_t userHash = 0;
+            uint32_t epoch = 0;
+        };
+
+        History history(const string &userId, uint64_t nowSeconds) const {
+            History h;
+            if (userId.empty()) return h;
+            h.store = this;
+            h.userHash = hashString(userId);
+            h.slot = h.userHash % slots;
+            h.epoch = static_cast<uint32_t>(nowSeconds / windowSeconds);
+            return h;
+        }
+
+        void record(const string &userId, uint32_t work, uint64_t nowSeconds) {
+            if (userId.empty()) return;
+            uint64_t userHash = hashString(userId);
+            uint32_t epoch = static_cast<uint32_t>(nowSeconds / windowSeconds);
+            size_t window = (userHash % slots) * windows + epoch % windows;
+            uint32_t tag = epochs[window].load(memory_order_acquire);
+            if (tag != epoch && (tag == kNoEpoch || tag < epoch) &&
+                epochs[window].compare_exchange_strong(tag, epoch, memory_order_acq_rel)) {
+                for (size_t j = 0; j < words; j++) bits[window * words + j].store(0, memory_order_relaxed);
+            }
+            uint64_t h1, h2;
+            positions(userHash, work, h1, h2);
+            for (int i = 0; i < hashes; i++) {
+                uint64_t bit = (h1 + i * h2) % (words * 64);
+                bits[window * words + bit / 64].fetch_or(1ULL << (bit % 64), memory_order_relaxed);
+            }
+        }
+
+        size_t memoryBytes() const { return slots * windows * (words * 8 + 4); }
+
+    private:
+        static const uint32_t kNoEpoch = UINT32_MAX;
+
+        static uint64_t mix(uint64_t x) {
+            x += 0x9e3779b97f4a7c15ULL;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        }
+        static uint64_t hashString(const string &s) { return mix(hash<string>()(s)); }
+
+        // Двойное хеширование: позиции h1 + i * h2 (h2 нечётный).
+        static void positions(uint64_t userHash, uint32_t work, uint64_t &h1, uint64_t &h2) {
+            h1 = mix(userHash ^ work);
+            h2 = mix(h1) | 1;
+        }
+
+        bool test(size_t window, uint64_t userHash, uint32_t work) const {
+            uint64_t h1, h2;
+            positions(userHash, work, h1, h2);
+            for (int i = 0; i < hashes; i++) {
+                uint64_t bit = (h1 + i * h2) % (words * 64);
+                if (!((bits[window * words + bit / 64].load(memory_order_relaxed) >> (bit % 64)) & 1)) return false;
+            }
+            return true;
+        }
+
+        size_t slots;
+        int windows;
+        uint32_t windowSeconds;
+        size_t words;
+        int hashes;
+        SharedArray<atomic<uint64_t>> bits;        // [слот][окно][слово]
+        SharedArray<atomic<uint32_t>> epochs;      // эпоха, которую хранит окно
+    };
+
+    // Учёт истории показов в запросе: недавно показанные работы исключаются (demote == 0) или их итоговая
+    // оценка умножается на demote.
+    struct ImpressionPolicy {
+        const ImpressionStore *store = nullptr;
+        double demote = 0;
+        uint64_t nowSeconds = 0;
+    };
+
+    // Исключения одного запроса: его список EXCLUDE в номерах каталога плюс запреты каталога
+    // и, если задана политика показов с исключением, недавние показы пользователя.
+    // Проверяются при отборе, до того как работа займёт место в выдаче, поэтому top-k заполняется за один проход.
+    struct Exclusions {
+        RoaringBitmap works;                 // исключённые запросом работы каталога
+        unordered_set<string> outside;       // исключённые идентификаторы вне каталога
+        const RoaringBitmap *blocked = nullptr;
+        ImpressionStore::History shown;      // недавние показы (пусто, если политика их не исключает)
+        bool constrained = false;            // заданы обязательные теги: допустимы только работы allowedList
+        vector<uint32_t> allowedList;        // пересечение списков обязательных тегов, по возрастанию
+        RoaringBitmap allowed;               // то же множество для проверки по номеру
+        bool any = false;
+
+        bool excluded(uint32_t i) const {
+            return any && (works.contains(i) || blocked->contains(i) || shown.contains(i) ||
+                           (constrained && !allowed.contains(i)));
+        }
+        // Работа вне каталога: её теги неизвестны, поэтому при обязательных тегах она исключается.
+        bool excludedOutside(const string &id) const {
+            return constrained || outside.count(id) > 0;
+        }
+        bool excludedId(const Catalog &catalog, const string &id) const {
+            if (!any) return false;
+            auto it = catalog.workIndex.find(id);
+            return it != catalog.workIndex.end() ? excluded(it->second) : excludedOutside(id);
+        }
+    };
+
+    Exclusions buildExclusions(const Request &request, const Catalog &catalog,
+                               const ImpressionPolicy *impressions = nullptr) {
+        Exclusions exclusions;
+        exclusions.blocked = &catalog.blocked;
+        if (impressions && impressions->store && impressions->demote == 0) {
+            exclusions.shown = impressions->store->history(request.userId, impressions->nowSeconds);
+        }
+        for (const auto &id : request.excludedWorks) {
+            auto it = catalog.workIndex.find(id);
+            if (it != catalog.workIndex.end()) exclusions.works.add(it->second);
+            else exclusions.outside.insert(id);
+        }
+        // Запрещённые теги — все работы их списков; обязательные — пересечение списков.
+        for (const auto &name : request.forbiddenTags) {
+            auto it = catalog.tagIndex.find(name);
+            if (it == catalog.tagIndex.end()) continue;
+            for (uint32_t p = catalog.postingOffsets[it->second]; p < catalog.postingOffsets[it->second + 1]; p++) {
+                exclusions.works.add(catalog.postingWorks[p]);
+            }
+        }
+        if (!request.requiredTags.empty()) {
+            exclusions.constrained = true;
+            vector<uint32_t> tagIds;
+            bool unknown = false;
+            for (const auto &name : request.requiredTags) {
+                auto it = catalog.tagIndex.find(name);
+                if (it == catalog.tagIndex.end()) unknown = true;
+                else tagIds.push_back(it->second);
+            }
+            if (!unknown) exclusions.allowedList = worksWithAllTags(catalog, tagIds);
+            for (uint32_t i : exclusions.allowedList) exclusions.allowed.add(i);
+        }
+        exclusions.any = !request.excludedWorks.empty() || !catalog.blocked.empty() || !exclusions.shown.empty() ||
+                         !request.forbiddenTags.empty() || exclusions.constrained;
+        return exclusions;
+    }
+
+    // Понижение недавно показанных работ (политика с demote > 0): оценка умножается на demote,
+    // список пересортировывается с сохранением порядка равных.
+    void demoteShown(const Request &request, const Catalog &catalog, const ImpressionPolicy *impressions,
+                     vector<pair<string, double>> &recs) {
+        if (!impressions || !impressions->store || impressions->demote == 0 || request.userId.empty()) return;
+        auto shown = impressions->store->history(request.userId, impressions->nowSeconds);
+        bool changed = false;
+        for (auto &p : recs) {
+            auto it = catalog.workIndex.find(p.first);
+            if (it != catalog.workIndex.end() && shown.contains(it->second)) {
+                p.second *= impressions->demote;
+                changed = true;
+            }
+        }
+        if (changed) stable_sort(recs.begin(), recs.end(), [](auto &a, auto &b) { return a.second > b.second; });
+    }
+
+    // Профиль пользователя в номерах тегов каталога.
+    // Как и в cosineSimilarity, при повторе тега учитывается первое вхождение, а норма — по всем тегам профиля.
+    // Теги, которых нет в каталоге, влияют только на норму.
+    struct UserVector {
+        vector<uint32_t> tagIds;
+        vector<double> values;
+        double norm = 0;
+    };
+
+    UserVector buildUserVector(const UserProfile &user, const Catalog &catalog) {
+        UserVector vec;
+        for (const auto &tag : user.tags) {
+            vec.norm += tag.value * tag.value;
+            auto it = catalog.tagIndex.find(tag.name);
+            if (it == catalog.tagIndex.end()) continue;
+            if (find(vec.tagIds.begin(), vec.tagIds.end(), it->second) != vec.tagIds.end()) continue;
+            vec.tagIds.push_back(it->second);
+            vec.values.push_back(tag.value);
+        }
+        vec.norm = sqrt(vec.norm);
+        return vec;
+    }
+
+    // Позиции тегов профиля в порядке убывания вклада — модуля веса: тег с отрицательным весом сдвигает
+    // оценку так же сильно, как положительный. Общий порядок приближённого поиска и генератора кандидатов.
+    vector<size_t> profileTagOrder(const UserVector &vec) {
+        vector<size_t> order(vec.tagIds.size());
+        for (size_t u = 0; u < order.size(); u++) order[u] = u;
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return fabs(vec.values[a]) > fabs(vec.values[b]);
+        });
+        return order;
+    }
+
+    // Скалярные произведения профиля со всеми работами каталога через posting lists.
+    void accumulateDots(const UserVector &user, const Catalog &catalog, vector<double> &dots) {
+        dots.assign(catalog.works.size(), 0.0);
+        for (size_t u = 0; u < user.tagIds.size(); u++) {
+            uint32_t t = user.tagIds[u];
+            double value = user.values[u];
+            for (uint32_t p = catalog.postingOffsets[t]; p < catalog.postingOffsets[t + 1]; p++) {
+                dots[catalog.postingWorks[p]] += value * catalog.postingValues[p];
+            }
+        }
+    }
+
+    // Оценка работы i по заранее посчитанному скалярному произведению — то же, что computeWorkScore.
+    double indexedWorkScore(const Catalog &catalog, uint32_t i, double dot, double userNorm,
+                            const MetricsConfig &config) {
+        double cosine = (userNorm == 0 || catalog.norms[i] == 0) ? 0 : dot / (userNorm * catalog.norms[i]);
+        double score = config.weightTags * cosine;
+        if (config.useMetrics) {
+            score += config.weightViews * catalog.normViews[i] + config.weightTime * catalog.normTimes[i];
+        }
+        return score;
+    }
+
+    // Контент‑бейзед рекомендации по индексированному каталогу.
+    // Результат совпадает с recommendContentBased с точностью до порядка суммирования.
+    // Исключённые работы (exclusions) не оцениваются и в результат не попадают.
+    vector<pair<string, double>> recommendContentBasedIndexed(const UserProfile &user, const Catalog &catalog,
+                                                               const MetricsConfig &config,
+                                                               const Exclusions *exclusions = nullptr) {
+        UserVector vec = buildUserVector(user, catalog);
+        vector<double> dots;
+        accumulateDots(vec, catalog, dots);
+        vector<pair<string, double>> recs;
+        recs.reserve(catalog.works.size());
+        for (uint32_t i = 0; i < catalog.works.size(); i++) {
+            if (exclusions && exclusions->excluded(i)) continue;
+            recs.push_back({catalog.works[i].id, indexedWorkScore(catalog, i, dots[i], vec.norm, config)});
+        }
+        sort(recs.begin(), recs.end(), [](auto &a, auto &b) {
+            return a.second > b.second;
+        });
+        return recs;
+    }
+
+    // Скалярное произведение профиля с одной работой по её вектору тегов (для точной переоценки кандидатов).
+    double workDot(const UserVector &user, const Catalog &catalog, uint32_t i) {
+        double dot = 0;
+        for (uint32_t j = catalog.tagOffsets[i]; j < catalog.tagOffsets[i + 1]; j++) {
+            for (size_t u = 0; u < user.tagIds.size(); u++) {
+                if (user.tagIds[u] == catalog.tagIds[j]) {
+                    dot += user.values[u] * catalog.tagValues[j];
+                    break;
+                }
+            }
+        }
+        return dot;
+    }
+
+    // Параметры приближённого контентного поиска (0 — без ограничения).
+    struct ApproxParams {
+        int maxProfileTags = 0;      // сколько самых весомых тегов профиля порождают кандидатов
+        int maxPostingsPerTag = 0;   // сколько работ с наибольшим вкладом брать из списка каждого тега
+    };
+
+    // Приближённые контентные рекомендации: кандидаты — начала упорядоченных по вкладу списков
+    // самых весомых тегов профиля, каждый кандидат оценивается точно по полному профилю.
+    // Работы без общих тегов с урезанным профилем не рассматриваются. Возвращает не больше k лучших.
+    vector<pair<string, double>> recommendContentBasedApprox(const UserProfile &user, const Catalog &catalog,
+                                                              const MetricsConfig &config, int k,
+                                                              const ApproxParams &params) {
+        UserVector vec = buildUserVector(user, catalog);
+        vector<size_t> order = profileTagOrder(vec);
+        if (params.maxProfileTags > 0 && order.size() > static_cast<size_t>(params.maxProfileTags)) {
+            order.resize(params.maxProfileTags);
+        }
+        vector<uint32_t> candidates;
+        for (size_t u : order) {
+            uint32_t t = vec.tagIds[u];
+            uint32_t begin = catalog.postingOffsets[t], end = catalog.postingOffsets[t + 1];
+            if (params.maxPostingsPerTag > 0) end = min(end, begin + static_cast<uint32_t>(params.maxPostingsPerTag));
+            candidates.insert(candidates.end(), catalog.impactWorks.begin() + begin, catalog.impactWorks.begin() + end);
+        }
+        sort(candidates.begin(), candidates.end());
+        candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+        vector<pair<string, double>> recs;
+        recs.reserve(candidates.size());
+        for (uint32_t i : candidates) {
+            recs.push_back({catalog.works[i].id, indexedWorkScore(catalog, i, workDot(vec, catalog, i), vec.norm, config)});
+        }
+        size_t top = min(recs.size(), static_cast<size_t>(max(k, 0)));
+        partial_sort(recs.begin(), recs.begin() + top, recs.end(), [](auto &a, auto &b) {
+            return a.second > b.second;
+        });
+        recs.resize(top);
+        return recs;
+    }
+
+    // --- Пакетный режим и перебор конфигураций ---
+    //
+    // Итоговая оценка линейна по трём компонентам контентной части (косинус, нормированные просмотры и время)
+    // и коллаборативной сумме:
+    //   combined = contentWeight * (weightTags * cosine + weightViews * normViews + weightTime * normTime)
+    //            + collabWeight * collab.
+    // Поэтому для пользователя компоненты считаются один раз в столбцы по номерам работ (просмотры и время —
+    // общие столбцы каталога), а затем top-k строится для любого числа конфигураций весов за один проход
+    // по каталогу блоками: для каждого блока и каждой конфигурации — линейная комбинация и обновление кучи top-k.
+    // Полный список пар (id, оценка) при этом не строится.
+
+    // Одна конфигурация весов.
+    struct SweepConfig {
+        MetricsConfig metrics;
+        double contentWeight = 0.5;
+        double collabWeight = 0.5;
+    };
+
+    // Столбцы компонент оценки одного пользователя.
+    struct ComponentColumns {
+        vector<double> cosine;                      // косинус профиля с работой i
+        vector<double> collab;                      // сумма сходств похожих пользователей, лайкнувших работу i
+        vector<pair<string, double>> outside;       // работы вне каталога из лайков (только коллаборативная часть)
+        Exclusions exclusions;                      // исключения запроса; outside уже отфильтрован
+    };
+
+    // Рабочие буферы одного потока, переиспользуемые между запросами.
+    struct ScoringScratch {
+        vector<double> dots;
+        ComponentColumns columns;
+        vector<double> block;
+        vector<vector<pair<double, uint32_t>>> heaps;
+        vector<uint32_t> order;
+    };
+
+    void computeComponents(const Request &request, const Catalog &catalog, ScoringScratch &scratch) {
+        size_t n = catalog.works.size();
+        UserVector vec = buildUserVector(request.user, catalog);
+        accumulateDots(vec, catalog, scratch.dots);
+        auto &columns = scratch.columns;
+        columns.cosine.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            double norm = catalog.norms[i];
+            columns.cosine[i] = (vec.norm == 0 || norm == 0) ? 0 : scratch.dots[i] / (vec.norm * norm);
+        }
+        // Как в recommendCollaborative: сначала сумма сходств по работе, вес применяется позже.
+        columns.collab.assign(n, 0.0);
+        columns.outside.clear();
+        columns.exclusions = buildExclusions(request, catalog);
+        for (const auto &p : recommendCollaborative(request.similarUsers)) {
+            auto it = catalog.workIndex.find(p.first);
+            if (it != catalog.workIndex.end()) columns.collab[it->second] = p.second;
+            else if (!columns.exclusions.excludedOutside(p.first)) columns.outside.push_back(p);
+        }
+    }
+
+    // Объединённые оценки работ [begin, begin + len) по столбцам при одной конфигурации весов.
+    void combineColumns(const Catalog &catalog, const ComponentColumns &columns, const SweepConfig &config,
+                        size_t begin, size_t len, double *out) {
+        const double *cosine = columns.cosine.data() + begin;
+        const double *views = catalog.normViews.data() + begin;
+        const double *times = catalog.normTimes.data() + begin;
+        const double *collab = columns.collab.data() + begin;
+        double wTags = config.metrics.weightTags;
+        double wViews = config.metrics.useMetrics ? config.metrics.weightViews : 0;
+        double wTime = config.metrics.useMetrics ? config.metrics.weightTime : 0;
+        double cw = config.contentWeight, lw = config.collabWeight;
+        // Линейная комбинация без ветвлений — компилятор векторизует цикл.
+        for (size_t i = 0; i < len; i++) {
+            out[i] = cw * (wTags * cosine[i] + (wViews * views[i] + wTime * times[i])) + lw * collab[i];
+        }
+    }
+
+    // top-k для каждой конфигурации по уже посчитанным столбцам.
+    vector<vector<pair<string, double>>> rankColumns(const Catalog &catalog, const vector<SweepConfig> &configs,
+                                                     int k, ScoringScratch &scratch) {
+        const size_t kBlock = 4096;
+        size_t n = catalog.works.size();
+        size_t top = static_cast<size_t>(max(k, 0));
+        const auto &columns = scratch.columns;
+        auto minFirst = [](const pair<double, uint32_t> &a, const pair<double, uint32_t> &b) {
+            return a.first > b.first;
+        };
+        scratch.heaps.resize(configs.size());
+        for (auto &heap : scratch.heaps) heap.clear();
+        scratch.block.resize(kBlock);
+        double *block = scratch.block.data();
+        for (size_t begin = 0; begin < n && top > 0; begin += kBlock) {
+            size_t len = min(kBlock, n - begin);
+            for (size_t c = 0; c < configs.size(); c++) {
+                combineColumns(catalog, columns, configs[c], begin, len, block);
+                // Исключения проверяются только для работ, которые иначе заняли бы место в куче.
+                auto &heap = scratch.heaps[c];
+                for (size_t i = 0; i < len; i++) {
+                    if (heap.size() < top) {
+                        if (columns.exclusions.excluded(static_cast<uint32_t>(begin + i))) continue;
+                        heap.push_back({ block[i], static_cast<uint32_t>(begin + i) });
+                        push_heap(heap.begin(), heap.end(), minFirst);
+                    } else if (block[i] > heap.front().first) {
+                        if (columns.exclusions.excluded(static_cast<uint32_t>(begin + i))) continue;
+                        pop_heap(heap.begin(), heap.end(), minFirst);
+                        heap.back() = { block[i], static_cast<uint32_t>(begin + i) };
+                        push_heap(heap.begin(), heap.end(), minFirst);
+                    }
+                }
+            }
+        }
+        vector<vector<pair<string, double>>> results(configs.size());
+        for (size_t c = 0; c < configs.size(); c++) {
+            auto &recs = results[c];
+            for (const auto &entry : scratch.heaps[c]) recs.push_back({ catalog.works[entry.second].id, entry.first });
+            for (const auto &p : columns.outside) recs.push_back({ p.first, configs[c].collabWeight * p.second });
+            sort(recs.begin(), recs.end(), [](auto &a, auto &b) {
+                return a.second > b.second;
+            });
+            recs.resize(min(recs.size(), top));
+        }
+        return results;
+    }
+
+    // top-k объединённого списка пользователя для каждой конфигурации весов (веса метрик из конфигурации,
+    // а не из запроса) за один проход по каталогу.
+    vector<vector<pair<string, double>>> rankSweep(const Request &request, const Catalog &catalog,
+                                                   const vector<SweepConfig> &configs, int k,
+                                                   ScoringScratch &scratch) {
+        computeComponents(request, catalog, scratch);
+        return rankColumns(catalog, configs, k, scratch);
+    }
+
+    // Первые k элементов combineRecommendations(контент, коллаборативные, contentWeight, collabWeight)
+    // без рандомизации. Идентификаторы работ в каталоге предполагаются уникальными.
+    vector<pair<string, double>> rankCombinedTopK(const Request &request, const Catalog &catalog, int k,
+                                                  double contentWeight, double collabWeight,
+                                                  ScoringScratch &scratch) {
+        return rankSweep(request, catalog, { { request.config, contentWeight, collabWeight } }, k, scratch).front();
+    }
+
+    // Выполняет fn(i, scratch) для всех i < count в threads потоках (threads <= 0 — по числу ядер);
+    // у каждого потока свои буферы.
+    template <typename Fn>
+    void parallelFor(size_t count, int threads, Fn &&fn) {
+        if (threads <= 0) threads = static_cast<int>(max(1u, thread::hardware_concurrency()));
+        threads = static_cast<int>(min<size_t>(static_cast<size_t>(threads), max<size_t>(count, 1)));
+        atomic<size_t> next { 0 };
+        auto worker = [&]() {
+            ScoringScratch scratch;
+            for (size_t i; (i = next++) < count;) fn(i, scratch);
+        };
+        vector<thread> pool;
+        for (int t = 1; t < threads; t++) pool.emplace_back(worker);
+        worker();
+        for (auto &t : pool) t.join();
+    }
+
+    // Пакетный расчёт top-k для набора запросов с весами из самих запросов.
+    vector<vector<pair<string, double>>> rankBatch(const vector<Request> &requests, const Catalog &catalog, int k,
+                                                   double contentWeight, double collabWeight, int threads) {
+        vector<vector<pair<string, double>>> results(requests.size());
+        parallelFor(requests.size(), threads, [&](size_t i, ScoringScratch &scratch) {
+            results[i] = rankCombinedTopK(requests[i], catalog, k, contentWeight, collabWeight, scratch);
+        });
+        return results;
+    }
+
+    // Пакетный перебор конфигураций: results[запрос][конфигурация].
+    vector<vector<vector<pair<string, double>>>> rankSweepBatch(const vector<Request> &requests,
+                                                                const Catalog &catalog,
+                                                                const vector<SweepConfig> &configs, int k,
+                                                                int threads) {
+        vector<vector<vector<pair<string, double>>>> results(requests.size());
+        parallelFor(requests.size(), threads, [&](size_t i, ScoringScratch &scratch) {
+            results[i] = rankSweep(requests[i], catalog, configs, k, scratch);
+        });
+        return results;
+    }
+
+    // Признаки компонентной модели — те же столбцы, что и при оценке: косинус, нормированные просмотры,
+    // нормированное время, коллаборативная сумма. Обученные на них линейные веса переводятся в
+    // (weightTags, weightViews, weightTime, collabWeight) при contentWeight = 1.
+    const int kNumFeatures = 4;
+
+    // Строка признаков работы workId для пользователя, чьи столбцы посчитаны computeComponents.
+    void componentFeatures(const Catalog &catalog, const ComponentColumns &columns, const string &workId, float *row) {
+        auto it = catalog.workIndex.find(workId);
+        if (it != catalog.workIndex.end()) {
+            uint32_t i = it->second;
+            row[0] = static_cast<float>(columns.cosine[i]);
+            row[1] = static_cast<float>(catalog.normViews[i]);
+            row[2] = static_cast<float>(catalog.normTimes[i]);
+            row[3] = static_cast<float>(columns.collab[i]);
+            return;
+        }
+        row[0] = row[1] = row[2] = row[3] = 0;
+        for (const auto &p : columns.outside) {
+            if (p.first == workId) row[3] = static_cast<float>(p.second);
+        }
+    }
+
+    // --- Переранжирование градиентным бустингом ---
+    //
+    // Второй этап: первые topN работ объединённого списка переоцениваются ансамблем деревьев решений
+    // (GBDT) по признакам rerankFeatures. Деревья считаются алгоритмом QuickScorer: условия всех деревьев
+    // сгруппированы по признакам и отсортированы по порогу, у каждого дерева — битовая маска достижимых
+    // листьев (до 64). Для работы просматриваются условия каждого признака по возрастанию порога, пока
+    // порог меньше значения; каждое ложное условие гасит листья своего левого поддерева. Выход дерева —
+    // младший оставшийся бит. Обход не ветвится по структуре деревьев и идёт по плотным массивам.
+    //
+    // Формат файла модели (текстовый, его пишет --train --model gbdt):
+    //   GBDT <число деревьев> <базовая оценка>
+    //   Для каждого дерева: TREE <число узлов>, затем узлы по одному в строке, корень — узел 0:
+    //     <признак> <порог> <левый> <правый>   — внутренний узел: x[признак] <= порог -> левый
+    //     -1 <значение>                        — лист
+    //   Потомки узла должны иметь большие номера, чем он сам.
+
+    // Признаки переранжирования: косинус, нормированные просмотры, нормированное время,
+    // коллаборативная сумма, число тегов работы из профиля.
+    const int kRerankFeatures = 5;
+    // Предел листьев дерева для битовых масок QuickScorer.
+    const int kMaxTreeLeaves = 64;
+
+    struct TreeNode {
+        int feature = -1;        // -1 — лист
+        float threshold = 0;
+        int left = 0;
+        int right = 0;
+        double value = 0;        // значение листа
+    };
+
+    struct TreeEnsemble {
+        double base = 0;
+        vector<vector<TreeNode>> trees;
+    };
+
+    // Проверка структуры дерева: номера потомков в диапазоне и больше номера узла, каждый узел
+    // достижим ровно один раз, листьев не больше kMaxTreeLeaves.
+    bool validTree(const vector<TreeNode> &tree) {
+        if (tree.empty()) return false;
+        vector<int> parents(tree.size(), 0);
+        int leaves = 0;
+        for (size_t i = 0; i < tree.size(); i++) {
+            const TreeNode &node = tree[i];
+            if (node.feature < 0) {
+                leaves++;
+                continue;
+            }
+            if (node.feature >= kRerankFeatures) return false;
+            for (int child : { node.left, node.right }) {
+                if (child <= static_cast<int>(i) || child >= static_cast<int>(tree.size())) return false;
+                parents[child]++;
+            }
+        }
+        for (size_t i = 1; i < tree.size(); i++) {
+            if (parents[i] != 1) return false;
+        }
+        return leaves <= kMaxTreeLeaves;
+    }
+
+    bool readEnsemble(istream &in, TreeEnsemble &model) {
+        string header;
+        size_t numTrees = 0;
+        if (!(in >> header >> numTrees >> model.base) || header != "GBDT") return false;
+        model.trees.assign(numTrees, {});
+        for (auto &tree : model.trees) {
+            string marker;
+            size_t numNodes = 0;
+            if (!(in >> marker >> numNodes) || marker != "TREE") return false;
+            tree.resize(numNodes);
+            for (auto &node : tree) {
+                if (!(in >> node.feature)) return false;
+                bool ok = node.feature < 0 ? static_cast<bool>(in >> node.value)
+                                           : static_cast<bool>(in >> node.threshold >> node.left >> node.right);
+                if (!ok) return false;
+            }
+            if (!validTree(tree)) return false;
+        }
+        return true;
+    }
+
+    bool loadEnsemble(const string &path, TreeEnsemble &model) {
+        ifstream in(path);
+        return in && readEnsemble(in, model);
+    }
+
+    void writeEnsemble(ostream &out, const TreeEnsemble &model) {
+        out << setprecision(17) << "GBDT " << model.trees.size() << " " << model.base << "\n";
+        for (const auto &tree : model.trees) {
+            out << "TREE " << tree.size() << "\n";
+            for (const auto &node : tree) {
+                if (node.feature < 0) out << "-1 " << node.value << "\n";
+                else out << node.feature << " " << setprecision(9) << node.threshold << setprecision(17) << " "
+                         << node.left << " " << node.right << "\n";
+            }
+        }
+    }
+
+    // Прямой обход деревьев — эталон для QuickScorer.
+    double evaluateTrees(const TreeEnsemble &model, const float *x) {
+        double score = model.base;
+        for (const auto &tree : model.trees) {
+            int node = 0;
+            while (tree[node].feature >= 0) {
+                node = (x[tree[node].feature] <= tree[node].threshold) ? tree[node].left : tree[node].right;
+            }
+            score += tree[node].value;
+        }
+        return score;
     }
-    cout << "  ]\n}\n";
 
+    // Ансамбль в раскладке QuickScorer.
+    struct QuickScorer {
+        vector<uint32_t> offsets;       // условия признака f — [offsets[f], offsets[f + 1]), по возрастанию порога
+        vector<float> thresholds;
+        vector<uint32_t> trees;         // дерево условия
+        vector<uint64_t> masks;         // нули — листья левого поддерева условия
+        vector<uint32_t> leafOffsets;   // листья дерева t слева направо — leaves[leafOffsets[t] + бит]
+        vector<double> leaves;
+        double base = 0;
+    };
+
+    QuickScorer buildQuickScorer(const TreeEnsemble &model) {
+        QuickScorer qs;
+        qs.base = model.base;
+        struct Condition {
+            float threshold;
+            uint32_t tree;
+            uint64_t mask;
+        };
+        vector<vector<Condition>> byFeature(kRerankFeatures);
+        for (uint32_t t = 0; t < model.trees.size(); t++) {
+            const auto &tree = model.trees[t];
+            qs.leafOffsets.push_back(static_cast<uint32_t>(qs.leaves.size()));
+            // Обход в глубину слева направо нумерует листья; first/last — диапазон листьев поддерева.
+            vector<int> first(tree.size()), last(tree.size());
+            function<void(int)> visit = [&](int node) {
+                if (tree[node].feature < 0) {
+                    first[node] = last[node] = static_cast<int>(qs.leaves.size() - qs.leafOffsets[t]);
+                    qs.leaves.push_back(tree[node].value);
+                    return;
+                }
+                visit(tree[node].left);
+                visit(tree[node].right);
+                first[node] = first[tree[node].left];
+                last[node] = last[tree[node].right];
+            };
+            visit(0);
+            for (const auto &node : tree) {
+                if (node.feature < 0) continue;
+                uint64_t mask = ~0ULL;
+                for (int leaf = first[node.left]; leaf <= last[node.left]; leaf++) mask &= ~(1ULL << leaf);
+                byFeature[node.feature].push_back({ node.threshold, t, mask });
+            }
+        }
+        qs.offsets.push_back(0);
+        for (auto &conditions : byFeature) {
+            stable_sort(conditions.begin(), conditions.end(), [](auto &a, auto &b) { return a.threshold < b.threshold; });
+            for (const auto &c : conditions) {
+                qs.thresholds.push_back(c.threshold);
+                qs.trees.push_back(c.tree);
+                qs.masks.push_back(c.mask);
+            }
+            qs.offsets.push_back(static_cast<uint32_t>(qs.thresholds.size()));
+        }
+        return qs;
+    }
+
+    // Оценки rows строк признаков x (по kRerankFeatures подряд) в out. bits — буфер масок, переиспользуется.
+    void scoreQuick(const QuickScorer &qs, const float *x, size_t rows, double *out, vector<uint64_t> &bits) {
+        size_t numTrees = qs.leafOffsets.size();
+        for (size_t r = 0; r < rows; r++, x += kRerankFeatures) {
+            bits.assign(numTrees, ~0ULL);
+            for (int f = 0; f < kRerankFeatures; f++) {
+                for (uint32_t p = qs.offsets[f]; p < qs.offsets[f + 1] && qs.thresholds[p] < x[f]; p++) {
+                    bits[qs.trees[p]] &= qs.masks[p];
+                }
+            }
+            double score = qs.base;
+            for (size_t t = 0; t < numTrees; t++) score += qs.leaves[qs.leafOffsets[t] + __builtin_ctzll(bits[t])];
+            out[r] = score;
+        }
+    }
+
+    // Пользовательская часть признаков: профиль в номерах тегов и коллаборативные суммы по работам.
+    struct RerankContext {
+        UserVector user;
+        unordered_map<string, double> collab;
+    };
+
+    RerankContext rerankContext(const Request &request, const Catalog &catalog) {
+        RerankContext context;
+        context.user = buildUserVector(request.user, catalog);
+        for (const auto &p : recommendCollaborative(request.similarUsers)) context.collab.emplace(p.first, p.second);
+        return context;
+    }
+
+    // Строка признаков переранжирования для работы workId; у работ вне каталога есть только коллаборативная часть.
+    void rerankFeatures(const Catalog &catalog, const RerankContext &context, const string &workId, float *row) {
+        fill(row, row + kRerankFeatures, 0.0f);
+        auto collab = context.collab.find(workId);
+        if (collab != context.collab.end()) row[3] = static_cast<float>(collab->second);
+        auto it = catalog.workIndex.find(workId);
+        if (it == catalog.workIndex.end()) return;
+        uint32_t i = it->second;
+        double norm = catalog.norms[i];
+        double dot = workDot(context.user, catalog, i);
+        row[0] = static_cast<float>((context.user.norm == 0 || norm == 0) ? 0 : dot / (context.user.norm * norm));
+        row[1] = static_cast<float>(catalog.normViews[i]);
+        row[2] = static_cast<float>(catalog.normTimes[i]);
+        int overlap = 0;
+        for (uint32_t j = catalog.tagOffsets[i]; j < catalog.tagOffsets[i + 1]; j++) {
+            if (find(context.user.tagIds.begin(), context.user.tagIds.end(), catalog.tagIds[j]) != context.user.tagIds.end()) {
+                overlap++;
+            }
+        }
+        row[4] = static_cast<float>(overlap);
+    }
+
+    // Модель второго этапа и число переоцениваемых кандидатов.
+    struct Reranker {
+        QuickScorer scorer;
+        int topN = 1000;
+    };
+
+    // Переранжирование: первые topN работ recs получают оценку модели и упорядочиваются по ней
+    // (при равенстве сохраняется исходный порядок), остальные идут следом без изменений.
+    void rerank(const Request &request, const Catalog &catalog, const Reranker &reranker,
+                vector<pair<string, double>> &recs) {
+        size_t n = min(recs.size(), static_cast<size_t>(max(reranker.topN, 0)));
+        if (n == 0) return;
+        RerankContext context = rerankContext(request, catalog);
+        vector<float> x(n * kRerankFeatures);
+        for (size_t i = 0; i < n; i++) rerankFeatures(catalog, context, recs[i].first, &x[i * kRerankFeatures]);
+        vector<double> scores(n);
+        vector<uint64_t> bits;
+        scoreQuick(reranker.scorer, x.data(), n, scores.data(), bits);
+        for (size_t i = 0; i < n; i++) recs[i].second = scores[i];
+        stable_sort(recs.begin(), recs.begin() + n, [](auto &a, auto &b) { return a.second > b.second; });
+    }
+
+    // Случайный ансамбль полных деревьев глубины depth — для бенчмарков и дифференциальных проверок.
+    TreeEnsemble randomEnsemble(int numTrees, int depth, uint32_t seed) {
+        mt19937 rng(seed);
+        uniform_int_distribution<int> feature(0, kRerankFeatures - 1);
+        uniform_real_distribution<double> unit(0, 1), leaf(-1, 1);
+        TreeEnsemble model;
+        for (int t = 0; t < numTrees; t++) {
+            vector<TreeNode> tree(1);
+            vector<pair<int, int>> open { { 0, 0 } };   // (узел, глубина)
+            for (size_t k = 0; k < open.size(); k++) {
+                int node = open[k].first, level = open[k].second;
+                if (level == depth) {
+                    tree[node].value = leaf(rng);
+                    continue;
+                }
+                TreeNode &split = tree[node];
+                split.feature = feature(rng);
+                // Порог в диапазоне признака: для числа общих тегов — небольшие целые с половиной.
+                split.threshold = static_cast<float>(split.feature == 4 ? floor(unit(rng) * 6) + 0.5
+                                                     : split.feature == 3 ? unit(rng) * 3 : unit(rng));
+                int left = static_cast<int>(tree.size());
+                split.left = left;
+                split.right = left + 1;
+                tree.resize(tree.size() + 2);
+                open.push_back({ left, level + 1 });
+                open.push_back({ left + 1, level + 1 });
+            }
+            model.trees.push_back(move(tree));
+        }
+        return model;
+    }
+
+    // --- Разнообразие выдачи ---
+    //
+    // Последний этап перед рандомизацией: из первых topN работ объединённого списка выбираются
+    // numRecommendations работ с учётом разнообразия и ставятся в начало в порядке выбора; остальные
+    // кандидаты и хвост списка идут следом в прежнем порядке, оценки не меняются.
+    // Режим задаётся секцией запроса DIVERSITY.
+    //
+    // mmr — Maximal Marginal Relevance: на каждом шаге берётся работа с наибольшим
+    // lambda * оценка - (1 - lambda) * (наибольшее сходство с уже выбранными). Сходство — косинус векторов
+    // тегов работ. Для каждого кандидата хранится текущее наибольшее сходство с выбранными, и после
+    // выбора оно обновляется одним скалярным произведением с новой работой: k шагов по N кандидатам —
+    // O(N·k) разреженных произведений вместо O(N·k²) при пересчёте по всем выбранным.
+    //
+    // coverage — жадная максимизация покрытия тегов:
+    // f(S) = lambda * Σ оценок S + (1 - lambda) * Σ по тегам t max по s из S нормированного веса t в s.
+    // Функция субмодулярна: прирост кандидата от новых выбранных только убывает. Поэтому прирост,
+    // посчитанный на прошлых шагах, — верхняя граница текущего, и ленивый жадный алгоритм держит кандидатов
+    // в очереди по устаревшим приростам: пересчитывается только вершина, и если её свежий прирост остаётся
+    // наибольшим, она выбирается. Выбор совпадает с обычным жадным, но на шаге пересчитывается лишь
+    // несколько кандидатов из N.
+
+    // Разреженный вектор тегов одной работы, развёрнутый в плотный массив по номерам тегов:
+    // скалярное произведение с любой другой работой — один проход по её тегам.
+    class TagScatter {
+    public:
+        explicit TagScatter(const Catalog &catalog) : catalog(catalog), dense(catalog.tagNames.size(), 0.0) {}
+
+        void load(uint32_t work) {
+            clear();
+            current = work;
+            for (uint32_t j = catalog.tagOffsets[work]; j < catalog.tagOffsets[work + 1]; j++) {
+                if (dense[catalog.tagIds[j]] == 0) touched.push_back(catalog.tagIds[j]);
+                dense[catalog.tagIds[j]] += catalog.tagValues[j];
+            }
+        }
+
+        // Косинус загруженной работы с работой other.
+        double cosine(uint32_t other) const {
+            double dot = 0;
+            for (uint32_t j = catalog.tagOffsets[other]; j < catalog.tagOffsets[other + 1]; j++) {
+                dot += dense[catalog.tagIds[j]] * catalog.tagValues[j];
+            }
+            double norms = catalog.norms[current] * catalog.norms[other];
+            return norms == 0 ? 0 : dot / norms;
+        }
+
+    private:
+        void clear() {
+            for (uint32_t t : touched) dense[t] = 0;
+            touched.clear();
+        }
+
+        const Catalog &catalog;
+        vector<double> dense;
+        vector<uint32_t> touched;
+        uint32_t current = 0;
+    };
+
+    // Кандидаты этапа разнообразия: первые topN работ списка и их номера в каталоге
+    // (UINT32_MAX для работ вне каталога — у них нет тегов, сходство с ними 0).
+    vector<uint32_t> diversityCandidates(const Catalog &catalog, const vector<pair<string, double>> &recs,
+                                         size_t topN) {
+        vector<uint32_t> index(min(recs.size(), topN));
+        for (size_t c = 0; c < index.size(); c++) {
+            auto it = catalog.workIndex.find(recs[c].first);
+            index[c] = it != catalog.workIndex.end() ? it->second : UINT32_MAX;
+        }
+        return index;
+    }
+
+    // Перестановка результата: выбранные кандидаты (номера в recs) по порядку выбора, затем остальные.
+    void applySelection(vector<pair<string, double>> &recs, const vector<size_t> &picked) {
+        vector<char> used(recs.size(), 0);
+        vector<pair<string, double>> reordered;
+        reordered.reserve(recs.size());
+        for (size_t c : picked) {
+            reordered.push_back(move(recs[c]));
+            used[c] = 1;
+        }
+        for (size_t c = 0; c < recs.size(); c++) {
+            if (!used[c]) reordered.push_back(move(recs[c]));
+        }
+        recs.swap(reordered);
+    }
+
+    // Выбор k работ MMR с инкрементальным обновлением наибольшего сходства. Возвращает номера в recs.
+    vector<size_t> selectMmr(const Catalog &catalog, const vector<pair<string, double>> &recs, size_t topN, size_t k,
+                             double lambda) {
+        vector<uint32_t> index = diversityCandidates(catalog, recs, topN);
+        size_t n = index.size();
+        vector<double> maxSim(n, 0.0);
+        vector<char> taken(n, 0);
+        vector<size_t> picked;
+        TagScatter scatter(catalog);
+        while (picked.size() < min(k, n)) {
+            size_t best = n;
+            double bestValue = 0;
+            for (size_t c = 0; c < n; c++) {
+                if (taken[c]) continue;
+                double value = lambda * recs[c].second - (1 - lambda) * maxSim[c];
+                if (best == n || value > bestValue) {
+                    best = c;
+                    bestValue = value;
+                }
+            }
+            taken[best] = 1;
+            picked.push_back(best);
+            if (index[best] == UINT32_MAX) continue;
+            scatter.load(index[best]);
+            for (size_t c = 0; c < n; c++) {
+                if (!taken[c] && index[c] != UINT32_MAX) maxSim[c] = max(maxSim[c], scatter.cosine(index[c]));
+            }
+        }
+        return picked;
+    }
+
+    // Покрытие тегов выбранными работами: для каждого тега — наибольший нормированный вес среди выбранных.
+    class TagCoverage {
+    public:
+        explicit TagCoverage(const Catalog &catalog) : catalog(catalog), cover(catalog.tagNames.size(), 0.0) {}
+
+        // Прирост покрытия от добавления работы (номер в каталоге, UINT32_MAX — работа вне каталога).
+        double gain(uint32_t work) const {
+            if (work == UINT32_MAX || catalog.norms[work] == 0) return 0;
+            double total = 0;
+            for (uint32_t j = catalog.tagOffsets[work]; j < catalog.tagOffsets[work + 1]; j++) {
+                total += max(0.0, catalog.tagValues[j] / catalog.norms[work] - cover[catalog.tagIds[j]]);
+            }
+            return total;
+        }
+
+        void add(uint32_t work) {
+            if (work == UINT32_MAX || catalog.norms[work] == 0) return;
+            for (uint32_t j = catalog.tagOffsets[work]; j < catalog.tagOffsets[work + 1]; j++) {
+                double &c = cover[catalog.tagIds[j]];
+                c = max(c, catalog.tagValues[j] / catalog.norms[work]);
+            }
+        }
+
+    private:
+        const Catalog &catalog;
+        vector<double> cover;
+    };
+
+    // Ленивый жадный выбор k работ по покрытию тегов. Возвращает номера в recs.
+    // evaluations, если задан, получает число вычислений прироста.
+    vector<size_t> selectCoverage(const Catalog &catalog, const vector<pair<string, double>> &recs, size_t topN,
+                                  size_t k, double lambda, size_t *evaluations = nullptr) {
+        vector<uint32_t> index = diversityCandidates(catalog, recs, topN);
+        size_t n = index.size();
+        TagCoverage coverage(catalog);
+        auto gainOf = [&](size_t c) { return lambda * recs[c].second + (1 - lambda) * coverage.gain(index[c]); };
+
+        // Элемент очереди: прирост, номер кандидата и шаг, на котором прирост посчитан.
+        // При равных приростах раньше идёт кандидат с меньшим номером — как в обычном жадном проходе.
+        struct Entry {
+            double gain;
+            size_t candidate;
+            size_t step;
+            bool operator<(const Entry &o) const {
+                return gain != o.gain ? gain < o.gain : candidate > o.candidate;
+            }
+        };
+        vector<Entry> initial;
+        initial.reserve(n);
+        for (size_t c = 0; c < n; c++) initial.push_back({ gainOf(c), c, 0 });
+        priority_queue<Entry> queue(less<Entry>(), move(initial));
+        size_t evaluated = n;
+
+        vector<size_t> picked;
+        while (picked.size() < min(k, n)) {
+            Entry top = queue.top();
+            queue.pop();
+            if (top.step != picked.size()) {
+                top.gain = gainOf(top.candidate);
+                top.step = picked.size();
+                evaluated++;
+                queue.push(top);
+                continue;
+            }
+            picked.push_back(top.candidate);
+            coverage.add(index[top.candidate]);
+        }
+        if (evaluations) *evaluations = evaluated;
+        return picked;
+    }
+
+    // Подавление почти одинаковых работ (переиздания, повторные загрузки): список просматривается по порядку,
+    // и работа удаляется, если её SimHash отличается от подписи уже оставленной не больше чем в maxDistance
+    // разрядах — одно сравнение popcount на пару вместо косинуса. Просмотр останавливается, когда оставлено
+    // limit работ; работы вне каталога и без тегов не подавляются. Возвращает число проверенных работ в начале
+    // списка, остальные идут за ними непроверенными.
+    size_t suppressNearDuplicates(const Catalog &catalog, vector<pair<string, double>> &recs, size_t limit,
+                                  int maxDistance) {
+        vector<uint64_t> kept;
+        size_t out = 0;
+        size_t i = 0;
+        for (; i < recs.size() && out < limit; i++) {
+            auto it = catalog.workIndex.find(recs[i].first);
+            if (it != catalog.workIndex.end() && catalog.norms[it->second] > 0) {
+                uint64_t signature = catalog.simhashes[it->second];
+                bool duplicate = false;
+                for (uint64_t other : kept) {
+                    if (__builtin_popcountll(signature ^ other) <= maxDistance) {
+                        duplicate = true;
+                        break;
+                    }
+                }
+                if (duplicate) continue;
+                kept.push_back(signature);
+            }
+            if (out != i) recs[out] = move(recs[i]);
+            out++;
+        }
+        size_t checked = out;
+        if (out == i) return checked;
+        for (; i < recs.size(); i++) recs[out++] = move(recs[i]);
+        recs.resize(out);
+        return checked;
+    }
+
+    // Этап разнообразия по параметрам запроса: подавление почти одинаковых работ (секция NEAR_DUPLICATES)
+    // среди кандидатов, затем выбор режима секции DIVERSITY; без этих секций список не меняется.
+    // Со случайной долей (randomFactor > 0) список обрезается до прошедших этапы кандидатов: иначе случайная
+    // доля, которая берётся из хвоста списка, вернула бы подавленные дубликаты и работы, пропущенные выбором.
+    // Подавление тогда проверяет max(k, diversityTop) работ, чтобы случайной доле было из чего выбирать.
+    // С квотами список не обрезается: отбор квот сам оставляет не больше k работ.
+    void diversify(const Request &request, const Catalog &catalog, vector<pair<string, double>> &recs) {
+        if (request.numRecommendations <= 0) return;
+        size_t topN = static_cast<size_t>(max(request.diversityTop, 0));
+        size_t k = static_cast<size_t>(request.numRecommendations);
+        bool randomShare = request.randomFactor > 0 && request.maxPerPrimaryTag <= 0 && request.minFresh <= 0;
+        size_t vetted = recs.size();
+        if (request.nearDuplicateDistance >= 0) {
+            size_t limit = request.diversity.empty() && !randomShare ? k : max(k, topN);
+            vetted = suppressNearDuplicates(catalog, recs, limit, request.nearDuplicateDistance);
+        }
+        if (request.diversity == "mmr" || request.diversity == "coverage") {
+            auto picked = request.diversity == "mmr" ? selectMmr(catalog, recs, topN, k, request.diversityLambda)
+                                                     : selectCoverage(catalog, recs, topN, k, request.diversityLambda);
+            vetted = picked.size();
+            applySelection(recs, picked);
+        }
+        if (randomShare && vetted < recs.size()) recs.resize(vetted);
+    }
+
+    // --- Квоты итоговой выдачи ---
+    //
+    // Ограничения на состав выдачи (секция запроса QUOTAS): не больше maxPerPrimaryTag работ с одним
+    // основным тегом (тег с наибольшим весом у работы) и не меньше minFresh свежих работ. Даты публикации
+    // в каталоге нет, поэтому свежей считается работа, ещё не набравшая просмотров: viewCount не больше
+    // freshMaxViews. Работы вне каталога основного тега не имеют и свежими не считаются.
+    //
+    // Кандидаты подаются отборщику по убыванию оценки. Работа берётся, если квота её тега не исчерпана и
+    // она не занимает места, оставленные под недостающие свежие; несвежая работа, не поместившаяся из-за
+    // резерва, откладывается. Отбор кончается, как только заполнены все места. Если свежих до конца списка
+    // не хватило, свободные места занимают отложенные (их хранится не больше числа мест).
+    bool hasQuotas(const Request &request) { return request.maxPerPrimaryTag > 0 || request.minFresh > 0; }
+
+    class QuotaSelector {
+    public:
+        QuotaSelector(const Request &request, const Catalog &catalog)
+            : request(request), catalog(catalog), slots(static_cast<size_t>(max(request.numRecommendations, 0))) {}
+
+        bool full() const { return selected.size() >= slots; }
+
+        // Следующий по убыванию оценки кандидат; index — номер в каталоге или UINT32_MAX для работы вне него.
+        // Возвращает false, когда все места заполнены и дальше кандидатов подавать не нужно.
+        bool offer(const pair<string, double> &rec, uint32_t index) {
+            if (full()) return false;
+            uint32_t tag = index != UINT32_MAX ? catalog.primaryTags[index] : UINT32_MAX;
+            if (capped(tag)) return true;
+            bool fresh = index != UINT32_MAX && catalog.works[index].viewCount <= request.freshMaxViews;
+            size_t missingFresh = static_cast<size_t>(max(request.minFresh - freshTaken, 0));
+            if (!fresh && slots - selected.size() <= missingFresh) {
+                if (deferred.size() < slots) deferred.push_back({ rec, tag });
+                return true;
+            }
+            take(rec, tag);
+            if (fresh) freshTaken++;
+            return !full();
+        }
+
+        // Выбранные работы по убыванию оценки, свободные места заняты отложенными.
+        vector<pair<string, double>> finish() {
+            for (const auto &entry : deferred) {
+                if (full()) break;
+                if (!capped(entry.second)) take(entry.first, entry.second);
+            }
+            stable_sort(selected.begin(), selected.end(), [](auto &a, auto &b) { return a.second > b.second; });
+            return move(selected);
+        }
+
+    private:
+        bool capped(uint32_t tag) const {
+            if (request.maxPerPrimaryTag <= 0 || tag == UINT32_MAX) return false;
+            auto it = tagCounts.find(tag);
+            return it != tagCounts.end() && it->second >= request.maxPerPrimaryTag;
+        }
+
+        void take(const pair<string, double> &rec, uint32_t tag) {
+            selected.push_back(rec);
+            if (tag != UINT32_MAX) tagCounts[tag]++;
+        }
+
+        const Request &request;
+        const Catalog &catalog;
+        size_t slots;
+        int freshTaken = 0;
+        unordered_map<uint32_t, int> tagCounts;
+        vector<pair<string, double>> selected;
+        vector<pair<pair<string, double>, uint32_t>> deferred;
+    };
+
+    // Квоты над уже упорядоченным списком: просмотр останавливается на заполнении мест. Возвращает false,
+    // если список кончился раньше: тогда продолжение списка могло бы изменить выбор.
+    bool applyQuotas(const Request &request, const Catalog &catalog, vector<pair<string, double>> &recs) {
+        if (!hasQuotas(request)) return true;
+        QuotaSelector selector(request, catalog);
+        bool filled = false;
+        for (const auto &rec : recs) {
+            auto it = catalog.workIndex.find(rec.first);
+            if (!selector.offer(rec, it != catalog.workIndex.end() ? it->second : UINT32_MAX)) {
+                filled = true;
+                break;
+            }
+        }
+        recs = selector.finish();
+        return filled;
+    }
+
+    // Выдача с квотами без полного объединённого списка: оценки считаются столбцами, работы подаются
+    // отборщику из кучи номеров (построение O(n), каждое извлечение O(log n)), и извлекается ровно столько,
+    // сколько нужно до заполнения мест. Работы вне каталога вливаются в тот же порядок; при равных оценках
+    // раньше идут работы каталога по возрастанию номера, затем внешние по идентификатору.
+    vector<pair<string, double>> rankWithQuotas(const Request &request, const Catalog &catalog,
+                                                ScoringScratch &scratch) {
+        size_t n = catalog.works.size();
+        computeComponents(request, catalog, scratch);
+        const auto &columns = scratch.columns;
+        scratch.block.resize(n);
+        const double *scores = scratch.block.data();
+        combineColumns(catalog, columns, { request.config, request.contentWeight, request.collabWeight }, 0, n,
+                       scratch.block.data());
+
+        auto &heap = scratch.order;
+        heap.clear();
+        for (uint32_t i = 0; i < n; i++) {
+            if (!columns.exclusions.excluded(i)) heap.push_back(i);
+        }
+        auto lower = [&](uint32_t a, uint32_t b) { return scores[a] != scores[b] ? scores[a] < scores[b] : a > b; };
+        make_heap(heap.begin(), heap.end(), lower);
+
+        vector<pair<string, double>> outside;
+        for (const auto &p : columns.outside) outside.push_back({ p.first, request.collabWeight * p.second });
+        sort(outside.begin(), outside.end(), [](auto &a, auto &b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+
+        QuotaSelector selector(request, catalog);
+        size_t nextOutside = 0;
+        while (!selector.full() && (!heap.empty() || nextOutside < outside.size())) {
+            if (!heap.empty() && (nextOutside == outside.size() || scores[heap.front()] >= outside[nextOutside].second)) {
+                uint32_t i = heap.front();
+                pop_heap(heap.begin(), heap.end(), lower);
+                heap.pop_back();
+                selector.offer({ catalog.works[i].id, scores[i] }, i);
+            } else {
+                selector.offer(outside[nextOutside++], UINT32_MAX);
+            }
+        }
+        return selector.finish();
+    }
+
+    // --- Двухэтапный конвейер: генерация кандидатов и полная оценка ---
+    //
+    // Дешёвые генераторы (лайки ближайших похожих пользователей, начала упорядоченных по вкладу списков
+    // самых весомых тегов профиля, самые просматриваемые работы) дают ограниченное множество кандидатов
+    // без повторов; полная оценка, объединение и рандомизация выполняются только для него. Стоимость
+    // запроса определяется бюджетами этапов, а не размером каталога. Бюджет 0 — без ограничения
+    // (при всех нулевых бюджетах результат совпадает с recommend).
+
+    struct StageBudgets {
+        int profileTags = 16;       // сколько самых весомых тегов профиля порождают кандидатов
+        int postingsPerTag = 200;   // сколько работ с наибольшим вкладом брать из списка каждого тега
+        int neighbors = 50;         // сколько похожих пользователей с наибольшим сходством дают свои лайки
+        int popular = 100;          // сколько самых просматриваемых работ добавить
+        int maxCandidates = 1000;   // предел объединённого множества кандидатов
+    };
+
+    // Кандидаты: работы каталога и работы вне каталога (только из лайков похожих пользователей).
+    struct CandidateSet {
+        vector<uint32_t> works;
+        vector<string> outside;
+    };
+
+    // Генерация кандидатов. При нехватке общего бюджета приоритет у лайков соседей, затем у тегов
+    // (списки тегов чередуются, чтобы каждый тег дал свои лучшие работы), затем у популярных работ.
+    CandidateSet generateCandidates(const Request &request, const Catalog &catalog, const StageBudgets &budgets,
+                                    const ImpressionPolicy *impressions = nullptr) {
+        CandidateSet candidates;
+        size_t limit = budgets.maxCandidates > 0 ? static_cast<size_t>(budgets.maxCandidates) : SIZE_MAX;
+        Exclusions exclusions = buildExclusions(request, catalog, impressions);
+        unordered_set<uint32_t> seen;
+        unordered_set<string> seenOutside;
+        auto full = [&]() { return candidates.works.size() + candidates.outside.size() >= limit; };
+        // Исключённые работы не занимают место в бюджете кандидатов.
+        auto addWork = [&](uint32_t i) {
+            if (!full() && !exclusions.excluded(i) && seen.insert(i).second) candidates.works.push_back(i);
+        };
+
+        // 1. Лайки ближайших похожих пользователей.
+        vector<const SimilarUser *> neighbors;
+        for (const auto &user : request.similarUsers) neighbors.push_back(&user);
+        if (budgets.neighbors > 0 && neighbors.size() > static_cast<size_t>(budgets.neighbors)) {
+            nth_element(neighbors.begin(), neighbors.begin() + budgets.neighbors, neighbors.end(),
+                        [](auto a, auto b) { return a->similarity > b->similarity; });
+            neighbors.resize(budgets.neighbors);
+        }
+        for (const auto *user : neighbors) {
+            for (const auto &id : user->likedWorks) {
+                auto it = catalog.workIndex.find(id);
+                if (it != catalog.workIndex.end()) addWork(it->second);
+                else if (!full() && !exclusions.excludedOutside(id) && seenOutside.insert(id).second) {
+                    candidates.outside.push_back(id);
+                }
+            }
+        }
+
+        // При обязательных тегах остальные генераторы заменяет само пересечение их списков.
+        if (exclusions.constrained) {
+            for (uint32_t i : exclusions.allowedList) addWork(i);
+            return candidates;
+        }
+
+        // 2. Теги профиля: по очереди из каждого списка, в порядке убывания вклада.
+        UserVector vec = buildUserVector(request.user, catalog);
+        vector<size_t> order = profileTagOrder(vec);
+        if (budgets.profileTags > 0 && order.size() > static_cast<size_t>(budgets.profileTags)) {
+            order.resize(budgets.profileTags);
+        }
+        for (size_t rank = 0; !full(); rank++) {
+            bool any = false;
+            for (size_t u : order) {
+                uint32_t t = vec.tagIds[u];
+                size_t length = catalog.postingOffsets[t + 1] - catalog.postingOffsets[t];
+                if (budgets.postingsPerTag > 0) length = min(length, static_cast<size_t>(budgets.postingsPerTag));
+                if (rank >= length) continue;
+                addWork(catalog.impactWorks[catalog.postingOffsets[t] + rank]);
+                any = true;
+            }
+            if (!any) break;
+        }
+
+        // 3. Популярные работы; без ограничения — весь каталог.
+        if (budgets.popular > 0) {
+            size_t count = min(catalog.popularWorks.size(), static_cast<size_t>(budgets.popular));
+            for (size_t j = 0; j < count && !full(); j++) addWork(catalog.popularWorks[j]);
+        } else {
+            for (uint32_t i = 0; i < catalog.works.size() && !full(); i++) addWork(i);
+        }
+        return candidates;
+    }
+
+    // Полная оценка кандидатов: контентная часть — как computeWorkScore, коллаборативная — суммы
+    // сходств по всем похожим пользователям. Возвращает объединённый список, отсортированный по убыванию.
+    vector<pair<string, double>> rankStaged(const Request &request, const Catalog &catalog,
+                                            const StageBudgets &budgets, const ImpressionPolicy *impressions = nullptr) {
+        CandidateSet candidates = generateCandidates(request, catalog, budgets, impressions);
+        UserVector vec = buildUserVector(request.user, catalog);
+        vector<pair<string, double>> contentRecs;
+        contentRecs.reserve(candidates.works.size());
+        for (uint32_t i : candidates.works) {
+            contentRecs.push_back({ catalog.works[i].id,
+                                    indexedWorkScore(catalog, i, workDot(vec, catalog, i), vec.norm, request.config) });
+        }
+        unordered_set<string> chosen(candidates.outside.begin(), candidates.outside.end());
+        for (uint32_t i : candidates.works) chosen.insert(catalog.works[i].id);
+        vector<pair<string, double>> collabRecs;
+        for (const auto &p : recommendCollaborative(request.similarUsers)) {
+            if (chosen.count(p.first)) collabRecs.push_back(p);
+        }
+        auto combinedRecs = combineRecommendations(contentRecs, collabRecs, request.contentWeight, request.collabWeight);
+        demoteShown(request, catalog, impressions, combinedRecs);
+        return combinedRecs;
+    }
+
+    // Полный цикл двухэтапного конвейера: кандидаты, оценка, переранжирование (если задано), рандомизация.
+    vector<pair<string, double>> recommendStaged(const Request &request, const Catalog &catalog,
+                                                 const StageBudgets &budgets, const Reranker *reranker = nullptr,
+                                                 const ImpressionPolicy *impressions = nullptr) {
+        auto combinedRecs = rankStaged(request, catalog, budgets, impressions);
+        if (reranker) rerank(request, catalog, *reranker, combinedRecs);
+        diversify(request, catalog, combinedRecs);
+        applyQuotas(request, catalog, combinedRecs);
+        return getRandomizedRecommendations(combinedRecs, request.numRecommendations, request.randomFactor,
+                                            request.randomSeed);
+    }
+
+    // Объединённый список по индексированному каталогу без исключённых работ, до рандомизации.
+    // reranker (если задан) переупорядочивает первые кандидаты.
+    vector<pair<string, double>> rankIndexed(const Request &request, const Catalog &catalog,
+                                             const Reranker *reranker = nullptr,
+                                             const ImpressionPolicy *impressions = nullptr) {
+        Exclusions exclusions = buildExclusions(request, catalog, impressions);
+        vector<pair<string, double>> contentRecs;
+        if (exclusions.constrained) {
+            // Обязательные теги: оцениваются только работы пересечения, стоимость не зависит от размера каталога.
+            UserVector vec = buildUserVector(request.user, catalog);
+            for (uint32_t i : exclusions.allowedList) {
+                if (exclusions.excluded(i)) continue;
+                contentRecs.push_back({ catalog.works[i].id, indexedWorkScore(catalog, i, workDot(vec, catalog, i),
+                                                                              vec.norm, request.config) });
+            }
+        } else {
+            contentRecs = recommendContentBasedIndexed(request.user, catalog, request.config, &exclusions);
+        }
+        auto collabRecs = recommendCollaborative(request.similarUsers);
+        if (exclusions.any) {
+            collabRecs.erase(remove_if(collabRecs.begin(), collabRecs.end(),
+                                       [&](const pair<string, double> &p) {
+                                           return exclusions.excludedId(catalog, p.first);
+                                       }),
+                             collabRecs.end());
+        }
+        auto combinedRecs = combineRecommendations(contentRecs, collabRecs, request.contentWeight,
+                                                   request.collabWeight);
+        demoteShown(request, catalog, impressions, combinedRecs);
+        if (reranker) rerank(request, catalog, *reranker, combinedRecs);
+        return combinedRecs;
+    }
+
+    // --- Оценка с дедлайном ---
+    //
+    // Под перегрузкой полный проход по каталогу может не уложиться в бюджет запроса (секция DEADLINE).
+    // Тогда работы оцениваются по блокам staticOrder — от популярных к непопулярным — в порядке убывания
+    // верхней границы блока: cw * (|weightTags| + wViews * max normViews + wTime * max normTimes) +
+    // lw * (наибольшая коллаборативная сумма запроса), так как косинус не больше 1. Между блоками
+    // проверяется время: по истечении бюджета возвращается текущий top-depth, и выдача помечается
+    // приближённой. Если наименьшая оценка заполненного top-depth не меньше границы следующего блока,
+    // оставшиеся блоки ничего не изменят и проход заканчивается досрочно с точным результатом.
+    // Без истечения бюджета результат совпадает с первыми depth работ rankIndexed.
+
+    // Сколько работ нужно последующим этапам: разнообразию — его top, модели — её topN. Квотам заранее
+    // не угадать: recommend увеличивает глубину, пока отбор не заполнит места.
+    size_t anytimeDepth(const Request &request, const Reranker *reranker) {
+        size_t depth = static_cast<size_t>(max(request.numRecommendations, 0));
+        if (!request.diversity.empty() || request.nearDuplicateDistance >= 0) {
+            depth = max(depth, static_cast<size_t>(max(request.diversityTop, 0)));
+        }
+        if (reranker) depth = max(depth, static_cast<size_t>(max(reranker->topN, 0)));
+        return depth;
+    }
+
+    vector<pair<string, double>> rankAnytime(const Request &request, const Catalog &catalog, size_t depth,
+                                             chrono::steady_clock::time_point deadline,
+                                             const ImpressionPolicy *impressions, bool &approximate) {
+        approximate = false;
+        Exclusions exclusions = buildExclusions(request, catalog, impressions);
+        UserVector vec = buildUserVector(request.user, catalog);
+        vector<double> dense(catalog.tagNames.size(), 0.0);
+        for (size_t u = 0; u < vec.tagIds.size(); u++) dense[vec.tagIds[u]] = vec.values[u];
+
+        double cw = request.contentWeight, lw = request.collabWeight;
+        unordered_map<uint32_t, double> collab;
+        vector<pair<string, double>> results;
+        double maxCollab = 0;
+        for (const auto &p : recommendCollaborative(request.similarUsers)) {
+            auto it = catalog.workIndex.find(p.first);
+            if (it == catalog.workIndex.end()) {
+                if (!exclusions.excludedOutside(p.first)) results.push_back({ p.first, lw * p.second });
+                continue;
+            }
+            collab[it->second] = p.second;
+            maxCollab = max(maxCollab, p.second);
+        }
+        ImpressionStore::History shown;
+        bool demoting = impressions && impressions->store && impressions->demote != 0 && !request.userId.empty();
+        if (demoting) shown = impressions->store->history(request.userId, impressions->nowSeconds);
+
+        const MetricsConfig &config = request.config;
+        double wViews = config.useMetrics ? max(config.weightViews, 0.0) : 0;
+        double wTime = config.useMetrics ? max(config.weightTime, 0.0) : 0;
+        // Границы верны только при неотрицательных весах объединения и без понижения показанных.
+        bool prune = cw >= 0 && lw >= 0 && !demoting;
+        size_t blocks = catalog.blockMaxViews.size();
+        vector<double> bounds(blocks);
+        vector<uint32_t> order(blocks);
+        for (uint32_t b = 0; b < blocks; b++) {
+            bounds[b] = cw * (fabs(config.weightTags) + wViews * catalog.blockMaxViews[b] +
+                              wTime * catalog.blockMaxTimes[b]) + lw * maxCollab;
+            order[b] = b;
+        }
+        stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return bounds[a] > bounds[b]; });
+
+        // При равных оценках выше работа с меньшим номером, как в rankWithQuotas: от этого порядка зависит
+        // выбор квот, и он не должен меняться с глубиной прохода.
+        auto better = [](const pair<double, uint32_t> &a, const pair<double, uint32_t> &b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        };
+        vector<pair<double, uint32_t>> heap;
+        for (size_t step = 0; step < blocks && depth > 0; step++) {
+            uint32_t b = order[step];
+            if (prune && heap.size() == depth && heap.front().first > bounds[b]) break;
+            if (step > 0 && chrono::steady_clock::now() >= deadline) {
+                approximate = true;
+                break;
+            }
+            size_t end = min(catalog.staticOrder.size(), (b + 1) * kStaticBlock);
+            for (size_t j = b * kStaticBlock; j < end; j++) {
+                uint32_t i = catalog.staticOrder[j];
+                if (exclusions.excluded(i)) continue;
+                double dot = 0;
+                for (uint32_t t = catalog.tagOffsets[i]; t < catalog.tagOffsets[i + 1]; t++) {
+                    dot += dense[catalog.tagIds[t]] * catalog.tagValues[t];
+                }
+                double score = cw * indexedWorkScore(catalog, i, dot, vec.norm, config);
+                auto it = collab.find(i);
+                if (it != collab.end()) score += lw * it->second;
+                if (demoting && shown.contains(i)) score *= impressions->demote;
+                if (heap.size() < depth) {
+                    heap.push_back({ score, i });
+                    push_heap(heap.begin(), heap.end(), better);
+                } else if (better({ score, i }, heap.front())) {
+                    pop_heap(heap.begin(), heap.end(), better);
+                    heap.back() = { score, i };
+                    push_heap(heap.begin(), heap.end(), better);
+                }
+            }
+        }
+        // Работы вне каталога идут после работ каталога с той же оценкой, между собой — по идентификатору.
+        sort(heap.begin(), heap.end(), better);
+        sort(results.begin(), results.end(), [](auto &a, auto &b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        vector<pair<string, double>> merged;
+        merged.reserve(min(heap.size() + results.size(), depth));
+        size_t h = 0, o = 0;
+        while (merged.size() < depth && (h < heap.size() || o < results.size())) {
+            if (o == results.size() || (h < heap.size() && heap[h].first >= results[o].second)) {
+                merged.push_back({ catalog.works[heap[h].second].id, heap[h].first });
+                h++;
+            } else {
+                merged.push_back(move(results[o++]));
+            }
+        }
+        return merged;
+    }
+
+    // Полный цикл получения рекомендаций по индексированному каталогу (для резидентного режима).
+    // approximate (если задан) сообщает, что бюджет DEADLINE истёк и выдача собрана не по всему каталогу.
+    vector<pair<string, double>> recommend(const Request &request, const Catalog &catalog,
+                                           const Reranker *reranker = nullptr,
+                                           const ImpressionPolicy *impressions = nullptr,
+                                           bool *approximate = nullptr) {
+        if (approximate) *approximate = false;
+        // С обязательными тегами оценивается только пересечение, бюджет времени не нужен.
+        if (request.deadlineMs > 0 && request.requiredTags.empty()) {
+            auto deadline = chrono::steady_clock::now() +
+                            chrono::microseconds(static_cast<int64_t>(request.deadlineMs * 1000));
+            bool partial = false;
+            vector<pair<string, double>> combinedRecs;
+            // Если квоты не заполнились на top-depth, глубина удваивается и проход повторяется, пока места
+            // не заполнятся, каталог не кончится или не истечёт бюджет (тогда выдача приближённая).
+            for (size_t depth = anytimeDepth(request, reranker);; depth *= 2) {
+                combinedRecs = rankAnytime(request, catalog, depth, deadline, impressions, partial);
+                bool exhausted = combinedRecs.size() < depth;
+                if (reranker) rerank(request, catalog, *reranker, combinedRecs);
+                diversify(request, catalog, combinedRecs);
+                if (applyQuotas(request, catalog, combinedRecs) || exhausted || partial || depth == 0) break;
+            }
+            if (approximate) *approximate = partial;
+            return getRandomizedRecommendations(combinedRecs, request.numRecommendations, request.randomFactor,
+                                                request.randomSeed);
+        }
+        // Квоты без других этапов над полным списком выбираются потоково, без объединённого списка.
+        bool history = impressions && impressions->store && !request.userId.empty();
+        if (hasQuotas(request) && !reranker && !history && request.diversity.empty() &&
+            request.nearDuplicateDistance < 0) {
+            ScoringScratch scratch;
+            return getRandomizedRecommendations(rankWithQuotas(request, catalog, scratch), request.numRecommendations,
+                                                request.randomFactor, request.randomSeed);
+        }
+        auto combinedRecs = rankIndexed(request, catalog, reranker, impressions);
+        diversify(request, catalog, combinedRecs);
+        applyQuotas(request, catalog, combinedRecs);
+        return getRandomizedRecommendations(combinedRecs, request.numRecommendations, request.randomFactor,
+                                            request.randomSeed);
+    }
+
+    // --- Бинарный формат каталога ---
+    //
+    // Каталог произведений можно хранить в бинарном файле, чтобы не разбирать текст при каждом запуске.
+    // Все числа записываются в порядке байт машины (little-endian на поддерживаемых платформах):
+    //   char[8]  магическая строка "RSCATv1\n"
+    //   uint32   число тегов в словаре
+    //   uint64   число произведений
+    //   словарь: для каждого тега uint32 длина имени + байты имени
+    //   произведения: uint32 длина id + байты id, uint32 число тегов,
+    //                 для каждого тега uint32 номер в словаре + double значение,
+    //                 double viewCount, double interactionTime
+    const char kCatalogMagic[8] = { 'R', 'S', 'C', 'A', 'T', 'v', '1', '\n' };
+
+    // Потоковая запись каталога: словарь тегов задаётся заранее, произведения добавляются по одному,
+    // поэтому каталог любого размера не нужно держать в памяти целиком.
+    class CatalogWriter {
+    public:
+        CatalogWriter(const string &path, const vector<string> &tagNames)
+            : file(fopen(path.c_str(), "wb")) {
+            if (!file) return;
+            putBytes(kCatalogMagic, sizeof(kCatalogMagic));
+            putU32(static_cast<uint32_t>(tagNames.size()));
+            putRaw(uint64_t(0)); // число произведений дописывается в finish()
+            for (const auto &name : tagNames) putString(name);
+        }
+
+        ~CatalogWriter() { finish(); }
+
+        bool ok() const { return file != nullptr && !failed; }
+
+        void addWork(const string &id, const vector<uint32_t> &tagIds, const vector<double> &values,
+                     double viewCount, double interactionTime) {
+            if (!file) return;
+            putString(id);
+            putU32(static_cast<uint32_t>(tagIds.size()));
+            for (size_t i = 0; i < tagIds.size(); i++) {
+                putU32(tagIds[i]);
+                putRaw(values[i]);
+            }
+            putRaw(viewCount);
+            putRaw(interactionTime);
+            workCount++;
+        }
+
+        // Сбрасывает буфер и записывает итоговое число произведений в заголовок.
+        bool finish() {
+            if (!file) return false;
+            flush();
+            if (fseek(file, sizeof(kCatalogMagic) + sizeof(uint32_t), SEEK_SET) != 0 ||
+                fwrite(&workCount, sizeof(workCount), 1, file) != 1) {
+                failed = true;
+            }
+            if (fclose(file) != 0) failed = true;
+            file = nullptr;
+            return !failed;
+        }
+
+    private:
+        static const size_t kBufferSize = 1 << 20;
+
+        void putBytes(const void *bytes, size_t n) {
+            if (buffer.size() - used < n) {
+                flush();
+                if (buffer.size() < n) buffer.resize(n);
+            }
+            memcpy(buffer.data() + used, bytes, n);
+            used += n;
+        }
+        template <typename T>
+        void putRaw(T value) { putBytes(&value, sizeof(T)); }
+        void putU32(uint32_t value) { putRaw(value); }
+        void putString(const string &value) {
+            putU32(static_cast<uint32_t>(value.size()));
+            putBytes(value.data(), value.size());
+        }
+        void flush() {
+            if (used > 0 && fwrite(buffer.data(), 1, used, file) != used) failed = true;
+            used = 0;
+        }
+
+        FILE *file;
+        vector<char> buffer = vector<char>(kBufferSize);
+        size_t used = 0;
+        uint64_t workCount = 0;
+        bool failed = false;
+    };
+
+    // Сохранение готового списка произведений в бинарный каталог.
+    bool saveCatalog(const string &path, const vector<Work> &works) {
+        unordered_map<string, uint32_t> tagIndex;
+        vector<string> tagNames;
+        for (const auto &work : works) {
+            for (const auto &tag : work.tags) {
+                if (tagIndex.emplace(tag.name, static_cast<uint32_t>(tagNames.size())).second) {
+                    tagNames.push_back(tag.name);
+                }
+            }
+        }
+        CatalogWriter writer(path, tagNames);
+        vector<uint32_t> tagIds;
+        vector<double> values;
+        for (const auto &work : works) {
+            tagIds.clear();
+            values.clear();
+            for (const auto &tag : work.tags) {
+                tagIds.push_back(tagIndex[tag.name]);
+                values.push_back(tag.value);
+            }
+            writer.addWork(work.id, tagIds, values, work.viewCount, work.interactionTime);
+        }
+        return writer.ok() && writer.finish();
+    }
+
+    // Байт заголовка до словаря: сигнатура, число тегов, число произведений.
+    const size_t kCatalogHeaderBytes = sizeof(kCatalogMagic) + sizeof(uint32_t) + sizeof(uint64_t);
+
+    // Число произведений из заголовка каталога размером size байт; data — хотя бы kCatalogHeaderBytes первых
+    // его байт. false, если сигнатура не та или столько произведений (каждое не короче 24 байт) не поместится.
+    bool catalogWorkCount(const char *data, size_t size, uint64_t &count) {
+        const size_t minWorkBytes = 2 * sizeof(uint32_t) + 2 * sizeof(double);
+        if (size < kCatalogHeaderBytes || memcmp(data, kCatalogMagic, sizeof(kCatalogMagic)) != 0) return false;
+        memcpy(&count, data + sizeof(kCatalogMagic) + sizeof(uint32_t), sizeof(count));
+        return count <= (size - kCatalogHeaderBytes) / minWorkBytes;
+    }
+
+    // Разбор бинарного каталога из буфера в памяти в заранее выделенные места dest[0 .. count): произведения
+    // заполняются на месте, без промежуточного вектора. Число произведений в заголовке должно быть равно count.
+    // Возвращает false, если данные повреждены или обрываются.
+    bool parseCatalogInto(const char *data, size_t size, Work *dest, uint64_t count) {
+        size_t pos = 0;
+        auto get = [&](void *out, size_t n) {
+            if (size - pos < n) return false;
+            memcpy(out, data + pos, n);
+            pos += n;
+            return true;
+        };
+        auto getString = [&](string &out) {
+            uint32_t len;
+            if (!get(&len, sizeof(len)) || size - pos < len) return false;
+            out.assign(data + pos, len);
+            pos += len;
+            return true;
+        };
+        char magic[sizeof(kCatalogMagic)];
+        uint32_t tagCount;
+        uint64_t workCount;
+        if (!get(magic, sizeof(magic)) || memcmp(magic, kCatalogMagic, sizeof(magic)) != 0) return false;
+        if (!get(&tagCount, sizeof(tagCount)) || !get(&workCount, sizeof(workCount)) || workCount != count) {
+            return false;
+        }
+        vector<string> tagNames(tagCount);
+        for (auto &name : tagNames) {
+            if (!getString(name)) return false;
+        }
+        for (uint64_t i = 0; i < workCount; i++) {
+            Work &work = dest[i];
+            uint32_t numTags;
+            if (!getString(work.id) || !get(&numTags, sizeof(numTags))) return false;
+            if ((size - pos) / (sizeof(uint32_t) + sizeof(double)) < numTags) return false;
+            work.tags.resize(numTags);
+            for (auto &tag : work.tags) {
+                uint32_t tagId = 0;
+                get(&tagId, sizeof(tagId));
+                get(&tag.value, sizeof(tag.value));
+                if (tagId >= tagCount) return false;
+                tag.name = tagNames[tagId];
+            }
+            if (!get(&work.viewCount, sizeof(double)) || !get(&work.interactionTime, sizeof(double))) return false;
+        }
+        return pos == size;
+    }
+
+    // Разбор бинарного каталога из буфера в памяти; произведения добавляются в конец works.
+    // Возвращает false (works не меняется), если данные повреждены или обрываются.
+    bool parseCatalog(const char *data, size_t size, vector<Work> &works) {
+        uint64_t count;
+        if (!catalogWorkCount(data, size, count)) return false;
+        size_t first = works.size();
+        works.resize(first + count);
+        if (parseCatalogInto(data, size, works.data() + first, count)) return true;
+        works.resize(first);
+        return false;
+    }
+
+    // --- Загрузка каталога из шардов ---
+    //
+    // Каталог можно разбить на несколько файлов того же формата (Gen --catalog-shards); loadCatalog принимает
+    // их через запятую, работы идут в порядке файлов. Файлы читаются блоками по kShardChunk, и по всем шардам
+    // сразу в полёте до kShardQueueDepth чтений — через io_uring, а если ядро его не даёт (или он отказал
+    // посреди загрузки) — оставшееся дочитывается pread из пула потоков. Шард, прочитанный целиком, сразу
+    // уходит разборщику, пока остальные ещё читаются.
+    const size_t kShardChunk = 4 << 20;
+    const unsigned kShardQueueDepth = 32;
+    const unsigned kPreadThreads = 8;
+
+    // Параметры чтения шардов; значения не по умолчанию нужны --difftest, чтобы пройти путь отказа io_uring.
+    struct ShardLoadOptions {
+        size_t chunkBytes = kShardChunk;
+        unsigned uringFailAfter = 0;           // после стольких отправок io_uring считается отказавшим (0 — нет)
+    };
+
+    // Минимальная обёртка над системными вызовами io_uring (без liburing): очередь отправки и завершений
+    // одного потока.
+    class IoUring {
+    public:
+        ~IoUring() {
+            if (sqes) munmap(sqes, sqesBytes);
+            if (cqRing && cqRing != sqRing) munmap(cqRing, cqBytes);
+            if (sqRing) munmap(sqRing, sqBytes);
+            if (fd >= 0) close(fd);
+        }
+
+        bool init(unsigned entries) {
+            io_uring_params params {};
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0) return false;
+            sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single) sqBytes = cqBytes = max(sqBytes, cqBytes);
+            sqRing = mapRegion(sqBytes, IORING_OFF_SQ_RING);
+            cqRing = single ? sqRing : mapRegion(cqBytes, IORING_OFF_CQ_RING);
+            sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe *>(mapRegion(sqesBytes, IORING_OFF_SQES));
+            if (!sqRing || !cqRing || !sqes) return false;
+            sqHead = field(sqRing, params.sq_off.head);
+            sqTail = field(sqRing, params.sq_off.tail);
+            sqMask = *field(sqRing, params.sq_off.ring_mask);
+            sqArray = field(sqRing, params.sq_off.array);
+            sqEntries = params.sq_entries;
+            cqHead = field(cqRing, params.cq_off.head);
+            cqTail = field(cqRing, params.cq_off.tail);
+            cqMask = *field(cqRing, params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(cqRing) + params.cq_off.cqes);
+            return true;
+        }
+
+        // Ставит чтение в очередь отправки; false — очередь полна.
+        bool queueRead(int file, char *buffer, uint32_t length, uint64_t offset, uint64_t userData) {
+            unsigned tail = *sqTail;
+            if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) return false;
+            unsigned index = tail & sqMask;
+            io_uring_sqe &sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_READ;
+            sqe.fd = file;
+            sqe.addr = reinterpret_cast<uint64_t>(buffer);
+            sqe.len = length;
+            sqe.off = offset;
+            sqe.user_data = userData;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            queued++;
+            return true;
+        }
+
+        // Отправляет поставленное и ждёт хотя бы одного завершения. Ядро забирает записи очереди отправки
+        // по порядку; сколько ещё не отправлено, сообщает unsubmitted().
+        bool submitAndWait() {
+            while (true) {
+                long n = syscall(__NR_io_uring_enter, fd, queued, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (n >= 0) {
+                    queued -= static_cast<unsigned>(n);
+                    return true;
+                }
+                if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+            }
+        }
+
+        // Ждёт хотя бы одного завершения, ничего не отправляя.
+        bool waitCompletion() {
+            while (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+                if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+            }
+            return true;
+        }
+
+        unsigned unsubmitted() const { return queued; }
+
+        // Снимает с очереди отправки записи, которые ядро ещё не забрало: они уже не будут выполнены.
+        void dropUnsubmitted() {
+            __atomic_store_n(sqTail, *sqTail - queued, __ATOMIC_RELEASE);
+            queued = 0;
+        }
+
+        bool nextCompletion(uint64_t &userData, int32_t &result) {
+            unsigned head = *cqHead;
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+            const io_uring_cqe &cqe = cqes[head & cqMask];
+            userData = cqe.user_data;
+            result = cqe.res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+    private:
+        void *mapRegion(size_t bytes, off_t offset) {
+            void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+            return p == MAP_FAILED ? nullptr : p;
+        }
+        static unsigned *field(void *ring, uint32_t offset) {
+            return reinterpret_cast<unsigned *>(static_cast<char *>(ring) + offset);
+        }
+
+        int fd = -1;
+        void *sqRing = nullptr, *cqRing = nullptr;
+        size_t sqBytes = 0, cqBytes = 0, sqesBytes = 0;
+        io_uring_sqe *sqes = nullptr;
+        io_uring_cqe *cqes = nullptr;
+        unsigned *sqHead = nullptr, *sqTail = nullptr, *sqArray = nullptr, *cqHead = nullptr, *cqTail = nullptr;
+        unsigned sqMask = 0, sqEntries = 0, cqMask = 0, queued = 0;
+    };
+
+    struct ShardFile {
+        int fd = -1;
+        size_t size = 0;
+        unique_ptr<char[]> data;
+        atomic<size_t> missing { 0 };          // ещё не прочитано байт
+        uint64_t count = 0;                    // произведений по заголовку
+        Work *works = nullptr;                 // места этих произведений в общем векторе
+        bool parsed = false;
+    };
+
+    struct ShardChunk {
+        size_t shard;
+        size_t offset;
+        size_t length;
+    };
+
+    // Разбор шардов по мере их готовности в threads потоках (больше, чем шардов, не нужно).
+    class ShardParser {
+    public:
+        ShardParser(vector<ShardFile> &shards, int threads) : shards(shards) {
+            for (int t = 0; t < threads; t++) pool.emplace_back(&ShardParser::work, this);
+        }
+
+        ~ShardParser() { finish(); }
+
+        void ready(size_t shard) {
+            {
+                lock_guard<mutex> lock(guard);
+                queue.push_back(shard);
+            }
+            wake.notify_one();
+        }
+
+        void finish() {
+            {
+                lock_guard<mutex> lock(guard);
+                closed = true;
+            }
+            wake.notify_all();
+            for (auto &t : pool) t.join();
+            pool.clear();
+        }
+
+    private:
+        void work() {
+            while (true) {
+                size_t s;
+                {
+                    unique_lock<mutex> lock(guard);
+                    wake.wait(lock, [&] { return closed || !queue.empty(); });
+                    if (queue.empty()) return;
+                    s = queue.front();
+                    queue.pop_front();
+                }
+                ShardFile &shard = shards[s];
+                shard.parsed = parseCatalogInto(shard.data.get(), shard.size, shard.works, shard.count);
+                shard.data.reset();
+            }
+        }
+
+        vector<ShardFile> &shards;
+        vector<thread> pool;
+        mutex guard;
+        condition_variable wake;
+        deque<size_t> queue;
+        bool closed = false;
+    };
+
+    // Чтение через io_uring. Чтения, которые не удалось выполнить (io_uring недоступен или вернул ошибку),
+    // остаются в pending для pread. Возвращает 1, если всё прочитано, 0 — io_uring не использовался или
+    // отказал (остаток в pending), -1 — отправленных ядру чтений не удалось дождаться: они могут ещё писать
+    // в буферы шардов, поэтому дочитывать pread нельзя.
+    int readShardsUring(vector<ShardFile> &shards, deque<ShardChunk> &pending, ShardParser &parser,
+                        const ShardLoadOptions &options) {
+        IoUring ring;
+        if (!ring.init(kShardQueueDepth)) return 0;
+        vector<ShardChunk> slots(kShardQueueDepth);
+        vector<uint64_t> freeSlots;
+        for (uint64_t i = 0; i < kShardQueueDepth; i++) freeSlots.push_back(i);
+        deque<uint64_t> unsent;                // поставленные, но ещё не отправленные слоты, в порядке очереди
+        bool failed = false;
+        auto collect = [&]() {
+            uint64_t slot;
+            int32_t result;
+            while (ring.nextCompletion(slot, result)) {
+                ShardChunk c = slots[slot];
+                freeSlots.push_back(slot);
+                if (result < 0 && result != -EINTR && result != -EAGAIN) failed = true;
+                if (result <= 0) {
+                    // Ошибка (чтение дочитает pread) или конец файла раньше ожидаемого (файл укоротили).
+                    if (result < 0) pending.push_back(c);
+                    else failed = true;
+                    continue;
+                }
+                size_t done = static_cast<size_t>(result);
+                if (done < c.length) pending.push_front({ c.shard, c.offset + done, c.length - done });
+                if (shards[c.shard].missing.fetch_sub(done) == done) parser.ready(c.shard);
+            }
+        };
+        for (unsigned submits = 0;; submits++) {
+            while (!failed && !pending.empty() && !freeSlots.empty()) {
+                const ShardChunk &c = pending.front();
+                uint64_t slot = freeSlots.back();
+                if (!ring.queueRead(shards[c.shard].fd, shards[c.shard].data.get() + c.offset,
+                                    static_cast<uint32_t>(c.length), c.offset, slot)) {
+                    break;
+                }
+                slots[slot] = c;
+                freeSlots.pop_back();
+                unsent.push_back(slot);
+                pending.pop_front();
+            }
+            if (freeSlots.size() == kShardQueueDepth) break;   // в полёте ничего нет
+            bool submitted = (options.uringFailAfter == 0 || submits < options.uringFailAfter) &&
+                             ring.submitAndWait();
+            while (unsent.size() > ring.unsubmitted()) unsent.pop_front();
+            if (!submitted) {
+                // Не отправленные ядру чтения снимаются с очереди и уходят pread. Отправленные ещё могут
+                // писать в свои буферы: их завершения собираются до возврата, иначе pread и ядро писали бы
+                // в одни и те же буферы, а кольцо разрушилось бы под чтениями в полёте.
+                ring.dropUnsubmitted();
+                for (uint64_t slot : unsent) {
+                    pending.push_back(slots[slot]);
+                    freeSlots.push_back(slot);
+                }
+                while (freeSlots.size() < kShardQueueDepth) {
+                    if (!ring.waitCompletion()) return -1;
+                    collect();
+                }
+                return 0;
+            }
+            collect();
+        }
+        return failed ? 0 : 1;
+    }
+
+    // Чтение pread из пула потоков; false — ошибка чтения.
+    bool readShardsPread(vector<ShardFile> &shards, const deque<ShardChunk> &pending, ShardParser &parser) {
+        vector<ShardChunk> chunks(pending.begin(), pending.end());
+        atomic<size_t> next { 0 };
+        atomic<bool> failed { false };
+        auto worker = [&]() {
+            for (size_t i; (i = next++) < chunks.size() && !failed;) {
+                ShardChunk c = chunks[i];
+                ShardFile &shard = shards[c.shard];
+                while (c.length > 0) {
+                    ssize_t n = pread(shard.fd, shard.data.get() + c.offset, c.length, static_cast<off_t>(c.offset));
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) {
+                        failed = true;
+                        return;
+                    }
+                    c.offset += static_cast<size_t>(n);
+                    c.length -= static_cast<size_t>(n);
+                    if (shard.missing.fetch_sub(static_cast<size_t>(n)) == static_cast<size_t>(n)) parser.ready(c.shard);
+                }
+            }
+        };
+        vector<thread> pool;
+        for (size_t t = 0; t < min<size_t>(kPreadThreads, chunks.size()); t++) pool.emplace_back(worker);
+        for (auto &t : pool) t.join();
+        return !failed;
+    }
+
+    // Числа произведений шардов читаются из заголовков заранее, общий вектор выделяется один раз, и каждый
+    // шард разбирается сразу в свой участок: без векторов шардов и их последующего слияния.
+    bool loadCatalogShards(const vector<string> &paths, vector<Work> &works, const ShardLoadOptions &options = {}) {
+        vector<ShardFile> shards(paths.size());
+        deque<ShardChunk> pending;
+        size_t first = works.size(), total = 0;
+        bool ok = true;
+        for (size_t s = 0; s < paths.size() && ok; s++) {
+            ShardFile &shard = shards[s];
+            shard.fd = open(paths[s].c_str(), O_RDONLY);
+            struct stat st {};
+            char header[kCatalogHeaderBytes];
+            ok = shard.fd >= 0 && fstat(shard.fd, &st) == 0 &&
+                 pread(shard.fd, header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+                 catalogWorkCount(header, static_cast<size_t>(st.st_size), shard.count);
+            if (!ok) break;
+            shard.size = static_cast<size_t>(st.st_size);
+            shard.data.reset(new char[shard.size]);
+            shard.missing = shard.size;
+            total += shard.count;
+            for (size_t offset = 0; offset < shard.size; offset += options.chunkBytes) {
+                pending.push_back({ s, offset, min(options.chunkBytes, shard.size - offset) });
+            }
+        }
+        if (ok) {
+            works.resize(first + total);
+            Work *next = works.data() + first;
+            for (auto &shard : shards) {
+                shard.works = next;
+                next += shard.count;
+            }
+            unsigned threads = min<size_t>(max(1u, thread::hardware_concurrency()), shards.size());
+            ShardParser parser(shards, static_cast<int>(threads));
+            int uring = readShardsUring(shards, pending, parser, options);
+            if (uring == 0 && !pending.empty()) ok = readShardsPread(shards, pending, parser);
+            parser.finish();
+            if (uring < 0) {
+                // Ядро может ещё писать в буферы недочитанных шардов: они намеренно не освобождаются.
+                for (auto &shard : shards) shard.data.release();
+                ok = false;
+            }
+        }
+        for (auto &shard : shards) {
+            if (shard.fd >= 0) close(shard.fd);
+            ok = ok && shard.parsed;
+        }
+        if (!ok) works.resize(first);
+        return ok;
+    }
+
+    // Загрузка бинарного каталога из файла (или из шардов, перечисленных через запятую).
+    // Файл отображается в память и разбирается на месте, без копирования в промежуточный буфер.
+    bool loadCatalog(const string &path, vector<Work> &works) {
+        if (path.find(',') != string::npos) {
+            vector<string> paths;
+            stringstream ss(path);
+            string item;
+            while (getline(ss, item, ',')) {
+                if (!item.empty()) paths.push_back(item);
+            }
+            return loadCatalogShards(paths, works);
+        }
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st {};
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        if (size == 0) {
+            close(fd);
+            return parseCatalog("", 0, works);
+        }
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) return false;
+        madvise(data, size, MADV_SEQUENTIAL);
+        bool ok = parseCatalog(static_cast<const char *>(data), size, works);
+        munmap(data, size);
+        return ok;
+    }
+
+} // namespace RecSys
+
+// --- Вспомогательная функция для удаления пробелов в начале и конце строки.
+string trim(const string &s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+//
+// --- Чтение запроса и вывод результата ---
+//
+// Формат входных данных (стандартный ввод или тело запроса к серверу):
+//
+// USER_PROFILE
+// <число тегов пользователя>
+// Для каждого тега: <имя_тега> <значение>
+//
+// WORKS
+// <число произведений>
+// Для каждого произведения:
+//   <идентификатор работы>
+//   <число тегов>
+//   Для каждого тега: <имя_тега> <значение>
+//   <viewCount> <interactionTime>   (метрики – число просмотров и время взаимодействия)
+//
+// SIMILAR_USERS
+// <число похожих пользователей>
+// Для каждого похожего пользователя:
+//   <идентификатор пользователя>
+//   <коэффициент сходства>
+//   <число понравившихся работ>
+//   Для каждого: <идентификатор работы>
+//
+// PARAMS
+// <число рекомендаций> <random_factor>
+// METRICS_CONFIG
+// <use_metrics(0/1)> <weight_views> <weight_time> <weight_tags>
+//
+// COMBINE_WEIGHTS   (необязательная секция, по умолчанию 0.5 0.5)
+// <content_weight> <collab_weight>
+//
+// EXCLUDE           (необязательная секция: работы, которых не должно быть в выдаче)
+// <число работ>
+// Для каждой: <идентификатор работы>
+//
+// DIVERSITY         (необязательная секция: этап разнообразия над первыми top кандидатами)
+// <режим: mmr | coverage> <lambda> <top>
+//
+// NEAR_DUPLICATES   (необязательная секция: работы, чей SimHash тегов отличается от уже выбранной
+//                    не больше чем в max_distance разрядах, не выдаются)
+// <max_distance>
+//
+// QUOTAS            (необязательная секция: квоты выдачи, 0 — без ограничения)
+// <не больше работ на основной тег> <не меньше свежих работ> <свежая — просмотров не больше>
+//
+// DEADLINE          (необязательная секция: бюджет времени на оценку; по его истечении выдача собирается
+//                    из уже оценённых популярных работ и помечается "approximate": true)
+// <миллисекунды>
+//
+// PAGE              (необязательная секция, только для --serve: постраничная выдача)
+// <размер страницы> <курсор из прошлого ответа или - для первой страницы>
+//
+// USER_ID           (необязательная секция: идентификатор для истории показов сервера)
+// <идентификатор пользователя>
+//
+// REQUIRED_TAGS     (необязательные секции: в выдаче только работы со всеми обязательными тегами
+// FORBIDDEN_TAGS     и без запрещённых; работы вне каталога при обязательных тегах не выдаются)
+// <число тегов>
+// Для каждого: <имя_тега>
+//
+// Секции могут идти в любом порядке, строки вне секций пропускаются.
+//
+
+// Чтение запроса из потока. Возвращает false, если данные оборваны или некорректны.
+bool readRequest(istream &in, RecSys::Request &request) {
+    string line;
+    bool any = false;
+    while (getline(in, line)) {
+        string section = trim(line);
+        if (section == "USER_PROFILE") {
+            int numUserTags = 0;
+            in >> numUserTags;
+            for (int i = 0; i < numUserTags && in; i++) {
+                RecSys::Tag tag;
+                in >> tag.name >> tag.value;
+                request.user.tags.push_back(tag);
+            }
+        } else if (section == "WORKS") {
+            int numWorks = 0;
+            in >> numWorks;
+            for (int i = 0; i < numWorks && in; i++) {
+                RecSys::Work work;
+                int numTags = 0;
+                in >> work.id >> numTags;
+                for (int j = 0; j < numTags && in; j++) {
+                    RecSys::Tag tag;
+                    in >> tag.name >> tag.value;
+                    work.tags.push_back(tag);
+                }
+                in >> work.viewCount >> work.interactionTime;
+                request.works.push_back(move(work));
+            }
+        } else if (section == "SIMILAR_USERS") {
+            int numSimilarUsers = 0;
+            in >> numSimilarUsers;
+            for (int i = 0; i < numSimilarUsers && in; i++) {
+                RecSys::SimilarUser user;
+                int numLiked = 0;
+                in >> user.id >> user.similarity >> numLiked;
+                for (int j = 0; j < numLiked && in; j++) {
+                    string workId;
+                    in >> workId;
+                    user.likedWorks.push_back(workId);
+                }
+                request.similarUsers.push_back(move(user));
+            }
+        } else if (section == "PARAMS") {
+            in >> request.numRecommendations >> request.randomFactor;
+        } else if (section == "METRICS_CONFIG") {
+            int useMetricsInt = 0;
+            in >> useMetricsInt >> request.config.weightViews >> request.config.weightTime
+               >> request.config.weightTags;
+            request.config.useMetrics = useMetricsInt != 0;
+        } else if (section == "COMBINE_WEIGHTS") {
+            in >> request.contentWeight >> request.collabWeight;
+        } else if (section == "REQUIRED_TAGS" || section == "FORBIDDEN_TAGS") {
+            auto &tags = (section == "REQUIRED_TAGS") ? request.requiredTags : request.forbiddenTags;
+            int numTags = 0;
+            in >> numTags;
+            for (int i = 0; i < numTags && in; i++) {
+                string name;
+                in >> name;
+                tags.push_back(name);
+            }
+        } else if (section == "DIVERSITY") {
+            in >> request.diversity >> request.diversityLambda >> request.diversityTop;
+        } else if (section == "NEAR_DUPLICATES") {
+            in >> request.nearDuplicateDistance;
+        } else if (section == "QUOTAS") {
+            in >> request.maxPerPrimaryTag >> request.minFresh >> request.freshMaxViews;
+        } else if (section == "DEADLINE") {
+            in >> request.deadlineMs;
+        } else if (section == "PAGE") {
+            in >> request.pageSize >> request.cursor;
+            if (request.cursor == "-") request.cursor.clear();
+        } else if (section == "USER_ID") {
+            in >> request.userId;
+        } else if (section == "EXCLUDE") {
+            int numExcluded = 0;
+            in >> numExcluded;
+            for (int i = 0; i < numExcluded && in; i++) {
+                string workId;
+                in >> workId;
+                request.excludedWorks.push_back(workId);
+            }
+        } else {
+            continue;
+        }
+        if (in.fail()) return false;
+        any = true;
+    }
+    return any;
+}
+
+// Запись запроса во входном формате (обратная операция к readRequest).
+void writeRequest(ostream &out, const RecSys::Request &request) {
+    out << setprecision(17);
+    out << "USER_PROFILE\n" << request.user.tags.size() << "\n";
+    for (const auto &tag : request.user.tags) out << tag.name << " " << tag.value << "\n";
+    out << "WORKS\n" << request.works.size() << "\n";
+    for (const auto &work : request.works) {
+        out << work.id << "\n" << work.tags.size() << "\n";
+        for (const auto &tag : work.tags) out << tag.name << " " << tag.value << "\n";
+        out << work.viewCount << " " << work.interactionTime << "\n";
+    }
+    out << "SIMILAR_USERS\n" << request.similarUsers.size() << "\n";
+    for (const auto &user : request.similarUsers) {
+        out << user.id << "\n" << user.similarity << "\n" << user.likedWorks.size() << "\n";
+        for (const auto &workId : user.likedWorks) out << workId << "\n";
+    }
+    out << "PARAMS\n" << request.numRecommendations << " " << request.randomFactor << "\n";
+    out << "METRICS_CONFIG\n" << (request.config.useMetrics ? 1 : 0) << " " << request.config.weightViews << " "
+        << request.config.weightTime << " " << request.config.weightTags << "\n";
+    out << "COMBINE_WEIGHTS\n" << request.contentWeight << " " << request.collabWeight << "\n";
+    if (!request.diversity.empty()) {
+        out << "DIVERSITY\n" << request.diversity << " " << request.diversityLambda << " " << request.diversityTop << "\n";
+    }
+    if (request.nearDuplicateDistance >= 0) out << "NEAR_DUPLICATES\n" << request.nearDuplicateDistance << "\n";
+    if (RecSys::hasQuotas(request)) {
+        out << "QUOTAS\n" << request.maxPerPrimaryTag << " " << request.minFresh << " " << request.freshMaxViews << "\n";
+    }
+    if (request.deadlineMs > 0) out << "DEADLINE\n" << request.deadlineMs << "\n";
+    if (request.pageSize > 0) {
+        out << "PAGE\n" << request.pageSize << " " << (request.cursor.empty() ? "-" : request.cursor) << "\n";
+    }
+    if (!request.userId.empty()) out << "USER_ID\n" << request.userId << "\n";
+    if (!request.requiredTags.empty()) {
+        out << "REQUIRED_TAGS\n" << request.requiredTags.size() << "\n";
+        for (const auto &name : request.requiredTags) out << name << "\n";
+    }
+    if (!request.forbiddenTags.empty()) {
+        out << "FORBIDDEN_TAGS\n" << request.forbiddenTags.size() << "\n";
+        for (const auto &name : request.forbiddenTags) out << name << "\n";
+    }
+    if (!request.excludedWorks.empty()) {
+        out << "EXCLUDE\n" << request.excludedWorks.size() << "\n";
+        for (const auto &workId : request.excludedWorks) out << workId << "\n";
+    }
+}
+
+// Список идентификаторов работ (по одному через пробельные символы) — например, запреты политики для --blocklist.
+bool loadIdList(const string &path, vector<string> &ids) {
+    ifstream in(path);
+    if (!in) return false;
+    string id;
+    while (in >> id) ids.push_back(id);
+    return true;
+}
+
+// Файл весов — запрос из секций METRICS_CONFIG и COMBINE_WEIGHTS (так его пишет --train).
+// Веса из файла заменяют веса запроса.
+bool loadWeights(const string &path, RecSys::Request &weights) {
+    ifstream in(path);
+    return in && readRequest(in, weights);
+}
+
+void applyWeights(const RecSys::Request &weights, RecSys::Request &request) {
+    request.config = weights.config;
+    request.contentWeight = weights.contentWeight;
+    request.collabWeight = weights.collabWeight;
+}
+
+// Аргументы бюджетов двухэтапного конвейера (--budget-*), общие для основного режима, --serve и --eval.
+// Возвращает false, если аргумент к бюджетам не относится.
+bool parseBudgetArg(const string &arg, const function<string()> &value, RecSys::StageBudgets &budgets) {
+    if (arg == "--budget-tags") budgets.profileTags = stoi(value());
+    else if (arg == "--budget-postings") budgets.postingsPerTag = stoi(value());
+    else if (arg == "--budget-neighbors") budgets.neighbors = stoi(value());
+    else if (arg == "--budget-popular") budgets.popular = stoi(value());
+    else if (arg == "--budget-candidates") budgets.maxCandidates = stoi(value());
+    else return false;
+    return true;
+}
+
+// Разбиение потока на блоки, начинающиеся строкой-маркером (например, EVAL_USER); текст до первого
+// маркера пропускается.
+void readBlocks(istream &in, const string &marker, vector<string> &blocks) {
+    string line;
+    bool inside = false;
+    while (getline(in, line)) {
+        if (trim(line) == marker) {
+            blocks.emplace_back();
+            inside = true;
+        } else if (inside) {
+            blocks.back() += line;
+            blocks.back() += '\n';
+        }
+    }
+}
+
+// Поиск секции name в тексте блока: поток встаёт сразу за её заголовком. Возвращает false, если секции нет.
+bool seekSection(istream &in, const string &name) {
+    string line;
+    while (getline(in, line)) {
+        if (trim(line) == name) return true;
+    }
+    return false;
+}
+
+// Вывод результата в формате JSON.
+// fields — дополнительные поля ответа (имя и уже готовое значение JSON) после списка рекомендаций.
+void writeRecommendations(ostream &out, const vector<pair<string, double>> &finalRecs,
+                          const vector<pair<string, string>> &fields = {}) {
+    out << "{\n  \"recommendations\": [\n";
+    for (size_t i = 0; i < finalRecs.size(); i++) {
+        out << "    { \"id\": \"" << finalRecs[i].first << "\", \"score\": " << finalRecs[i].second << " }";
+        if(i < finalRecs.size() - 1) out << ",";
+        out << "\n";
+    }
+    out << "  ]";
+    for (const auto &field : fields) out << ",\n  \"" << field.first << "\": " << field.second;
+    out << "\n}\n";
+}
+
+//
+// --- Микробенчмарки ядер RecSys (режим --bench) ---
+//
+// Каждое ядро прогоняется на синтетических данных с перебором параметров:
+// размер каталога, число тегов у работы, длина профиля, число похожих пользователей и k.
+// Для каждой точки выводится время на вызов, время на один элемент (работу) и элементов в секунду.
+// Результат можно сохранить в CSV (--out) и сравнить с базовым прогоном (--baseline):
+// при замедлении больше допуска (--tolerance) программа завершается с кодом 1.
+//
+namespace Bench {
+
+    // Параметры одной точки перебора.
+    struct BenchPoint {
+        int catalogSize;
+        int tagsPerWork;
+        int profileLength;
+        int similarUsers;
+        int k;
+        int candidates = 0;          // кандидатов на входе этапа переранжирования или разнообразия
+        int trees = 0;               // деревьев в ансамбле переранжирования
+        int shortList = 0;           // длина короткого списка пересечения
+    };
+
+    // Результат замера одного ядра в одной точке.
+    struct BenchResult {
+        string kernel;
+        BenchPoint point;
+        double nsPerOp;
+        double itemsPerOp;
+    };
+
+    // Настройки запуска бенчмарков.
+    struct BenchOptions {
+        double minTimeSec = 0.1;     // минимальное время одного повтора замера
+        int repetitions = 5;         // число повторов, берётся медиана
+        string filter;               // подстрока имени ядра (пусто — все ядра)
+        string outPath;              // куда сохранить CSV с результатами
+        string baselinePath;         // CSV базового прогона для сравнения
+        double tolerance = 0.10;     // допустимое относительное замедление
+        bool quick = false;          // сокращённый перебор (для быстрой проверки)
+    };
+
+    // Число тегов в словаре синтетических данных.
+    const int kVocabularySize = 512;
+    // Число понравившихся работ у каждого похожего пользователя.
+    const int kLikedPerUser = 20;
+
+    // Не даёт компилятору выбросить вычисления, результат которых не используется.
+    volatile double benchSink = 0;
+
+    string tagName(int index) {
+        return "tag" + to_string(index);
+    }
+
+    // Набор различных тегов из словаря со случайными весами.
+    vector<RecSys::Tag> makeTags(int count, mt19937 &rng) {
+        uniform_int_distribution<int> pick(0, kVocabularySize - 1);
+        uniform_real_distribution<double> weight(0.05, 1.0);
+        vector<RecSys::Tag> tags;
+        vector<bool> used(kVocabularySize, false);
+        while (static_cast<int>(tags.size()) < min(count, kVocabularySize)) {
+            int t = pick(rng);
+            if (used[t]) continue;
+            used[t] = true;
+            tags.push_back({tagName(t), weight(rng)});
+        }
+        return tags;
+    }
+
+    vector<RecSys::Work> makeWorks(int count, int tagsPerWork, mt19937 &rng) {
+        uniform_real_distribution<double> views(0, 1e6);
+        uniform_real_distribution<double> time(0, 600);
+        vector<RecSys::Work> works;
+        works.reserve(count);
+        for (int i = 0; i < count; i++) {
+            works.push_back({"w" + to_string(i), makeTags(tagsPerWork, rng), views(rng), time(rng)});
+        }
+        return works;
+    }
+
+    vector<RecSys::SimilarUser> makeSimilarUsers(int count, int catalogSize, mt19937 &rng) {
+        uniform_int_distribution<int> pick(0, catalogSize - 1);
+        uniform_real_distribution<double> similarity(0, 1);
+        vector<RecSys::SimilarUser> users;
+        for (int i = 0; i < count; i++) {
+            vector<string> liked;
+            for (int j = 0; j < kLikedPerUser; j++) {
+                liked.push_back("w" + to_string(pick(rng)));
+            }
+            users.push_back({"u" + to_string(i), similarity(rng), liked});
+        }
+        return users;
+    }
+
+    // Замер одного ядра: fn выполняет одну операцию и возвращает число для sink.
+    // Число итераций подбирается так, чтобы повтор длился не меньше minTimeSec;
+    // возвращается медиана времени на операцию по всем повторам (в наносекундах).
+    template <typename Fn>
+    double measureNs(Fn &&fn, const BenchOptions &options) {
+        using Clock = chrono::steady_clock;
+        long long iterations = 1;
+        while (true) {
+            auto start = Clock::now();
+            for (long long i = 0; i < iterations; i++) benchSink = benchSink + fn();
+            double elapsed = chrono::duration<double>(Clock::now() - start).count();
+            if (elapsed >= options.minTimeSec || iterations >= (1LL << 40)) break;
+            double scale = (elapsed > 0) ? options.minTimeSec / elapsed * 1.2 : 10;
+            iterations = max(iterations + 1, static_cast<long long>(iterations * min(scale, 10.0)));
+        }
+        vector<double> samples;
+        for (int r = 0; r < max(1, options.repetitions); r++) {
+            auto start = Clock::now();
+            for (long long i = 0; i < iterations; i++) benchSink = benchSink + fn();
+            double elapsed = chrono::duration<double, nano>(Clock::now() - start).count();
+            samples.push_back(elapsed / iterations);
+        }
+        sort(samples.begin(), samples.end());
+        return samples[samples.size() / 2];
+    }
+
+    // Ключ точки для сравнения с базовым прогоном.
+    string resultKey(const string &kernel, const BenchPoint &p) {
+        ostringstream key;
+        key << kernel << "/n=" << p.catalogSize << "/tags=" << p.tagsPerWork << "/profile=" << p.profileLength
+            << "/users=" << p.similarUsers << "/k=" << p.k;
+        if (p.candidates > 0) key << "/candidates=" << p.candidates;
+        if (p.trees > 0) key << "/trees=" << p.trees;
+        if (p.shortList > 0) key << "/short=" << p.shortList;
+        return key.str();
+    }
+
+    // Генератор данных точки: зерно выводится из имени группы ядер и параметров точки, поэтому данные
+    // точки не зависят от того, какие ядра выбраны --filter и в каком порядке они замеряются.
+    mt19937 pointRng(const string &group, const BenchPoint &p) {
+        uint64_t hash = 14695981039346656037ULL;   // FNV-1a
+        for (char c : resultKey(group, p)) hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+        return mt19937(static_cast<uint32_t>(hash ^ (hash >> 32)));
+    }
+
+    bool selected(const string &kernel, const BenchOptions &options) {
+        return options.filter.empty() || kernel.find(options.filter) != string::npos;
+    }
+
+    vector<BenchResult> runAll(const BenchOptions &options) {
+        vector<BenchResult> results;
+        RecSys::MetricsConfig config { true, 0.2, 0.1, 1.0 };
+
+        vector<int> catalogSizes = options.quick ? vector<int>{1000, 10000} : vector<int>{1000, 10000, 100000};
+        vector<int> tagsPerWork = options.quick ? vector<int>{8} : vector<int>{4, 16, 64};
+        vector<int> profileLengths = options.quick ? vector<int>{16} : vector<int>{4, 16, 64};
+        vector<int> similarCounts = options.quick ? vector<int>{10, 100} : vector<int>{10, 100, 1000};
+        vector<int> ks = options.quick ? vector<int>{10, 100} : vector<int>{10, 100, 1000};
+        const int defaultTags = 8, defaultProfile = 16;
+
+        auto record = [&](const string &kernel, const BenchPoint &p, double ns, double items) {
+            results.push_back({kernel, p, ns, items});
+            cerr << "  " << left << setw(64) << resultKey(kernel, p) << right << fixed << setprecision(1)
+                 << setw(14) << ns << " ns/op" << setw(12) << ns / items << " ns/work\n";
+        };
+
+        // Ядра, работающие с одной работой: перебор тегов у работы и длины профиля.
+        for (int tags : tagsPerWork) {
+            for (int profileLength : profileLengths) {
+                BenchPoint p { 1, tags, profileLength, 0, 0 };
+                mt19937 rng = pointRng("work", p);
+                RecSys::UserProfile user { makeTags(profileLength, rng) };
+                auto works = makeWorks(64, tags, rng);
+                size_t next = 0;
+                if (selected("cosineSimilarity", options)) {
+                    double ns = measureNs([&] {
+                        next = (next + 1) % works.size();
+                        return RecSys::cosineSimilarity(user, works[next]);
+                    }, options);
+                    record("cosineSimilarity", p, ns, 1);
+                }
+                if (selected("computeWorkScore", options)) {
+                    double ns = measureNs([&] {
+                        next = (next + 1) % works.size();
+                        return RecSys::computeWorkScore(user, works[next], config, 1e6, 600);
+                    }, options);
+                    record("computeWorkScore", p, ns, 1);
+                }
+            }
+        }
+
+        // Контентные рекомендации: размер каталога × теги у работы × длина профиля.
+        if (selected("recommendContentBased", options)) {
+            for (int n : catalogSizes) {
+                for (int tags : tagsPerWork) {
+                    for (int profileLength : profileLengths) {
+                        BenchPoint p { n, tags, profileLength, 0, 0 };
+                        mt19937 rng = pointRng("recommendContentBased", p);
+                        RecSys::UserProfile user { makeTags(profileLength, rng) };
+                        auto works = makeWorks(n, tags, rng);
+                        double ns = measureNs([&] {
+                            return RecSys::recommendContentBased(user, works, config).front().second;
+                        }, options);
+                        record("recommendContentBased", p, ns, n);
+                    }
+                }
+            }
+        }
+
+        // То же по индексированному каталогу.
+        if (selected("recommendContentBasedIndexed", options)) {
+            for (int n : catalogSizes) {
+                for (int tags : tagsPerWork) {
+                    for (int profileLength : profileLengths) {
+                        BenchPoint p { n, tags, profileLength, 0, 0 };
+                        mt19937 rng = pointRng("recommendContentBasedIndexed", p);
+                        RecSys::UserProfile user { makeTags(profileLength, rng) };
+                        auto catalog = RecSys::buildCatalog(makeWorks(n, tags, rng));
+                        double ns = measureNs([&] {
+                            return RecSys::recommendContentBasedIndexed(user, catalog, config).front().second;
+                        }, options);
+                        record("recommendContentBasedIndexed", p, ns, n);
+                    }
+                }
+            }
+        }
+
+        // Коллаборативная фильтрация: число похожих пользователей.
+        if (selected("recommendCollaborative", options)) {
+            for (int n : catalogSizes) {
+                for (int users : similarCounts) {
+                    BenchPoint p { n, 0, 0, users, 0 };
+                    mt19937 rng = pointRng("recommendCollaborative", p);
+                    auto similar = makeSimilarUsers(users, n, rng);
+                    double ns = measureNs([&] {
+                        return RecSys::recommendCollaborative(similar).front().second;
+                    }, options);
+                    record("recommendCollaborative", p, ns,
+                           static_cast<double>(users) * kLikedPerUser);
+                }
+            }
+        }
+
+        // Объединение: размер каталога × число похожих пользователей.
+        if (selected("combineRecommendations", options)) {
+            for (int n : catalogSizes) {
+                for (int users : similarCounts) {
+                    BenchPoint p { n, defaultTags, defaultProfile, users, 0 };
+                    mt19937 rng = pointRng("combineRecommendations", p);
+                    RecSys::UserProfile user { makeTags(defaultProfile, rng) };
+                    auto works = makeWorks(n, defaultTags, rng);
+                    auto contentRecs = RecSys::recommendContentBased(user, works, config);
+                    auto collabRecs = RecSys::recommendCollaborative(makeSimilarUsers(users, n, rng));
+                    double ns = measureNs([&] {
+                        return RecSys::combineRecommendations(contentRecs, collabRecs, 0.5, 0.5).front().second;
+                    }, options);
+                    record("combineRecommendations", p, ns,
+                           static_cast<double>(contentRecs.size() + collabRecs.size()));
+                }
+            }
+        }
+
+        // Рандомизация выдачи: размер каталога × k.
+        if (selected("getRandomizedRecommendations", options)) {
+            for (int n : catalogSizes) {
+                mt19937 rng = pointRng("getRandomizedRecommendations", { n, defaultTags, defaultProfile, 0, 0 });
+                RecSys::UserProfile user { makeTags(defaultProfile, rng) };
+                auto recs = RecSys::recommendContentBased(user, makeWorks(n, defaultTags, rng), config);
+                for (int k : ks) {
+                    double ns = measureNs([&] {
+                        auto finalRecs = RecSys::getRandomizedRecommendations(recs, k, 0.2);
+                        return finalRecs.empty() ? 0.0 : finalRecs.front().second;
+                    }, options);
+                    record("getRandomizedRecommendations", { n, defaultTags, defaultProfile, 0, k }, ns, k);
+                }
+            }
+        }
+
+        // Переранжирование 1000 кандидатов ансамблем 100 деревьев глубины 4: QuickScorer и прямой обход.
+        if (selected("rerankQuickScorer", options) || selected("rerankTreeTraversal", options)) {
+            const int candidates = 1000, trees = 100;
+            auto model = RecSys::randomEnsemble(trees, 4, 99);
+            auto scorer = RecSys::buildQuickScorer(model);
+            BenchPoint p { 0, 0, 0, 0, 0, candidates, trees };
+            mt19937 rng = pointRng("rerank", p);
+            uniform_real_distribution<float> unit(0, 1);
+            vector<float> x(static_cast<size_t>(candidates) * RecSys::kRerankFeatures);
+            for (size_t i = 0; i < x.size(); i++) {
+                int f = static_cast<int>(i % RecSys::kRerankFeatures);
+                x[i] = f == 4 ? floor(unit(rng) * 6) : f == 3 ? unit(rng) * 3 : unit(rng);
+            }
+            vector<double> scores(candidates);
+            vector<uint64_t> bits;
+            if (selected("rerankQuickScorer", options)) {
+                double ns = measureNs([&] {
+                    RecSys::scoreQuick(scorer, x.data(), candidates, scores.data(), bits);
+                    return scores[0];
+                }, options);
+                record("rerankQuickScorer", p, ns, candidates);
+            }
+            if (selected("rerankTreeTraversal", options)) {
+                double ns = measureNs([&] {
+                    double sum = 0;
+                    for (int i = 0; i < candidates; i++) {
+                        sum += RecSys::evaluateTrees(model, &x[static_cast<size_t>(i) * RecSys::kRerankFeatures]);
+                    }
+                    return sum;
+                }, options);
+                record("rerankTreeTraversal", p, ns, candidates);
+            }
+        }
+
+        // Этап разнообразия: выбор k из 1000 лучших кандидатов.
+        if (selected("diversify", options)) {
+            const int catalogSize = 10000, candidates = 1000;
+            mt19937 rng = pointRng("diversify", { catalogSize, defaultTags, defaultProfile, 0, 0, candidates });
+            RecSys::UserProfile user { makeTags(defaultProfile, rng) };
+            auto catalog = RecSys::buildCatalog(makeWorks(catalogSize, defaultTags, rng));
+            RecSys::Request request;
+            request.user = user;
+            auto recs = RecSys::rankIndexed(request, catalog);
+            for (const string mode : { "mmr", "coverage" }) {
+                for (int k : ks) {
+                    request.diversity = mode;
+                    request.diversityTop = candidates;
+                    request.numRecommendations = k;
+                    double ns = measureNs([&] {
+                        auto copy = recs;
+                        RecSys::diversify(request, catalog, copy);
+                        return copy.front().second;
+                    }, options);
+                    record("diversify-" + string(mode), { catalogSize, defaultTags, defaultProfile, 0, k, candidates },
+                           ns, candidates);
+                }
+            }
+            for (int k : ks) {
+                double ns = measureNs([&] {
+                    auto copy = recs;
+                    RecSys::suppressNearDuplicates(catalog, copy, static_cast<size_t>(k), 3);
+                    return copy.front().second;
+                }, options);
+                record("diversify-simhash", { catalogSize, defaultTags, defaultProfile, 0, k, candidates }, ns,
+                       candidates);
+            }
+        }
+
+        // Выдача с квотами (не больше 2 работ на основной тег, половина свежих) потоково из кучи оценок.
+        if (selected("quotaSelect", options)) {
+            RecSys::ScoringScratch scratch;
+            for (int n : catalogSizes) {
+                mt19937 rng = pointRng("quotaSelect", { n, defaultTags, defaultProfile, 0, 0 });
+                auto works = makeWorks(n, defaultTags, rng);
+                auto catalog = RecSys::buildCatalog(works);
+                RecSys::Request request;
+                request.user = { makeTags(defaultProfile, rng) };
+                request.maxPerPrimaryTag = 2;
+                request.freshMaxViews = works[0].viewCount;
+                for (int k : ks) {
+                    request.numRecommendations = k;
+                    request.minFresh = k / 2;
+                    double ns = measureNs([&] {
+                        return RecSys::rankWithQuotas(request, catalog, scratch).size();
+                    }, options);
+                    record("quotaSelect", { n, defaultTags, defaultProfile, 0, k }, ns, n);
+                }
+            }
+        }
+
+        // Оценка по блокам популярности без истечения бюджета (досрочная остановка по границам блоков).
+        if (selected("anytimeScore", options)) {
+            for (int n : catalogSizes) {
+                mt19937 rng = pointRng("anytimeScore", { n, defaultTags, defaultProfile, 0, 0 });
+                auto catalog = RecSys::buildCatalog(makeWorks(n, defaultTags, rng));
+                RecSys::Request request;
+                request.user = { makeTags(defaultProfile, rng) };
+                request.config = { true, 0.5, 0.2, 0.3 };
+                for (int k : ks) {
+                    double ns = measureNs([&] {
+                        bool approximate = false;
+                        return RecSys::rankAnytime(request, catalog, static_cast<size_t>(k),
+                                                   chrono::steady_clock::time_point::max(), nullptr, approximate)
+                            .size();
+                    }, options);
+                    record("anytimeScore", { n, defaultTags, defaultProfile, 0, k }, ns, n);
+                }
+            }
+        }
+
+        // Пересечение отсортированных списков: длина короткого × длина длинного (галоп или SSE2-слияние).
+        if (selected("intersectSorted", options)) {
+            for (int n : catalogSizes) {
+                for (int m : { n / 100, n / 10, n }) {
+                    BenchPoint p { n, 0, 0, 0, 0 };
+                    p.shortList = max(m, 1);
+                    mt19937 rng = pointRng("intersectSorted", p);
+                    auto makeList = [&](int count) {
+                        uniform_int_distribution<uint32_t> pick(0, static_cast<uint32_t>(n) * 4);
+                        vector<uint32_t> list(count);
+                        for (auto &x : list) x = pick(rng);
+                        sort(list.begin(), list.end());
+                        return list;
+                    };
+                    auto small = makeList(p.shortList), large = makeList(n);
+                    vector<uint32_t> out;
+                    double ns = measureNs([&] {
+                        RecSys::intersectSorted(small.data(), small.size(), large.data(), large.size(), out);
+                        return static_cast<double>(out.size());
+                    }, options);
+                    record("intersectSorted", p, ns, static_cast<double>(small.size()));
+                }
+            }
+        }
+
+        // trim: типичные строки входного формата.
+        if (selected("trim", options)) {
+            vector<string> lines = { "USER_PROFILE", "  WORKS\r", "\ttag17 0.4321  ", "w123456", "                " };
+            size_t next = 0;
+            double ns = measureNs([&] {
+                next = (next + 1) % lines.size();
+                return static_cast<double>(trim(lines[next]).size());
+            }, options);
+            record("trim", { 0, 0, 0, 0, 0 }, ns, 1);
+        }
+        return results;
+    }
+
+    bool writeCsv(const string &path, const vector<BenchResult> &results) {
+        ofstream out(path);
+        if (!out) return false;
+        out << "kernel,catalog_size,tags_per_work,profile_length,similar_users,k,candidates,trees,short_list,"
+               "ns_per_op,ns_per_work,items_per_sec\n";
+        out << setprecision(10);
+        for (const auto &r : results) {
+            out << r.kernel << ',' << r.point.catalogSize << ',' << r.point.tagsPerWork << ','
+                << r.point.profileLength << ',' << r.point.similarUsers << ',' << r.point.k << ','
+                << r.point.candidates << ',' << r.point.trees << ',' << r.point.shortList << ',' << r.nsPerOp << ','
+                << r.nsPerOp / r.itemsPerOp << ',' << r.itemsPerOp * 1e9 / r.nsPerOp << '\n';
+        }
+        return static_cast<bool>(out);
+    }
+
+    vector<string> splitCsv(const string &line) {
+        vector<string> fields;
+        stringstream ss(line);
+        string field;
+        while (getline(ss, field, ',')) fields.push_back(field);
+        return fields;
+    }
+
+    // Чтение базового CSV: ключ точки -> ns на работу. Столбцы ищутся по заголовку, так что CSV
+    // прежнего формата (без candidates, trees и short_list) тоже читается.
+    bool readBaseline(const string &path, map<string, double> &baseline) {
+        ifstream in(path);
+        if (!in) return false;
+        string line;
+        getline(in, line);
+        vector<string> header = splitCsv(trim(line));
+        auto column = [&](const string &name) -> int {
+            auto it = find(header.begin(), header.end(), name);
+            return it == header.end() ? -1 : static_cast<int>(it - header.begin());
+        };
+        int candidates = column("candidates"), trees = column("trees"), shortList = column("short_list");
+        int nsPerWork = column("ns_per_work");
+        if (nsPerWork < 6) return false;
+        while (getline(in, line)) {
+            if (trim(line).empty()) continue;
+            vector<string> fields = splitCsv(trim(line));
+            if (static_cast<int>(fields.size()) <= nsPerWork) continue;
+            BenchPoint p { stoi(fields[1]), stoi(fields[2]), stoi(fields[3]), stoi(fields[4]), stoi(fields[5]) };
+            if (candidates >= 0) p.candidates = stoi(fields[candidates]);
+            if (trees >= 0) p.trees = stoi(fields[trees]);
+            if (shortList >= 0) p.shortList = stoi(fields[shortList]);
+            baseline[resultKey(fields[0], p)] = stod(fields[nsPerWork]);
+        }
+        return true;
+    }
+
+    // Точка входа режима --bench. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        BenchOptions options;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            auto value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : ""; };
+            if (arg == "--filter") options.filter = value();
+            else if (arg == "--out") options.outPath = value();
+            else if (arg == "--baseline") options.baselinePath = value();
+            else if (arg == "--tolerance") options.tolerance = stod(value());
+            else if (arg == "--min-time") options.minTimeSec = stod(value());
+            else if (arg == "--repetitions") options.repetitions = stoi(value());
+            else if (arg == "--quick") options.quick = true;
+            else {
+                cerr << "bench: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+
+        auto results = runAll(options);
+
+        // Сводная таблица в стандартный вывод.
+        cout << left << setw(30) << "kernel" << right << setw(9) << "n" << setw(6) << "tags" << setw(8) << "profile"
+             << setw(7) << "users" << setw(6) << "k" << setw(7) << "cands" << setw(6) << "trees" << setw(7) << "short"
+             << setw(14) << "ns/op" << setw(12) << "ns/work" << setw(16) << "items/s" << "\n";
+        for (const auto &r : results) {
+            cout << left << setw(30) << r.kernel << right << setw(9) << r.point.catalogSize << setw(6)
+                 << r.point.tagsPerWork << setw(8) << r.point.profileLength << setw(7) << r.point.similarUsers
+                 << setw(6) << r.point.k << setw(7) << r.point.candidates << setw(6) << r.point.trees << setw(7)
+                 << r.point.shortList << fixed << setprecision(1) << setw(14) << r.nsPerOp << setw(12)
+                 << r.nsPerOp / r.itemsPerOp << setprecision(0) << setw(16) << r.itemsPerOp * 1e9 / r.nsPerOp
+                 << "\n";
+        }
+
+        if (!options.outPath.empty() && !writeCsv(options.outPath, results)) {
+            cerr << "bench: не удалось записать " << options.outPath << "\n";
+            return 2;
+        }
+
+        if (options.baselinePath.empty()) return 0;
+        map<string, double> baseline;
+        if (!readBaseline(options.baselinePath, baseline)) {
+            cerr << "bench: не удалось прочитать " << options.baselinePath << "\n";
+            return 2;
+        }
+        // Регрессия — если время на работу выросло больше допуска относительно базы.
+        int regressions = 0;
+        for (const auto &r : results) {
+            auto it = baseline.find(resultKey(r.kernel, r.point));
+            if (it == baseline.end() || it->second <= 0) continue;
+            double ratio = (r.nsPerOp / r.itemsPerOp) / it->second;
+            if (ratio > 1.0 + options.tolerance) {
+                regressions++;
+                cerr << "REGRESSION " << resultKey(r.kernel, r.point) << ": " << fixed << setprecision(2)
+                     << ratio << "x от базы\n";
+            }
+        }
+        return regressions > 0 ? 1 : 0;
+    }
+
+} // namespace Bench
+
+//
+// --- Генератор синтетических нагрузок (режим --gen) ---
+//
+// Пишет корректный запрос во входном текстовом формате и, по желанию, бинарный каталог
+// (с --catalog-shards N — N файлов <catalog-out>.0 … .N-1 с последовательными диапазонами работ).
+// Распределения подобраны под продуктовые данные:
+//   - популярность тегов — по Ципфу (показатель --tag-zipf);
+//   - viewCount — степенной закон Парето (--views-alpha, --views-min);
+//   - interactionTime — логнормальное (--time-mu, --time-sigma);
+//   - у похожих пользователей доля --overlap лайков берётся из общего пула работ, остальные — случайно.
+// Генератор детерминирован: одинаковый --seed даёт побайтно одинаковый вывод в пределах одной сборки и libm.
+// Собственный ГСЧ и собственные преобразования распределений (а не <random>, чьи распределения различаются
+// между стандартными библиотеками) делают поток случайных чисел переносимым, но pow/exp/log/cos из libm
+// не обязаны округлять одинаково, и на другой платформе отдельные значения могут отличаться в последних битах.
+//
+namespace Gen {
+
+    struct GenOptions {
+        uint64_t seed = 1;
+        long long works = 10000;
+        int vocabulary = 5000;           // размер словаря тегов
+        double tagZipf = 1.1;            // показатель Ципфа популярности тегов
+        int minTags = 3;                 // число тегов у работы — равномерно в [minTags, maxTags]
+        int maxTags = 12;
+        double viewsAlpha = 1.2;         // Парето: P(X > x) = (viewsMin / x)^alpha
+        double viewsMin = 10;
+        double timeMu = 3.5;             // логнормальное: ln X ~ N(mu, sigma^2), в секундах
+        double timeSigma = 1.0;
+        int profileTags = 20;            // длина профиля пользователя
+        int similarUsers = 50;
+        int likesPerUser = 30;
+        double overlap = 0.5;            // доля лайков из общего пула
+        int sharedPool = 200;            // размер общего пула работ
+        int numRecommendations = 10;
+        double randomFactor = 0.2;
+        RecSys::MetricsConfig config { true, 0.2, 0.1, 1.0 };
+        string outPath = "-";            // текстовый запрос ("-" — стандартный вывод)
+        string catalogPath;              // бинарный каталог; если задан, секция WORKS в тексте пустая
+        int catalogShards = 1;           // число файлов каталога
+        bool emitWorks = true;           // false — только запрос к уже загруженному каталогу из works работ
+    };
+
+    // xoshiro256** с инициализацией через splitmix64.
+    struct Rng {
+        uint64_t s[4];
+
+        explicit Rng(uint64_t seed) {
+            for (auto &word : s) {
+                seed += 0x9e3779b97f4a7c15ULL;
+                uint64_t z = seed;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                word = z ^ (z >> 31);
+            }
+        }
+
+        static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+        uint64_t next() {
+            uint64_t result = rotl(s[1] * 5, 7) * 9;
+            uint64_t t = s[1] << 17;
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+            s[2] ^= t;
+            s[3] = rotl(s[3], 45);
+            return result;
+        }
+
+        // Равномерно в [0, 1).
+        double uniform() { return (next() >> 11) * 0x1.0p-53; }
+
+        // Равномерно в [0, n).
+        uint64_t below(uint64_t n) { return static_cast<uint64_t>(uniform() * n); }
+
+        // Стандартное нормальное (Бокс — Мюллер, второе значение отбрасывается ради простоты).
+        double normal() {
+            double u1 = 1.0 - uniform();
+            double u2 = uniform();
+            return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+        }
+    };
+
+    // Таблица псевдонимов (метод Воуза) для выборки из дискретного распределения за O(1).
+    struct AliasTable {
+        vector<double> prob;
+        vector<uint32_t> alias;
+
+        explicit AliasTable(const vector<double> &weights) : prob(weights.size()), alias(weights.size()) {
+            size_t n = weights.size();
+            double total = 0;
+            for (double w : weights) total += w;
+            vector<double> scaled(n);
+            vector<uint32_t> small, large;
+            for (size_t i = 0; i < n; i++) {
+                scaled[i] = weights[i] * n / total;
+                (scaled[i] < 1.0 ? small : large).push_back(static_cast<uint32_t>(i));
+            }
+            while (!small.empty() && !large.empty()) {
+                uint32_t l = small.back(), g = large.back();
+                small.pop_back();
+                prob[l] = scaled[l];
+                alias[l] = g;
+                scaled[g] = scaled[g] + scaled[l] - 1.0;
+                if (scaled[g] < 1.0) {
+                    large.pop_back();
+                    small.push_back(g);
+                }
+            }
+            for (uint32_t i : large) prob[i] = 1.0;
+            for (uint32_t i : small) prob[i] = 1.0;
+        }
+
+        // Одно 64-битное случайное число: старшие 32 бита выбирают ячейку, младшие — монетку.
+        uint32_t sample(Rng &rng) const {
+            uint64_t r = rng.next();
+            uint64_t i = ((r >> 32) * prob.size()) >> 32;
+            return (r & 0xffffffffULL) * 0x1.0p-32 < prob[i] ? static_cast<uint32_t>(i) : alias[i];
+        }
+    };
+
+    // Буферизованная запись текста с быстрым форматированием чисел.
+    class TextWriter {
+    public:
+        explicit TextWriter(FILE *file) : file(file) { buffer.reserve(kBufferSize + 256); }
+        ~TextWriter() { flush(); }
+
+        TextWriter &put(const string &text) {
+            buffer.append(text);
+            return maybeFlush();
+        }
+        TextWriter &put(const char *text) {
+            buffer.append(text);
+            return maybeFlush();
+        }
+        TextWriter &put(long long value) {
+            char tmp[24];
+            auto res = to_chars(tmp, tmp + sizeof(tmp), value);
+            buffer.append(tmp, res.ptr);
+            return maybeFlush();
+        }
+        // Число с фиксированным количеством знаков после запятой.
+        TextWriter &put(double value, int precision) {
+            char tmp[64];
+            auto res = to_chars(tmp, tmp + sizeof(tmp), value, chars_format::fixed, precision);
+            buffer.append(tmp, res.ptr);
+            return maybeFlush();
+        }
+
+        bool flush() {
+            if (!buffer.empty() && fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) failed = true;
+            buffer.clear();
+            return !failed;
+        }
+
+    private:
+        static const size_t kBufferSize = 1 << 20;
+
+        TextWriter &maybeFlush() {
+            if (buffer.size() >= kBufferSize) flush();
+            return *this;
+        }
+
+        FILE *file;
+        string buffer;
+        bool failed = false;
+    };
+
+    // Значения округляются так же, как печатаются в тексте, чтобы текст и бинарный каталог совпадали.
+    double quantize(double value, double step) {
+        return round(value / step) * step;
+    }
+
+    // Вес тега — равномерно в [0.01, 1] с шагом 1e-4 (сразу кратен шагу, без округления).
+    double tagValue(Rng &rng) {
+        return (100 + static_cast<int>(rng.below(9901))) * 1e-4;
+    }
+
+    string tagName(uint32_t index) {
+        return "tag" + to_string(index);
+    }
+
+    // Набор различных тегов по распределению Ципфа.
+    void sampleTags(int count, const AliasTable &tagTable, Rng &rng, vector<uint32_t> &tagIds) {
+        tagIds.clear();
+        count = min<int>(count, static_cast<int>(tagTable.prob.size()));
+        while (static_cast<int>(tagIds.size()) < count) {
+            uint32_t t = tagTable.sample(rng);
+            if (find(tagIds.begin(), tagIds.end(), t) == tagIds.end()) tagIds.push_back(t);
+        }
+    }
+
+    // Пишет сгенерированный запрос в out (и каталог в o.catalogPath, если он задан).
+    bool generate(const GenOptions &o, FILE *out) {
+        Rng rng(o.seed);
+        vector<double> tagWeights(o.vocabulary);
+        for (int i = 0; i < o.vocabulary; i++) tagWeights[i] = 1.0 / pow(i + 1.0, o.tagZipf);
+        AliasTable tagTable(tagWeights);
+        vector<string> tagNames(o.vocabulary);
+        for (int i = 0; i < o.vocabulary; i++) tagNames[i] = tagName(i);
+
+        bool ok = true;
+        {
+            TextWriter text(out);
+            vector<uint32_t> tagIds;
+            vector<double> values;
+
+            // Профиль пользователя: популярные теги встречаются в профилях чаще.
+            sampleTags(o.profileTags, tagTable, rng, tagIds);
+            text.put("USER_PROFILE\n").put(static_cast<long long>(tagIds.size())).put("\n");
+            for (uint32_t t : tagIds) {
+                text.put(tagNames[t]).put(" ").put(tagValue(rng), 4).put("\n");
+            }
+
+            // Произведения: в текст или в бинарный каталог.
+            bool toCatalog = !o.catalogPath.empty() && o.emitWorks;
+            vector<unique_ptr<RecSys::CatalogWriter>> catalogs;
+            for (int shard = 0; toCatalog && shard < o.catalogShards; shard++) {
+                string path = o.catalogShards > 1 ? o.catalogPath + "." + to_string(shard) : o.catalogPath;
+                catalogs.emplace_back(new RecSys::CatalogWriter(path, tagNames));
+                if (!catalogs.back()->ok()) return false;
+            }
+            text.put("WORKS\n").put(toCatalog || !o.emitWorks ? 0LL : o.works).put("\n");
+            string id;
+            for (long long i = 0; o.emitWorks && i < o.works; i++) {
+                int numTags = o.minTags + static_cast<int>(rng.below(o.maxTags - o.minTags + 1));
+                sampleTags(numTags, tagTable, rng, tagIds);
+                values.clear();
+                for (size_t j = 0; j < tagIds.size(); j++) values.push_back(tagValue(rng));
+                double views = quantize(o.viewsMin / pow(1.0 - rng.uniform(), 1.0 / o.viewsAlpha), 1.0);
+                double time = quantize(exp(o.timeMu + o.timeSigma * rng.normal()), 0.01);
+                id = "w" + to_string(i);
+                if (toCatalog) {
+                    size_t shard = static_cast<size_t>(i * o.catalogShards / o.works);
+                    catalogs[shard]->addWork(id, tagIds, values, views, time);
+                    continue;
+                }
+                text.put(id).put("\n").put(static_cast<long long>(tagIds.size())).put("\n");
+                for (size_t j = 0; j < tagIds.size(); j++) {
+                    text.put(tagNames[tagIds[j]]).put(" ").put(values[j], 4).put("\n");
+                }
+                text.put(views, 0).put(" ").put(time, 2).put("\n");
+            }
+            for (auto &catalog : catalogs) {
+                if (!catalog->finish()) ok = false;
+            }
+
+            // Похожие пользователи с пересекающимися лайками.
+            vector<long long> pool(max(1, o.sharedPool));
+            for (auto &w : pool) w = static_cast<long long>(rng.below(o.works));
+            text.put("SIMILAR_USERS\n").put(static_cast<long long>(o.similarUsers)).put("\n");
+            for (int u = 0; u < o.similarUsers; u++) {
+                text.put("u").put(static_cast<long long>(u)).put("\n");
+                text.put(quantize(rng.uniform(), 1e-4), 4).put("\n");
+                text.put(static_cast<long long>(o.likesPerUser)).put("\n");
+                for (int j = 0; j < o.likesPerUser; j++) {
+                    long long w = (rng.uniform() < o.overlap) ? pool[rng.below(pool.size())]
+                                                              : static_cast<long long>(rng.below(o.works));
+                    text.put("w").put(w).put("\n");
+                }
+            }
+
+            text.put("PARAMS\n").put(static_cast<long long>(o.numRecommendations)).put(" ")
+                .put(o.randomFactor, 4).put("\n");
+            text.put("METRICS_CONFIG\n").put(o.config.useMetrics ? 1LL : 0LL).put(" ")
+                .put(o.config.weightViews, 4).put(" ").put(o.config.weightTime, 4).put(" ")
+                .put(o.config.weightTags, 4).put("\n");
+            if (!text.flush()) ok = false;
+        }
+        return ok;
+    }
+
+    // Генерация запроса в строку.
+    bool generateText(const GenOptions &o, string &text) {
+        char *data = nullptr;
+        size_t size = 0;
+        FILE *out = open_memstream(&data, &size);
+        if (!out) return false;
+        bool ok = generate(o, out);
+        fclose(out);
+        if (ok) text.assign(data, size);
+        free(data);
+        return ok;
+    }
+
+    // Каталог для инструментов: бинарный файл, если путь задан, иначе синтетический из syntheticWorks работ.
+    bool loadOrGenerateWorks(const string &catalogPath, long long syntheticWorks, vector<RecSys::Work> &works) {
+        if (!catalogPath.empty()) return RecSys::loadCatalog(catalogPath, works);
+        GenOptions gen;
+        gen.works = syntheticWorks;
+        string text;
+        RecSys::Request request;
+        if (!generateText(gen, text)) return false;
+        istringstream in(text);
+        if (!readRequest(in, request)) return false;
+        works = move(request.works);
+        return true;
+    }
+
+    // Запрос синтетического пользователя к каталогу из catalogWorks работ (без секции WORKS).
+    bool syntheticRequest(uint64_t seed, long long catalogWorks, RecSys::Request &request) {
+        GenOptions gen;
+        gen.seed = seed;
+        gen.works = catalogWorks;
+        gen.emitWorks = false;
+        string text;
+        if (!generateText(gen, text)) return false;
+        istringstream in(text);
+        return readRequest(in, request);
+    }
+
+    // Точка входа режима --gen. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        GenOptions o;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            auto value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : "0"; };
+            if (arg == "--seed") o.seed = stoull(value());
+            else if (arg == "--works") o.works = stoll(value());
+            else if (arg == "--vocabulary") o.vocabulary = stoi(value());
+            else if (arg == "--tag-zipf") o.tagZipf = stod(value());
+            else if (arg == "--min-tags") o.minTags = stoi(value());
+            else if (arg == "--max-tags") o.maxTags = stoi(value());
+            else if (arg == "--views-alpha") o.viewsAlpha = stod(value());
+            else if (arg == "--views-min") o.viewsMin = stod(value());
+            else if (arg == "--time-mu") o.timeMu = stod(value());
+            else if (arg == "--time-sigma") o.timeSigma = stod(value());
+            else if (arg == "--profile-tags") o.profileTags = stoi(value());
+            else if (arg == "--similar-users") o.similarUsers = stoi(value());
+            else if (arg == "--likes") o.likesPerUser = stoi(value());
+            else if (arg == "--overlap") o.overlap = stod(value());
+            else if (arg == "--shared-pool") o.sharedPool = stoi(value());
+            else if (arg == "--k") o.numRecommendations = stoi(value());
+            else if (arg == "--random-factor") o.randomFactor = stod(value());
+            else if (arg == "--out") o.outPath = value();
+            else if (arg == "--catalog-out") o.catalogPath = value();
+            else if (arg == "--catalog-shards") o.catalogShards = stoi(value());
+            else if (arg == "--no-works") o.emitWorks = false;
+            else {
+                cerr << "gen: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+        if (o.works <= 0 || o.vocabulary <= 0 || o.minTags < 0 || o.maxTags < o.minTags || o.catalogShards < 1) {
+            cerr << "gen: некорректные параметры\n";
+            return 2;
+        }
+        FILE *out = (o.outPath == "-") ? stdout : fopen(o.outPath.c_str(), "wb");
+        bool ok = out && generate(o, out);
+        if (out && out != stdout && fclose(out) != 0) ok = false;
+        if (!ok) {
+            cerr << "gen: ошибка записи\n";
+            return 1;
+        }
+        return 0;
+    }
+
+} // namespace Gen
+
+//
+// --- Сетевой протокол резидентного сервера ---
+//
+// Сообщения передаются кадрами: "<длина тела в байтах>\n<тело>".
+// Тело запроса — текст во входном формате (секция WORKS игнорируется: используется загруженный каталог),
+// тело ответа — JSON с рекомендациями или {"error": "..."}.
+//
+namespace Net {
+
+    const size_t kMaxFrame = 256u << 20;
+
+    // Извлекает кадр из buffer начиная с pos: 1 — кадр в payload и pos за ним, 0 — кадр ещё не дочитан,
+    // -1 — ошибка протокола (заголовок не число или тело длиннее kMaxFrame).
+    int takeFrame(const string &buffer, size_t &pos, string &payload) {
+        size_t newline = buffer.find('\n', pos);
+        if (newline == string::npos) return buffer.size() - pos > 32 ? -1 : 0;
+        size_t length = 0;
+        auto res = from_chars(buffer.data() + pos, buffer.data() + newline, length);
+        if (res.ec != errc() || res.ptr != buffer.data() + newline || length > kMaxFrame) return -1;
+        if (buffer.size() - newline - 1 < length) return 0;
+        payload.assign(buffer, newline + 1, length);
+        pos = newline + 1 + length;
+        return 1;
+    }
+
+    // Чтение кадров из сокета с собственной буферизацией.
+    class FrameReader {
+    public:
+        explicit FrameReader(int fd) : fd(fd) {}
+
+        // Возвращает false при закрытии соединения или ошибке протокола.
+        bool next(string &payload) {
+            while (true) {
+                int taken = takeFrame(buffer, pos, payload);
+                if (taken != 0) return taken > 0;
+                if (!fill()) return false;
+            }
+        }
+
+    private:
+        bool fill() {
+            if (pos > 0) {
+                buffer.erase(0, pos);
+                pos = 0;
+            }
+            char chunk[64 * 1024];
+            ssize_t n;
+            do {
+                n = recv(fd, chunk, sizeof(chunk), 0);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) return false;
+            buffer.append(chunk, static_cast<size_t>(n));
+            return true;
+        }
+
+        int fd;
+        string buffer;
+        size_t pos = 0;
+    };
+
+    bool sendAll(int fd, const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    string encodeFrame(const string &payload) {
+        return to_string(payload.size()) + "\n" + payload;
+    }
+
+    bool writeFrame(int fd, const string &payload) {
+        string frame = encodeFrame(payload);
+        return sendAll(fd, frame.data(), frame.size());
+    }
+
+    int listenTcp(int port) {
+        int fd = socket(AF_INET6, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        int on = 1, off = 0;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        sockaddr_in6 addr {};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(static_cast<uint16_t>(port));
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 1024) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int connectTcp(const string &host, int port) {
+        addrinfo hints {}, *result = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) != 0) return -1;
+        int fd = -1;
+        for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        if (fd >= 0) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        return fd;
+    }
+
+} // namespace Net
+
+//
+// --- Транспорт через разделяемую память (--serve --shm <имя>) ---
+//
+// Для вызывающих на том же хосте: сегмент POSIX shm "/<имя>" из заголовка и channels каналов.
+// Канал — пара колец (запросы клиента серверу и ответы сервера клиенту) и слово владельца.
+// Клиент захватывает свободный канал CAS-ом своего pid и держит его до закрытия, поэтому у каждого
+// кольца ровно один писатель и один читатель (SPSC): head и tail — счётчики байт без блокировок.
+// Кадр в кольце — uint32 длина и байты, без текстового заголовка и без системных вызовов на пути данных.
+// В простое читатель после короткого активного опроса засыпает на futex счётчика записей, писатель будит
+// его, только если тот объявил ожидание. Отпущенный клиентом канал (или канал умершего владельца)
+// сервер очищает в простое и только потом делает свободным.
+//
+namespace Shm {
+
+    const uint32_t kMagic = 0x314d5352;    // "RSM1"
+    const uint32_t kReleasing = UINT32_MAX; // владелец отпустил канал, сервер ещё не очистил кольца
+    const uint64_t kMinRingBytes = 4096;
+
+    // Управляющие поля одного кольца; данные лежат отдельно. Поля читателя и писателя —
+    // в разных строках кэша.
+    struct RingHeader {
+        alignas(64) atomic<uint64_t> head;          // прочитано байт (пишет читатель)
+        atomic<uint32_t> spaceSeq;                  // futex писателя: растёт при чтении
+        atomic<uint32_t> writerWaiting;
+        alignas(64) atomic<uint64_t> tail;          // записано байт (пишет писатель)
+        atomic<uint32_t> dataSeq;                   // futex читателя: растёт при записи
+        atomic<uint32_t> readerWaiting;
+    };
+
+    struct ChannelHeader {
+        alignas(64) atomic<uint32_t> owner;         // pid клиента, 0 — свободен, kReleasing — освобождается
+        RingHeader request;
+        RingHeader response;
+    };
+
+    struct alignas(64) SegmentHeader {             // выравнивание: каналы начинаются с новой строки кэша
+        uint32_t magic;
+        uint32_t channels;
+        uint64_t ringBytes;                         // ёмкость кольца, степень двойки
+    };
+
+    size_t segmentSize(uint32_t channels, uint64_t ringBytes) {
+        return sizeof(SegmentHeader) + channels * (sizeof(ChannelHeader) + 2 * ringBytes);
+    }
+
+    void futexWait(atomic<uint32_t> &word, uint32_t expected, long timeoutMs) {
+        timespec timeout { timeoutMs / 1000, (timeoutMs % 1000) * 1000000 };
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+    }
+
+    void futexWake(atomic<uint32_t> &word) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+    }
+
+    // Конец кольца одного процесса: кольцо пишет ровно один поток, читает ровно один.
+    class Ring {
+    public:
+        Ring(RingHeader *header, char *data, uint64_t capacity) : header(header), data(data), capacity(capacity) {}
+
+        void reset() {
+            header->head = 0;
+            header->tail = 0;
+            header->readerWaiting = 0;
+            header->writerWaiting = 0;
+        }
+
+        // Записывает кадр; ждёт места не дольше timeoutMs. false — кадр больше кольца или время вышло.
+        bool write(const string &payload, long timeoutMs) {
+            uint64_t need = 4 + payload.size();
+            if (need > capacity) return false;
+            uint64_t tail = header->tail.load(memory_order_relaxed);
+            if (!waitFor([&] { return tail + need - header->head.load(memory_order_acquire) <= capacity; },
+                         header->spaceSeq, header->writerWaiting, timeoutMs)) {
+                return false;
+            }
+            uint32_t length = static_cast<uint32_t>(payload.size());
+            copyIn(tail, &length, 4);
+            copyIn(tail + 4, payload.data(), payload.size());
+            header->tail.store(tail + need, memory_order_release);
+            header->dataSeq.fetch_add(1);
+            if (header->readerWaiting.load()) futexWake(header->dataSeq);
+            return true;
+        }
+
+        // Читает кадр; ждёт данных не дольше timeoutMs. 1 — кадр в payload, 0 — время вышло, -1 — кольцо
+        // испорчено (длина кадра не умещается в записанное или в кольцо): данным другого процесса не доверяем.
+        int read(string &payload, long timeoutMs) {
+            uint64_t head = header->head.load(memory_order_relaxed);
+            if (!waitFor([&] { return header->tail.load(memory_order_acquire) != head; }, header->dataSeq,
+                         header->readerWaiting, timeoutMs)) {
+                return 0;
+            }
+            uint64_t available = header->tail.load(memory_order_acquire) - head;
+            uint32_t length = 0;
+            if (available < 4 || available > capacity) return -1;
+            copyOut(head, &length, 4);
+            if (length > capacity - 4 || 4 + length > available) return -1;
+            payload.resize(length);
+            copyOut(head + 4, &payload[0], length);
+            header->head.store(head + 4 + length, memory_order_release);
+            header->spaceSeq.fetch_add(1);
+            if (header->writerWaiting.load()) futexWake(header->spaceSeq);
+            return 1;
+        }
+
+    private:
+        // Активный опрос, затем сон на futex: флаг ожидания ставится до повторной проверки условия,
+        // поэтому запись между проверкой и сном либо видна проверке, либо разбудит ожидающего.
+        template <typename Ready>
+        bool waitFor(Ready ready, atomic<uint32_t> &seq, atomic<uint32_t> &waiting, long timeoutMs) {
+            for (int spin = 0; spin < 2000; spin++) {
+                if (ready()) return true;
+            }
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+            while (true) {
+                uint32_t observed = seq.load();
+                waiting.store(1);
+                if (ready()) {
+                    waiting.store(0);
+                    return true;
+                }
+                auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+                if (left.count() <= 0) {
+                    waiting.store(0);
+                    return false;
+                }
+                futexWait(seq, observed, static_cast<long>(min<int64_t>(left.count(), 100)));
+                waiting.store(0);
+            }
+        }
+
+        void copyIn(uint64_t pos, const void *src, size_t size) {
+            size_t offset = pos & (capacity - 1), first = min<size_t>(size, capacity - offset);
+            memcpy(data + offset, src, first);
+            memcpy(data, static_cast<const char *>(src) + first, size - first);
+        }
+
+        void copyOut(uint64_t pos, void *dst, size_t size) const {
+            size_t offset = pos & (capacity - 1), first = min<size_t>(size, capacity - offset);
+            memcpy(dst, data + offset, first);
+            memcpy(static_cast<char *>(dst) + first, data, size - first);
+        }
+
+        RingHeader *header;
+        char *data;
+        uint64_t capacity;
+    };
+
+    // Отображение сегмента в память процесса.
+    class Segment {
+    public:
+        // Сервер: создаёт сегмент заново (старый с тем же именем удаляется).
+        bool create(const string &name, uint32_t channels, uint64_t ringBytes) {
+            shm_unlink(("/" + name).c_str());
+            int fd = shm_open(("/" + name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0) return false;
+            size = segmentSize(channels, ringBytes);
+            bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0 && map(fd);
+            close(fd);
+            if (!ok) return false;
+            // ftruncate заполняет сегмент нулями: все счётчики и владельцы уже в исходном состоянии.
+            header()->magic = kMagic;
+            header()->channels = numChannels = channels;
+            header()->ringBytes = this->ringBytes = ringBytes;
+            return true;
+        }
+
+        // Клиент: подключается к существующему сегменту. Заголовок пишет другой процесс, поэтому число каналов
+        // и ёмкость колец проверяются (ёмкость — степень двойки не меньше kMinRingBytes: по ней берётся маска)
+        // и запоминаются: дальше сегмент пользуется только проверенными значениями.
+        bool open(const string &name) {
+            int fd = shm_open(("/" + name).c_str(), O_RDWR, 0);
+            if (fd < 0) return false;
+            struct stat st {};
+            bool ok = fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(SegmentHeader));
+            size = ok ? static_cast<size_t>(st.st_size) : 0;
+            ok = ok && map(fd);
+            close(fd);
+            if (!ok || header()->magic != kMagic) return false;
+            uint32_t channels = header()->channels;
+            uint64_t bytes = header()->ringBytes;
+            if (bytes < kMinRingBytes || (bytes & (bytes - 1)) != 0 || bytes > size) return false;
+            if (channels > (size - sizeof(SegmentHeader)) / (sizeof(ChannelHeader) + 2 * bytes)) return false;
+            numChannels = channels;
+            ringBytes = bytes;
+            return true;
+        }
+
+        ~Segment() {
+            if (base) munmap(base, size);
+        }
+
+        uint32_t channels() const { return numChannels; }
+
+        ChannelHeader *channel(uint32_t c) const { return reinterpret_cast<ChannelHeader *>(channelBase(c)); }
+
+        // Кольцо запросов (request = true) или ответов канала c.
+        Ring ring(uint32_t c, bool request) const {
+            ChannelHeader *ch = channel(c);
+            char *data = channelBase(c) + sizeof(ChannelHeader) + (request ? 0 : ringBytes);
+            return Ring(request ? &ch->request : &ch->response, data, ringBytes);
+        }
+
+    private:
+        bool map(int fd) {
+            void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) return false;
+            base = static_cast<char *>(p);
+            return true;
+        }
+
+        SegmentHeader *header() const { return reinterpret_cast<SegmentHeader *>(base); }
+
+        char *channelBase(uint32_t c) const {
+            return base + sizeof(SegmentHeader) + c * (sizeof(ChannelHeader) + 2 * ringBytes);
+        }
+
+        char *base = nullptr;
+        size_t size = 0;
+        uint32_t numChannels = 0;
+        uint64_t ringBytes = 0;
+    };
+
+    // Клиентский конец: захваченный канал и вызов запрос-ответ.
+    class Client {
+    public:
+        bool connect(const string &name) {
+            if (!segment.open(name)) return false;
+            uint32_t pid = static_cast<uint32_t>(getpid());
+            for (uint32_t c = 0; c < segment.channels(); c++) {
+                uint32_t expected = 0;
+                if (segment.channel(c)->owner.compare_exchange_strong(expected, pid)) {
+                    channel = c;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Кольца очищает сервер: в них могут остаться кадры недождавшегося вызова.
+        ~Client() { release(); }
+
+        // Если запрос ушёл, а ответа не дождались (или кольцо испорчено), опоздавший ответ остался бы в кольце
+        // и достался следующему вызову. Поэтому канал отпускается (сервер очистит его кольца), и все
+        // последующие вызовы этого клиента возвращают false.
+        bool call(const string &request, string &response, long timeoutMs = 60000) {
+            if (channel == UINT32_MAX || !segment.ring(channel, true).write(request, timeoutMs)) return false;
+            if (segment.ring(channel, false).read(response, timeoutMs) > 0) return true;
+            release();
+            return false;
+        }
+
+    private:
+        void release() {
+            if (channel != UINT32_MAX) segment.channel(channel)->owner.store(kReleasing);
+            channel = UINT32_MAX;
+        }
+
+        Segment segment;
+        uint32_t channel = UINT32_MAX;
+    };
+
+} // namespace Shm
+
+//
+// --- Резидентный сервер (режим --serve) ---
+//
+// Каталог загружается и индексируется один раз при старте, далее каждое соединение обслуживается своим потоком:
+// кадры запросов читаются по очереди, на каждый отправляется кадр ответа.
+// С --record все входящие запросы дописываются в файл кадров, пригодный для LoadGen --replay.
+// С --processes N (пре-форк) родитель загружает каталог, строит индексы и открывает порт, после чего
+// порождает N процессов-обработчиков: они принимают соединения с общего сокета, а страницы каталога делят
+// с родителем (копирование при записи, а пишут в них только до fork). Упавший обработчик перезапускается.
+//
+namespace Server {
+
+    struct ServerOptions {
+        int port = 7070;
+        string catalogPath;
+        string recordPath;
+        string weightsPath;
+        string rerankPath;
+        int rerankTop = 1000;
+        bool staged = false;
+        RecSys::StageBudgets budgets;
+        string blocklistPath;
+        size_t impressionSlots = 0;         // 0 — без истории показов
+        int impressionWindows = 4;
+        uint32_t impressionWindowSec = 3600;
+        double impressionDemote = 0;        // 0 — исключать показанные, иначе множитель оценки
+        size_t pageCacheEntries = 10000;    // снимков постраничной выдачи, 0 — без кэша
+        uint32_t pageTtlSec = 600;
+        int pageDepth = 500;                // работ в снимке
+        double deadlineMs = 0;              // бюджет запросов без секции DEADLINE, 0 — без ограничения
+        int workers = 0;                    // потоков оценки, 0 — по числу ядер
+        size_t queueLimit = 1024;           // запросов в очереди на оценку
+        double maxQueueMs = 0;              // наибольшее ожидание в очереди, 0 — без ограничения
+        bool degrade = false;               // при перегрузке отдавать популярное вместо отказа
+        string shmName;                     // сегмент разделяемой памяти, пусто — только TCP
+        uint32_t shmChannels = 16;
+        uint64_t shmRingBytes = 1 << 20;
+        int processes = 0;                  // процессов-обработчиков, 0 — всё в одном процессе
+        bool eventLoop = false;             // соединения на epoll в одном потоке вместо потока на соединение
+    };
+
+    // Счётчики допуска одного процесса. У пре-форк сервера лежат в разделяемой памяти, чтобы кадр STATS,
+    // пришедший любому обработчику, и родитель видели счётчики всех.
+    struct AdmissionCounters {
+        atomic<uint64_t> queueDepth, peakQueueDepth, inFlight, served, rejected, timedOut, degraded;
+    };
+
+    struct WorkerSlot {
+        atomic<int32_t> pid;
+        atomic<uint32_t> restarts;
+        AdmissionCounters counters;
+    };
+
+    // Запись входящих запросов для последующего воспроизведения.
+    class Recorder {
+    public:
+        explicit Recorder(const string &path) : out(path, ios::binary | ios::app) {}
+        bool ok() const { return static_cast<bool>(out); }
+        void record(const string &payload) {
+            lock_guard<mutex> lock(guard);
+            out << Net::encodeFrame(payload);
+            out.flush();
+        }
+
+    private:
+        ofstream out;
+        mutex guard;
+    };
+
+    // Кэш снимков постраничной выдачи. Первая страница считает весь конвейер для pageDepth работ с новым
+    // зерном рандомизации и сохраняет результат под случайным токеном; курсор следующей страницы —
+    // <токен>:<смещение>, и она отдаётся из снимка копированием только своих работ. Снимок, собранный
+    // до истечения бюджета DEADLINE не по всему каталогу, помнит это, и каждая его страница помечается "approximate".
+    // Снимки лежат в разделяемой памяти, в capacity слотах фиксированного размера, поэтому у пре-форк сервера
+    // курсор, выданный одним обработчиком, принимает любой. Снимок занимает один из двух слотов, заданных
+    // токеном: свободный или истёкший, а если оба живы — более старый. Слоты защищены полосами устойчивых
+    // (robust) мьютексов: если процесс умер, держа мьютекс, следующий владелец полосы сбрасывает её слоты,
+    // которые тот мог не дописать. Снимок, не поместившийся в слот (очень длинные идентификаторы), обрезается.
+    class PageCache {
+    public:
+        PageCache(size_t capacity, uint32_t ttlSeconds, int depth)
+            : capacity(max<size_t>(capacity, 1)), ttl(ttlSeconds), depth(static_cast<size_t>(max(depth, 0))),
+              slotBytes(slotSize(this->depth)), slots(this->capacity * slotBytes), locks(kStripes) {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            for (size_t i = 0; i < kStripes; i++) pthread_mutex_init(&locks[i], &attr);
+            pthread_mutexattr_destroy(&attr);
+            reseed();
+        }
+
+        // Новый источник токенов и зёрен; процесс-обработчик вызывает после fork, иначе токены
+        // обработчиков совпадали бы.
+        void reseed() {
+            lock_guard<mutex> lock(guard);
+            tokens.seed(random_device()() ^ (static_cast<uint64_t>(getpid()) << 32));
+        }
+
+        // Новое зерно рандомизации (не 0).
+        uint64_t nextSeed() { return nextRandom(); }
+
+        // Сохраняет снимок и возвращает его токен.
+        string insert(const vector<pair<string, double>> &items, uint64_t seed, bool approximate, uint64_t now) {
+            uint64_t token = nextRandom();
+            size_t a = token % capacity, b = (token >> 32) % capacity;
+            size_t stripeA = a % kStripes, stripeB = b % kStripes;
+            lockStripe(min(stripeA, stripeB));
+            if (stripeA != stripeB) lockStripe(max(stripeA, stripeB));
+            SlotHeader *ha = header(a), *hb = header(b);
+            size_t target = (ha->expires <= now || (hb->expires > now && ha->expires <= hb->expires)) ? a : b;
+            write(target, token, items, seed, approximate, now + ttl);
+            if (stripeA != stripeB) pthread_mutex_unlock(&locks[max(stripeA, stripeB)]);
+            pthread_mutex_unlock(&locks[min(stripeA, stripeB)]);
+            char text[17];
+            snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(token));
+            return text;
+        }
+
+        // Страница снимка по курсору: не больше size работ с его смещения, зерно и приближённость снимка и курсор
+        // следующей страницы (пусто, если снимок исчерпан). false, если курсор испорчен или снимок истёк.
+        bool page(const string &cursor, uint64_t now, size_t size, vector<pair<string, double>> &items, uint64_t &seed,
+                  bool &approximate, string &next) {
+            size_t colon = cursor.find(':');
+            if (colon != 16) return false;
+            uint64_t token = 0;
+            size_t offset = 0;
+            const char *begin = cursor.data(), *end = cursor.data() + cursor.size();
+            if (from_chars(begin, begin + colon, token, 16).ptr != begin + colon) return false;
+            if (from_chars(begin + colon + 1, end, offset).ptr != end) return false;
+            for (size_t slot : { token % capacity, (token >> 32) % capacity }) {
+                lockStripe(slot % kStripes);
+                const SlotHeader *h = header(slot);
+                bool found = h->token == token && h->expires > now;
+                if (found) {
+                    seed = h->seed;
+                    approximate = h->approximate != 0;
+                    size_t first = min<size_t>(offset, h->count), last = min<size_t>(first + size, h->count);
+                    const uint32_t *offsets = reinterpret_cast<const uint32_t *>(h + 1);
+                    const char *data = reinterpret_cast<const char *>(offsets + depth);
+                    items.clear();
+                    for (size_t i = first; i < last; i++) {
+                        const char *item = data + offsets[i];
+                        double score;
+                        uint32_t length;
+                        memcpy(&score, item, sizeof(score));
+                        memcpy(&length, item + sizeof(score), sizeof(length));
+                        items.push_back({ string(item + sizeof(score) + sizeof(length), length), score });
+                    }
+                    next = last < h->count ? cursor.substr(0, colon) + ":" + to_string(last) : "";
+                }
+                pthread_mutex_unlock(&locks[slot % kStripes]);
+                if (found) return true;
+            }
+            return false;
+        }
+
+    private:
+        static const size_t kStripes = 64;
+        static const size_t kIdBytes = 24;         // средняя длина идентификатора, на которую рассчитан слот
+
+        struct SlotHeader {
+            uint64_t token;
+            uint64_t seed;
+            uint64_t expires;                      // 0 — слот свободен
+            uint32_t count;
+            uint32_t bytes;                        // занято байт данных
+            uint32_t approximate;                  // 1 — снимок собран до истечения бюджета DEADLINE
+        };
+
+        static size_t slotSize(size_t depth) {
+            size_t bytes = sizeof(SlotHeader) + depth * (sizeof(uint32_t) + sizeof(double) + sizeof(uint32_t) + kIdBytes);
+            return (bytes + 63) / 64 * 64;
+        }
+
+        SlotHeader *header(size_t slot) const { return reinterpret_cast<SlotHeader *>(&slots[slot * slotBytes]); }
+
+        void lockStripe(size_t stripe) {
+            if (pthread_mutex_lock(&locks[stripe]) == EOWNERDEAD) {
+                for (size_t slot = stripe; slot < capacity; slot += kStripes) header(slot)->expires = 0;
+                pthread_mutex_consistent(&locks[stripe]);
+            }
+        }
+
+        void write(size_t slot, uint64_t token, const vector<pair<string, double>> &items, uint64_t seed,
+                   bool approximate, uint64_t expires) {
+            SlotHeader *h = header(slot);
+            uint32_t *offsets = reinterpret_cast<uint32_t *>(h + 1);
+            char *data = reinterpret_cast<char *>(offsets + depth);
+            size_t room = slotBytes - sizeof(SlotHeader) - depth * sizeof(uint32_t), used = 0, count = 0;
+            for (; count < items.size() && count < depth; count++) {
+                const string &id = items[count].first;
+                uint32_t length = static_cast<uint32_t>(id.size());
+                if (room - used < sizeof(double) + sizeof(length) + id.size()) break;
+                offsets[count] = static_cast<uint32_t>(used);
+                memcpy(data + used, &items[count].second, sizeof(double));
+                memcpy(data + used + sizeof(double), &length, sizeof(length));
+                memcpy(data + used + sizeof(double) + sizeof(length), id.data(), id.size());
+                used += sizeof(double) + sizeof(length) + id.size();
+            }
+            h->token = token;
+            h->seed = seed;
+            h->expires = expires;
+            h->count = static_cast<uint32_t>(count);
+            h->bytes = static_cast<uint32_t>(used);
+            h->approximate = approximate ? 1 : 0;
+        }
+
+        uint64_t nextRandom() {
+            lock_guard<mutex> lock(guard);
+            uint64_t value = 0;
+            while (value == 0) value = tokens();
+            return value;
+        }
+
+        size_t capacity;
+        uint64_t ttl;
+        size_t depth;
+        size_t slotBytes;
+        RecSys::SharedArray<char> slots;
+        RecSys::SharedArray<pthread_mutex_t> locks;
+        mt19937_64 tokens;
+        mutex guard;
+    };
+
+    // Общее для всех соединений состояние: каталог и необязательные веса, модель и запись.
+    struct Shared {
+        RecSys::Catalog catalog;
+        unique_ptr<RecSys::Request> weights;       // заменяет веса каждого запроса
+        unique_ptr<RecSys::Reranker> reranker;
+        unique_ptr<Recorder> recorder;
+        const RecSys::StageBudgets *budgets = nullptr;   // двухэтапный конвейер, если задан
+        unique_ptr<RecSys::ImpressionStore> impressions; // история показов, если задана
+        double impressionDemote = 0;
+        unique_ptr<PageCache> pages;                     // снимки постраничной выдачи, если заданы
+        int pageDepth = 500;
+        double deadlineMs = 0;
+        vector<uint32_t> popular;                        // выдача при перегрузке: самые просматриваемые работы
+                                                         // каталога, кроме запрещённых политикой
+        const RecSys::SharedArray<WorkerSlot> *workers = nullptr;   // обработчики пре-форк сервера
+        size_t workerCount = 0;
+    };
+
+    uint64_t nowSeconds() {
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::seconds>(
+            chrono::system_clock::now().time_since_epoch()).count());
+    }
+
+    // Обратная связь о показах (тело кадра вместо запроса):
+    //   IMPRESSIONS
+    //   <идентификатор пользователя>
+    //   <число работ>
+    //   Для каждой: <идентификатор работы>
+    // Ответ — { "recorded": <число учтённых работ каталога> }.
+    string handleImpressions(istream &in, const Shared &shared) {
+        string userId;
+        int count = 0;
+        if (!(in >> userId >> count)) return "{ \"error\": \"bad request\" }\n";
+        int recorded = 0;
+        uint64_t now = nowSeconds();
+        for (int i = 0; i < count; i++) {
+            string workId;
+            if (!(in >> workId)) break;
+            auto it = shared.catalog.workIndex.find(workId);
+            if (it == shared.catalog.workIndex.end() || !shared.impressions) continue;
+            shared.impressions->record(userId, it->second, now);
+            recorded++;
+        }
+        return "{ \"recorded\": " + to_string(recorded) + " }\n";
+    }
+
+    // approximate — выдача собрана до истечения бюджета DEADLINE не по всему каталогу.
+    vector<pair<string, double>> computeRecommendations(const RecSys::Request &request, const Shared &shared,
+                                                        const RecSys::ImpressionPolicy &policy, bool &approximate) {
+        approximate = false;
+        return shared.budgets ? RecSys::recommendStaged(request, shared.catalog, *shared.budgets,
+                                                        shared.reranker.get(), &policy)
+                              : RecSys::recommend(request, shared.catalog, shared.reranker.get(), &policy,
+                                                  &approximate);
+    }
+
+    // С историей показов выданные работы сразу записываются как показанные пользователю из USER_ID.
+    void recordShown(const RecSys::Request &request, const Shared &shared, const vector<pair<string, double>> &recs,
+                     uint64_t now) {
+        if (!shared.impressions || request.userId.empty()) return;
+        for (const auto &p : recs) {
+            auto it = shared.catalog.workIndex.find(p.first);
+            if (it != shared.catalog.workIndex.end()) shared.impressions->record(request.userId, it->second, now);
+        }
+    }
+
+    // Страница постраничной выдачи (секция PAGE). Ответ дополняется полями "cursor" (курсор следующей
+    // страницы или null, если снимок исчерпан) и "seed" (зерно рандомизации снимка), а под DEADLINE или
+    // для приближённого снимка — полем "approximate", одинаковым на всех страницах снимка.
+    string handlePage(RecSys::Request &request, const Shared &shared, const RecSys::ImpressionPolicy &policy) {
+        string cursor = request.cursor;
+        uint64_t seed = 0;
+        bool approximate = false;
+        if (cursor.empty()) {
+            request.numRecommendations = shared.pageDepth;
+            request.randomSeed = seed = shared.pages->nextSeed();
+            auto snapshot = computeRecommendations(request, shared, policy, approximate);
+            cursor = shared.pages->insert(snapshot, seed, approximate, policy.nowSeconds) + ":0";
+        }
+        vector<pair<string, double>> page;
+        string next;
+        size_t size = static_cast<size_t>(request.pageSize);
+        if (!shared.pages->page(cursor, policy.nowSeconds, size, page, seed, approximate, next)) {
+            return "{ \"error\": \"cursor expired\" }\n";
+        }
+        recordShown(request, shared, page, policy.nowSeconds);
+        ostringstream out;
+        vector<pair<string, string>> fields { { "cursor", next.empty() ? "null" : "\"" + next + "\"" },
+                                              { "seed", to_string(seed) } };
+        if (request.deadlineMs > 0 || approximate) fields.push_back({ "approximate", approximate ? "true" : "false" });
+        writeRecommendations(out, page, fields);
+        return out.str();
+    }
+
+    // Выполнение одного запроса: текст запроса -> JSON ответа.
+    string handleRequest(const string &payload, const Shared &shared) {
+        istringstream in(payload);
+        if (payload.compare(0, 11, "IMPRESSIONS") == 0) {
+            string header;
+            getline(in, header);
+            return handleImpressions(in, shared);
+        }
+        RecSys::Request request;
+        if (!readRequest(in, request)) return "{ \"error\": \"bad request\" }\n";
+        if (shared.weights) applyWeights(*shared.weights, request);
+        if (request.deadlineMs <= 0) request.deadlineMs = shared.deadlineMs;
+        RecSys::ImpressionPolicy policy { shared.impressions.get(), shared.impressionDemote, nowSeconds() };
+        if (request.pageSize > 0 && shared.pages) return handlePage(request, shared, policy);
+        bool approximate = false;
+        vector<pair<string, double>> finalRecs = computeRecommendations(request, shared, policy, approximate);
+        recordShown(request, shared, finalRecs, policy.nowSeconds);
+        ostringstream out;
+        vector<pair<string, string>> fields;
+        if (request.deadlineMs > 0) fields.push_back({ "approximate", approximate ? "true" : "false" });
+        writeRecommendations(out, finalRecs, fields);
+        return out.str();
+    }
+
+    // Ответ без оценки при перегрузке: первые numRecommendations популярных работ с полем "degraded": true.
+    // Исключения те же, что при оценке (EXCLUDE, запреты, теги, история показов). При обязательных тегах
+    // работы берутся из пересечения их списков по убыванию просмотров, а не из общего списка популярного.
+    string degradedResponse(const string &payload, const Shared &shared) {
+        istringstream in(payload);
+        RecSys::Request request;
+        if (!readRequest(in, request)) return "{ \"error\": \"bad request\" }\n";
+        const RecSys::Catalog &catalog = shared.catalog;
+        RecSys::ImpressionPolicy policy { shared.impressions.get(), shared.impressionDemote, nowSeconds() };
+        RecSys::Exclusions exclusions = RecSys::buildExclusions(request, catalog, &policy);
+        vector<uint32_t> candidates = exclusions.constrained ? exclusions.allowedList : shared.popular;
+        if (exclusions.constrained) {
+            stable_sort(candidates.begin(), candidates.end(),
+                        [&](uint32_t a, uint32_t b) { return catalog.normViews[a] > catalog.normViews[b]; });
+        }
+        vector<pair<string, double>> recs;
+        for (uint32_t w : candidates) {
+            if (static_cast<int>(recs.size()) >= request.numRecommendations) break;
+            if (!exclusions.excluded(w)) recs.push_back({ catalog.works[w].id, catalog.normViews[w] });
+        }
+        RecSys::demoteShown(request, catalog, &policy, recs);
+        recordShown(request, shared, recs, policy.nowSeconds);
+        ostringstream out;
+        writeRecommendations(out, recs, { { "degraded", "true" } });
+        return out.str();
+    }
+
+    // Допуск запросов к оценке. Соединения только читают и пишут кадры, а оценивают workers потоков
+    // из общей очереди длиной не больше limit. Запрос, которому нет места в очереди, сразу получает отказ
+    // { "error": "overloaded" } (или популярное при degrade), поэтому очередь, а с ней и задержка,
+    // не растут без предела. Запрос, прождавший в очереди дольше maxDelayMs, тоже не оценивается:
+    // клиент его, скорее всего, уже не ждёт, а оценка задержала бы следующих.
+    class AdmissionQueue {
+    public:
+        AdmissionQueue(const Shared &shared, int workers, size_t limit, double maxDelayMs, bool degrade,
+                       AdmissionCounters &counters)
+            : shared(shared), limit(limit), maxDelay(chrono::microseconds(static_cast<int64_t>(maxDelayMs * 1000))),
+              degrade(degrade), counters(counters) {
+            if (workers <= 0) workers = static_cast<int>(max(1u, thread::hardware_concurrency()));
+            for (int i = 0; i < workers; i++) pool.emplace_back(&AdmissionQueue::work, this);
+        }
+
+        ~AdmissionQueue() {
+            {
+                lock_guard<mutex> lock(guard);
+                stopping = true;
+            }
+            ready.notify_all();
+            for (auto &t : pool) t.join();
+        }
+
+        const AdmissionCounters &stats() const { return counters; }
+
+        // Ставит запрос в очередь; done получит ответ в потоке оценки (или сразу, если запрос отклонён).
+        void submitAsync(string payload, function<void(string)> done) {
+            {
+                unique_lock<mutex> lock(guard);
+                if (jobs.size() < limit) {
+                    jobs.push_back(Job { move(payload), chrono::steady_clock::now(), move(done) });
+                    counters.queueDepth = jobs.size();
+                    counters.peakQueueDepth = max<uint64_t>(counters.peakQueueDepth, jobs.size());
+                    lock.unlock();
+                    ready.notify_one();
+                    return;
+                }
+            }
+            counters.rejected++;
+            done(shed(payload));
+        }
+
+        // Выполняет запрос в потоке оценки и ждёт ответа (вызывается потоком соединения).
+        string submit(const string &payload) {
+            mutex finishedGuard;
+            condition_variable finished;
+            bool done = false;
+            string response;
+            submitAsync(payload, [&](string result) {
+                lock_guard<mutex> lock(finishedGuard);
+                response = move(result);
+                done = true;
+                finished.notify_one();
+            });
+            unique_lock<mutex> lock(finishedGuard);
+            finished.wait(lock, [&] { return done; });
+            return response;
+        }
+
+    private:
+        struct Job {
+            string payload;
+            chrono::steady_clock::time_point enqueued;
+            function<void(string)> done;
+        };
+
+        string shed(const string &payload) {
+            if (!degrade) return "{ \"error\": \"overloaded\" }\n";
+            counters.degraded++;
+            return degradedResponse(payload, shared);
+        }
+
+        void work() {
+            while (true) {
+                Job job;
+                {
+                    unique_lock<mutex> lock(guard);
+                    ready.wait(lock, [&] { return stopping || !jobs.empty(); });
+                    if (stopping) return;
+                    job = move(jobs.front());
+                    jobs.pop_front();
+                    counters.queueDepth = jobs.size();
+                }
+                if (maxDelay.count() > 0 && chrono::steady_clock::now() - job.enqueued > maxDelay) {
+                    counters.timedOut++;
+                    job.done(shed(job.payload));
+                    continue;
+                }
+                counters.inFlight++;
+                string response = handleRequest(job.payload, shared);
+                counters.inFlight--;
+                counters.served++;
+                job.done(move(response));
+            }
+        }
+
+        const Shared &shared;
+        size_t limit;
+        chrono::steady_clock::duration maxDelay;
+        bool degrade;
+        mutex guard;
+        condition_variable ready;
+        deque<Job> jobs;
+        bool stopping = false;
+        vector<thread> pool;
+        AdmissionCounters &counters;
+    };
+
+    void writeCounters(ostream &out, const AdmissionCounters &c) {
+        out << "\"queue_depth\": " << c.queueDepth.load() << ", \"peak_queue_depth\": " << c.peakQueueDepth.load()
+            << ", \"in_flight\": " << c.inFlight.load() << ", \"served\": " << c.served.load()
+            << ", \"rejected\": " << c.rejected.load() << ", \"timed_out\": " << c.timedOut.load()
+            << ", \"degraded\": " << c.degraded.load();
+    }
+
+    // Ответ на кадр STATS. У пре-форк сервера — сумма по обработчикам (пик очереди — наибольший)
+    // и счётчики каждого в массиве "workers".
+    string statsResponse(const Shared &shared, const AdmissionCounters &own) {
+        ostringstream out;
+        out << "{ ";
+        if (!shared.workers) {
+            writeCounters(out, own);
+            out << " }\n";
+            return out.str();
+        }
+        AdmissionCounters total {};
+        uint64_t restarts = 0;
+        for (size_t w = 0; w < shared.workerCount; w++) {
+            const WorkerSlot &slot = (*shared.workers)[w];
+            total.queueDepth += slot.counters.queueDepth;
+            total.peakQueueDepth = max(total.peakQueueDepth.load(), slot.counters.peakQueueDepth.load());
+            total.inFlight += slot.counters.inFlight;
+            total.served += slot.counters.served;
+            total.rejected += slot.counters.rejected;
+            total.timedOut += slot.counters.timedOut;
+            total.degraded += slot.counters.degraded;
+            restarts += slot.restarts;
+        }
+        writeCounters(out, total);
+        out << ", \"restarts\": " << restarts << ", \"workers\": [";
+        for (size_t w = 0; w < shared.workerCount; w++) {
+            const WorkerSlot &slot = (*shared.workers)[w];
+            out << (w ? ", " : " ") << "{ \"pid\": " << slot.pid.load() << ", \"restarts\": " << slot.restarts.load()
+                << ", ";
+            writeCounters(out, slot.counters);
+            out << " }";
+        }
+        out << " ] }\n";
+        return out.str();
+    }
+
+    // Кадры IMPRESSIONS и STATS дешёвые и обрабатываются сразу, запросы рекомендаций — через очередь допуска.
+    // Возвращает false, если кадр — запрос рекомендаций и его нужно отдать в очередь.
+    bool answerInline(const string &payload, const Shared &shared, const AdmissionQueue &admission, string &response) {
+        if (shared.recorder) shared.recorder->record(payload);
+        if (payload.compare(0, 5, "STATS") == 0) response = statsResponse(shared, admission.stats());
+        else if (payload.compare(0, 11, "IMPRESSIONS") == 0) response = handleRequest(payload, shared);
+        else return false;
+        return true;
+    }
+
+    string dispatch(const string &payload, const Shared &shared, AdmissionQueue &admission) {
+        string response;
+        if (answerInline(payload, shared, admission, response)) return response;
+        return admission.submit(payload);
+    }
+
+    void serveConnection(int fd, const Shared *shared, AdmissionQueue *admission) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        Net::FrameReader reader(fd);
+        string payload;
+        while (reader.next(payload)) {
+            if (!Net::writeFrame(fd, dispatch(payload, *shared, *admission))) break;
+        }
+        close(fd);
+    }
+
+    // Поток одного канала разделяемой памяти. В простое (нет запроса за 100 мс) проверяет владельца:
+    // отпущенный канал или канал умершего процесса очищается и становится свободным.
+    // Владелец, испортивший кольцо запросов, больше не обслуживается: его кадры сбрасываются, пока он
+    // не отпустит канал или не завершится.
+    void serveShmChannel(const Shm::Segment *segment, uint32_t c, const Shared *shared, AdmissionQueue *admission) {
+        Shm::Ring requests = segment->ring(c, true), responses = segment->ring(c, false);
+        atomic<uint32_t> &owner = segment->channel(c)->owner;
+        string payload;
+        bool abandoned = false;
+        while (true) {
+            int taken = requests.read(payload, 100);
+            if (taken < 0 || (taken > 0 && abandoned)) {
+                if (!abandoned) cerr << "serve: канал " << c << " испорчен владельцем " << owner.load() << "\n";
+                abandoned = true;
+                requests.reset();
+                responses.reset();
+                continue;
+            }
+            if (taken > 0) {
+                responses.write(dispatch(payload, *shared, *admission), 1000);
+                continue;
+            }
+            uint32_t pid = owner.load();
+            bool dead = pid != 0 && pid != Shm::kReleasing && kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH;
+            if (pid != Shm::kReleasing && !(dead && owner.compare_exchange_strong(pid, Shm::kReleasing))) continue;
+            requests.reset();
+            responses.reset();
+            abandoned = false;
+            owner.store(0);
+        }
+    }
+
+    // Готовые ответы пула для событийного цикла. Задача пула держит shared_ptr на очередь, а не на цикл,
+    // поэтому завершение задачи после разрушения цикла безопасно.
+    struct Completions {
+        mutex guard;
+        vector<pair<uint64_t, string>> ready;
+        int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        bool closed = false;
+
+        ~Completions() {
+            if (wakeFd >= 0) close(wakeFd);
+        }
+
+        // Вызывается потоком оценки: ответ передаётся циклу через очередь и eventfd.
+        void push(uint64_t id, string response) {
+            lock_guard<mutex> lock(guard);
+            if (closed) return;
+            ready.emplace_back(id, move(response));
+            uint64_t one = 1;
+            while (write(wakeFd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+        }
+    };
+
+    // Пауза приёма, когда кончились дескрипторы (EMFILE/ENFILE): ожидающее соединение остаётся в очереди
+    // listen, и без паузы готовый к чтению слушающий сокет крутил бы цикл приёма вхолостую.
+    const int kAcceptPauseMs = 100;
+
+    // Событийный режим (--event-loop): все соединения процесса обслуживает один поток на epoll, а оценка
+    // идёт в пуле очереди допуска. Соединение — конечный автомат: копит входные байты, пока не соберётся кадр,
+    // отдаёт запрос в пул и, не занимая поток, ждёт ответа (пул сообщает о готовности через eventfd), затем
+    // дописывает ответ по мере готовности сокета. Медленный или простаивающий клиент стоит только буферов
+    // соединения, а не потока. Запросы одного соединения выполняются по одному, ответы идут в их порядке;
+    // пока запрос в пуле, сокет соединения не читается, и лишние кадры клиента ждут в буфере ядра.
+    class EventLoop {
+    public:
+        EventLoop(const Shared &shared, AdmissionQueue &admission, int listenFd)
+            : shared(shared), admission(admission), listenFd(listenFd),
+              epollFd(epoll_create1(EPOLL_CLOEXEC)), completions(make_shared<Completions>()) {}
+
+        // Задачи, уже отданные в пул, могут завершиться после выхода из цикла: очередь готовых ответов
+        // закрывается, и их ответы выбрасываются; сама очередь и eventfd живут, пока на них ссылается задача.
+        ~EventLoop() {
+            {
+                lock_guard<mutex> lock(completions->guard);
+                completions->closed = true;
+            }
+            for (auto &c : connections) close(c.second.fd);
+            close(epollFd);
+        }
+
+        // Возвращается только при ошибке сокета или epoll.
+        int run() {
+            int wakeFd = completions->wakeFd;
+            if (epollFd < 0 || wakeFd < 0) return 1;
+            fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+            if (!watch(listenFd, kListenId, EPOLLIN, EPOLL_CTL_ADD) || !watch(wakeFd, kWakeId, EPOLLIN, EPOLL_CTL_ADD)) {
+                return 1;
+            }
+            epoll_event events[256];
+            while (true) {
+                int timeout = -1;
+                if (acceptPaused) {
+                    auto left = chrono::duration_cast<chrono::milliseconds>(acceptResume - chrono::steady_clock::now());
+                    timeout = static_cast<int>(max<int64_t>(left.count(), 0));
+                }
+                int n = epoll_wait(epollFd, events, 256, timeout);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    return 1;
+                }
+                if (acceptPaused && chrono::steady_clock::now() >= acceptResume) {
+                    if (!watch(listenFd, kListenId, EPOLLIN, EPOLL_CTL_ADD)) return 1;
+                    acceptPaused = false;
+                }
+                for (int i = 0; i < n; i++) {
+                    uint64_t id = events[i].data.u64;
+                    if (id == kListenId) {
+                        if (!acceptAll()) return 1;
+                    } else if (id == kWakeId) {
+                        deliverCompleted();
+                    } else {
+                        auto it = connections.find(id);
+                        if (it == connections.end()) continue;
+                        if (events[i].events & EPOLLOUT) flush(id, it->second);
+                        it = connections.find(id);
+                        if (it != connections.end() && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                            receive(id, it->second);
+                        }
+                    }
+                }
+            }
+        }
+
+    private:
+        static const uint64_t kListenId = 0, kWakeId = 1;
+
+        struct Connection {
+            int fd = -1;
+            string input;
+            size_t inputPos = 0;
+            string output;
+            size_t outputPos = 0;
+            uint32_t interest = 0;      // события, на которые подписан сокет (0 — сокета нет в epoll)
+            bool busy = false;          // запрос в пуле, ответа ещё нет
+            bool eof = false;           // клиент закрыл свою сторону: закрыть после последнего ответа
+        };
+
+        bool watch(int fd, uint64_t id, uint32_t events, int op) {
+            epoll_event event {};
+            event.events = events;
+            event.data.u64 = id;
+            return epoll_ctl(epollFd, op, fd, &event) == 0;
+        }
+
+        bool acceptAll() {
+            while (true) {
+                int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    if (errno == EMFILE || errno == ENFILE) {
+                        // Слушающий сокет снимается с epoll до конца паузы, иначе он будил бы цикл сразу.
+                        if (epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, nullptr) != 0) return false;
+                        acceptPaused = true;
+                        acceptResume = chrono::steady_clock::now() + chrono::milliseconds(kAcceptPauseMs);
+                        return true;
+                    }
+                    return false;
+                }
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                uint64_t id = nextId++;
+                Connection &c = connections[id];
+                c.fd = fd;
+                c.interest = EPOLLIN;
+                if (!watch(fd, id, c.interest, EPOLL_CTL_ADD)) drop(id, c);
+            }
+        }
+
+        void receive(uint64_t id, Connection &c) {
+            char chunk[64 * 1024];
+            while (true) {
+                ssize_t n = recv(c.fd, chunk, sizeof(chunk), 0);
+                if (n > 0) {
+                    c.input.append(chunk, static_cast<size_t>(n));
+                    if (static_cast<size_t>(n) < sizeof(chunk)) break;
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                c.eof = true;
+                break;
+            }
+            advance(id, c);
+        }
+
+        // Разбирает накопленные кадры, пока соединение не занято запросом в пуле.
+        void advance(uint64_t id, Connection &c) {
+            string payload, response;
+            while (!c.busy) {
+                int taken = Net::takeFrame(c.input, c.inputPos, payload);
+                if (taken < 0) return drop(id, c);
+                if (taken == 0) break;
+                if (answerInline(payload, shared, admission, response)) {
+                    c.output += Net::encodeFrame(response);
+                    continue;
+                }
+                c.busy = true;
+                shared_ptr<Completions> target = completions;
+                admission.submitAsync(move(payload), [target, id](string result) { target->push(id, move(result)); });
+            }
+            if (c.inputPos > 0) {
+                c.input.erase(0, c.inputPos);
+                c.inputPos = 0;
+            }
+            flush(id, c);
+        }
+
+        void deliverCompleted() {
+            uint64_t count;
+            while (read(completions->wakeFd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+            vector<pair<uint64_t, string>> ready;
+            {
+                lock_guard<mutex> lock(completions->guard);
+                ready.swap(completions->ready);
+            }
+            for (auto &r : ready) {
+                auto it = connections.find(r.first);
+                if (it == connections.end()) continue;   // клиент ушёл, не дождавшись ответа
+                it->second.output += Net::encodeFrame(r.second);
+                it->second.busy = false;
+                advance(r.first, it->second);
+            }
+        }
+
+        void flush(uint64_t id, Connection &c) {
+            while (c.outputPos < c.output.size()) {
+                ssize_t n = send(c.fd, c.output.data() + c.outputPos, c.output.size() - c.outputPos, MSG_NOSIGNAL);
+                if (n > 0) {
+                    c.outputPos += static_cast<size_t>(n);
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                return drop(id, c);
+            }
+            if (c.outputPos == c.output.size()) {
+                c.output.clear();
+                c.outputPos = 0;
+            }
+            if (c.eof && !c.busy && c.output.empty()) return drop(id, c);
+            // Без интересующих событий сокет снимается с epoll: иначе EPOLLHUP закрытого клиентом соединения
+            // будил бы цикл всё время, пока его запрос в пуле.
+            uint32_t interest = 0;
+            if (!c.busy && !c.eof) interest |= EPOLLIN;
+            if (!c.output.empty()) interest |= EPOLLOUT;
+            if (interest != c.interest) {
+                int op = c.interest == 0 ? EPOLL_CTL_ADD : interest == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+                c.interest = interest;
+                if (!watch(c.fd, id, interest, op)) return drop(id, c);
+            }
+        }
+
+        void drop(uint64_t id, Connection &c) {
+            close(c.fd);
+            connections.erase(id);
+        }
+
+        const Shared &shared;
+        AdmissionQueue &admission;
+        int listenFd;
+        int epollFd;
+        bool acceptPaused = false;
+        chrono::steady_clock::time_point acceptResume;
+        uint64_t nextId = 2;
+        unordered_map<uint64_t, Connection> connections;
+        shared_ptr<Completions> completions;
+    };
+
+    // Обслуживание в текущем процессе: очередь допуска, потоки каналов разделяемой памяти с номерами
+    // firstChannel, firstChannel + channelStep, ... и цикл приёма соединений. Возвращается только при ошибке сокета.
+    // Очередь допуска, как и shared, segment и counters, живёт до завершения процесса: ею пользуются
+    // отсоединённые потоки соединений и каналов, поэтому она создаётся в куче и не освобождается.
+    int serveForever(const ServerOptions &options, const Shared &shared, int listenFd, const Shm::Segment &segment,
+                     AdmissionCounters &counters, uint32_t firstChannel, uint32_t channelStep) {
+        AdmissionQueue &admission = *new AdmissionQueue(shared, options.workers, max<size_t>(options.queueLimit, 1),
+                                                        options.maxQueueMs, options.degrade, counters);
+        if (!options.shmName.empty()) {
+            for (uint32_t c = firstChannel; c < options.shmChannels; c += channelStep) {
+                thread(serveShmChannel, &segment, c, &shared, &admission).detach();
+            }
+        }
+        if (options.eventLoop) {
+            int code = EventLoop(shared, admission, listenFd).run();
+            close(listenFd);
+            return code;
+        }
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno == EMFILE || errno == ENFILE) {
+                    this_thread::sleep_for(chrono::milliseconds(kAcceptPauseMs));
+                    continue;
+                }
+                break;
+            }
+            thread(serveConnection, fd, &shared, &admission).detach();
+        }
+        close(listenFd);
+        return 1;
+    }
+
+    // Пре-форк: родитель только порождает обработчиков и перезапускает завершившихся. Потоков до fork
+    // не создаётся — очередь допуска и её пул у каждого обработчика свои. Каналы разделяемой памяти
+    // делятся между обработчиками по остатку от деления номера. Кэш постраничной выдачи и история показов
+    // лежат в разделяемой памяти и общие: курсор принимает любой обработчик.
+    int runPrefork(const ServerOptions &options, Shared &shared, int listenFd, const Shm::Segment &segment) {
+        size_t count = static_cast<size_t>(options.processes);
+        RecSys::SharedArray<WorkerSlot> slots(count);
+        shared.workers = &slots;
+        shared.workerCount = count;
+        pid_t parent = getpid();
+        using Clock = chrono::steady_clock;
+        // Обработчик, падающий раньше kStableRun после старта, перезапускается с задержкой: 1 с, затем вдвое
+        // больше после каждого такого падения, но не больше kMaxBackoff. Проработавший дольше — сразу.
+        const Clock::duration kStableRun = chrono::seconds(10), kMinBackoff = chrono::seconds(1),
+                              kMaxBackoff = chrono::seconds(60);
+        vector<Clock::time_point> started(count), restartAt(count);
+        vector<Clock::duration> backoff(count, Clock::duration::zero());
+        vector<char> waiting(count, 0);
+        auto growBackoff = [&](size_t w) { backoff[w] = min(max(backoff[w] * 2, kMinBackoff), kMaxBackoff); };
+
+        auto spawn = [&](size_t w) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                // Обработчик не переживает родителя: иначе после его падения порт остался бы занят сиротами.
+                prctl(PR_SET_PDEATHSIG, SIGKILL);
+                if (getppid() != parent) _exit(1);
+                if (shared.pages) shared.pages->reseed();
+                _exit(serveForever(options, shared, listenFd, segment, slots[w].counters, static_cast<uint32_t>(w),
+                                   static_cast<uint32_t>(count)));
+            }
+            if (pid > 0) {
+                slots[w].pid = pid;
+                started[w] = Clock::now();
+            }
+            return pid > 0;
+        };
+
+        for (size_t w = 0; w < count; w++) {
+            if (!spawn(w)) {
+                cerr << "serve: не удалось породить обработчик: " << strerror(errno) << "\n";
+                return 1;
+            }
+        }
+        cerr << "serve: обработчиков " << count << "\n";
+        while (true) {
+            // Перезапуск обработчиков, чья задержка истекла. Пока кто-то ждёт перезапуска, завершившиеся
+            // собираются без блокировки (WNOHANG) с паузами не длиннее 100 мс.
+            Clock::time_point now = Clock::now(), wake = now + chrono::milliseconds(100);
+            bool pending = false;
+            for (size_t w = 0; w < count; w++) {
+                if (!waiting[w]) continue;
+                if (restartAt[w] <= now) {
+                    if (spawn(w)) {
+                        waiting[w] = 0;
+                        continue;
+                    }
+                    cerr << "serve: не удалось породить обработчик " << w << ": " << strerror(errno) << "\n";
+                    growBackoff(w);
+                    restartAt[w] = now + backoff[w];
+                }
+                pending = true;
+                wake = min(wake, restartAt[w]);
+            }
+            int status = 0;
+            pid_t pid = waitpid(-1, &status, pending ? WNOHANG : 0);
+            if (pending && (pid == 0 || (pid < 0 && errno == ECHILD))) {
+                this_thread::sleep_until(wake);
+                continue;
+            }
+            if (pid < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            size_t w = 0;
+            while (w < count && slots[w].pid != pid) w++;
+            if (w == count) continue;
+            now = Clock::now();
+            if (now - started[w] >= kStableRun) backoff[w] = Clock::duration::zero();
+            else growBackoff(w);
+            restartAt[w] = now + backoff[w];
+            waiting[w] = 1;
+            cerr << "serve: обработчик " << w << " (pid " << pid << ") ";
+            if (WIFSIGNALED(status)) cerr << "убит сигналом " << WTERMSIG(status);
+            else cerr << "завершился с кодом " << WEXITSTATUS(status);
+            if (backoff[w] > Clock::duration::zero()) {
+                cerr << ", перезапуск через " << chrono::duration_cast<chrono::seconds>(backoff[w]).count() << " с\n";
+            } else {
+                cerr << ", перезапуск\n";
+            }
+            // Запросы в очереди погибли вместе с процессом; накопленные счётчики остаются.
+            slots[w].pid = 0;
+            slots[w].restarts++;
+            slots[w].counters.queueDepth = 0;
+            slots[w].counters.inFlight = 0;
+        }
+        close(listenFd);
+        return 1;
+    }
+
+    // Точка входа режима --serve. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        ServerOptions options;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            function<string()> value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : ""; };
+            if (parseBudgetArg(arg, value, options.budgets)) continue;
+            if (arg == "--port") options.port = stoi(value());
+            else if (arg == "--catalog") options.catalogPath = value();
+            else if (arg == "--record") options.recordPath = value();
+            else if (arg == "--weights") options.weightsPath = value();
+            else if (arg == "--rerank") options.rerankPath = value();
+            else if (arg == "--rerank-top") options.rerankTop = stoi(value());
+            else if (arg == "--staged") options.staged = true;
+            else if (arg == "--blocklist") options.blocklistPath = value();
+            else if (arg == "--impression-slots") options.impressionSlots = stoull(value());
+            else if (arg == "--impression-windows") options.impressionWindows = stoi(value());
+            else if (arg == "--impression-window-sec") options.impressionWindowSec = static_cast<uint32_t>(stoul(value()));
+            else if (arg == "--impression-demote") options.impressionDemote = stod(value());
+            else if (arg == "--page-cache") options.pageCacheEntries = stoull(value());
+            else if (arg == "--page-ttl") options.pageTtlSec = static_cast<uint32_t>(stoul(value()));
+            else if (arg == "--page-depth") options.pageDepth = stoi(value());
+            else if (arg == "--deadline-ms") options.deadlineMs = stod(value());
+            else if (arg == "--workers") options.workers = stoi(value());
+            else if (arg == "--queue-limit") options.queueLimit = stoull(value());
+            else if (arg == "--max-queue-ms") options.maxQueueMs = stod(value());
+            else if (arg == "--shm") options.shmName = value();
+            else if (arg == "--shm-channels") options.shmChannels = static_cast<uint32_t>(stoul(value()));
+            else if (arg == "--shm-ring-kb") options.shmRingBytes = stoull(value()) << 10;
+            else if (arg == "--processes") options.processes = stoi(value());
+            else if (arg == "--event-loop") options.eventLoop = true;
+            else if (arg == "--overload") {
+                string mode = value();
+                if (mode != "reject" && mode != "degrade") {
+                    cerr << "serve: --overload принимает reject или degrade\n";
+                    return 2;
+                }
+                options.degrade = mode == "degrade";
+            }
+            else {
+                cerr << "serve: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+
+        vector<RecSys::Work> works;
+        if (!options.catalogPath.empty() && !RecSys::loadCatalog(options.catalogPath, works)) {
+            cerr << "serve: не удалось загрузить каталог " << options.catalogPath << "\n";
+            return 1;
+        }
+        // Общее состояние не освобождается: его используют отсоединённые потоки (см. serveForever).
+        Shared &shared = *new Shared;
+        shared.catalog = RecSys::buildCatalog(move(works));
+        if (options.staged) shared.budgets = new RecSys::StageBudgets(options.budgets);
+        if (options.impressionSlots > 0) {
+            shared.impressions.reset(new RecSys::ImpressionStore(options.impressionSlots, options.impressionWindows,
+                                                                 options.impressionWindowSec));
+            shared.impressionDemote = options.impressionDemote;
+            cerr << "serve: история показов " << shared.impressions->memoryBytes() / (1 << 20) << " МиБ\n";
+        }
+        shared.deadlineMs = options.deadlineMs;
+        if (options.pageCacheEntries > 0) {
+            shared.pages.reset(new PageCache(options.pageCacheEntries, options.pageTtlSec, options.pageDepth));
+            shared.pageDepth = options.pageDepth;
+        }
+        if (!options.blocklistPath.empty()) {
+            vector<string> blocked;
+            if (!loadIdList(options.blocklistPath, blocked)) {
+                cerr << "serve: не удалось загрузить список запретов " << options.blocklistPath << "\n";
+                return 1;
+            }
+            RecSys::blockWorks(shared.catalog, blocked);
+        }
+        for (size_t i = 0; i < shared.catalog.popularWorks.size() && shared.popular.size() < 1000; i++) {
+            uint32_t w = shared.catalog.popularWorks[i];
+            if (!shared.catalog.blocked.contains(w)) shared.popular.push_back(w);
+        }
+        if (!options.weightsPath.empty()) {
+            shared.weights.reset(new RecSys::Request);
+            if (!loadWeights(options.weightsPath, *shared.weights)) {
+                cerr << "serve: не удалось загрузить веса " << options.weightsPath << "\n";
+                return 1;
+            }
+        }
+        if (!options.rerankPath.empty()) {
+            RecSys::TreeEnsemble model;
+            if (!RecSys::loadEnsemble(options.rerankPath, model)) {
+                cerr << "serve: не удалось загрузить модель " << options.rerankPath << "\n";
+                return 1;
+            }
+            shared.reranker.reset(new RecSys::Reranker { RecSys::buildQuickScorer(model), options.rerankTop });
+        }
+        if (!options.recordPath.empty()) {
+            shared.recorder.reset(new Recorder(options.recordPath));
+            if (!shared.recorder->ok()) {
+                cerr << "serve: не удалось открыть " << options.recordPath << "\n";
+                return 1;
+            }
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+        int listenFd = Net::listenTcp(options.port);
+        if (listenFd < 0) {
+            cerr << "serve: не удалось открыть порт " << options.port << "\n";
+            return 1;
+        }
+        cerr << "serve: " << shared.catalog.works.size() << " произведений, порт " << options.port << "\n";
+        Shm::Segment &segment = *new Shm::Segment;
+        if (!options.shmName.empty()) {
+            // Ёмкость кольца округляется вверх до степени двойки: позиция в кольце — маска счётчика.
+            uint64_t ringBytes = Shm::kMinRingBytes;
+            while (ringBytes < options.shmRingBytes) ringBytes <<= 1;
+            if (options.shmChannels == 0 || !segment.create(options.shmName, options.shmChannels, ringBytes)) {
+                cerr << "serve: не удалось создать сегмент /" << options.shmName << "\n";
+                return 1;
+            }
+            cerr << "serve: разделяемая память /" << options.shmName << ", каналов " << options.shmChannels << "\n";
+        }
+        if (options.processes > 0) return runPrefork(options, shared, listenFd, segment);
+        return serveForever(options, shared, listenFd, segment, *new AdmissionCounters(), 0, 1);
+    }
+
+} // namespace Server
+
+//
+// --- Нагрузочный клиент (режим --loadgen) ---
+//
+// Подаёт на сервер поток запросов — записанный (--replay, файл кадров от Server --record)
+// или синтетический (--synthetic N, запросы от Gen без секции WORKS) — в одном из режимов:
+//   - открытый контур (--rate R): запросы отправляются по расписанию R в секунду через --connections соединений;
+//     задержка считается от запланированного момента отправки, а не от фактического, поэтому
+//     отставание клиента от расписания попадает в задержку (поправка на coordinated omission);
+//   - закрытый контур (--rate 0): каждое соединение отправляет следующий запрос сразу после ответа;
+//     с --expected-interval-us пропущенные из-за долгих ответов замеры достраиваются, как в HdrHistogram.
+// Итог — пропускная способность и гистограмма задержек с перцентилями хвоста.
+//
+namespace LoadGen {
+
+    // Логарифмически-линейная гистограмма задержек (в наносекундах) с точностью около 1%:
+    // значения до 256 хранятся точно, дальше каждый двоичный порядок делится на 128 ячеек.
+    class LatencyHistogram {
+    public:
+        LatencyHistogram() : counts(kBuckets, 0) {}
+
+        void record(uint64_t value) {
+            counts[bucketOf(value)]++;
+            total++;
+            sum += static_cast<double>(value);
+            maxValue = max(maxValue, value);
+        }
+
+        // Запись с поправкой на coordinated omission: если ответ ждали дольше ожидаемого интервала,
+        // добавляются замеры, которые клиент сделал бы, не будучи заблокированным.
+        void recordCorrected(uint64_t value, uint64_t expectedInterval) {
+            record(value);
+            if (expectedInterval == 0) return;
+            for (uint64_t missing = (value > expectedInterval) ? value - expectedInterval : 0;
+                 missing >= expectedInterval; missing -= expectedInterval) {
+                record(missing);
+            }
+        }
+
+        void merge(const LatencyHistogram &other) {
+            for (size_t i = 0; i < kBuckets; i++) counts[i] += other.counts[i];
+            total += other.total;
+            sum += other.sum;
+            maxValue = max(maxValue, other.maxValue);
+        }
+
+        uint64_t count() const { return total; }
+        uint64_t maximum() const { return maxValue; }
+        double mean() const { return total ? sum / total : 0; }
+
+        // Значение перцентиля q (0..100): верхняя граница ячейки, в которую он попадает.
+        uint64_t percentile(double q) const {
+            if (total == 0) return 0;
+            uint64_t rank = static_cast<uint64_t>(ceil(q / 100.0 * total));
+            rank = max<uint64_t>(rank, 1);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; i++) {
+                seen += counts[i];
+                if (seen >= rank) return min(upperBound(i), maxValue);
+            }
+            return maxValue;
+        }
+
+    private:
+        static const int kSubBits = 7;
+        static const size_t kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+        static size_t bucketOf(uint64_t value) {
+            if (value < (1u << kSubBits)) return static_cast<size_t>(value);
+            int shift = 63 - __builtin_clzll(value) - kSubBits;
+            return (static_cast<size_t>(shift) << kSubBits) + static_cast<size_t>(value >> shift);
+        }
+
+        static uint64_t upperBound(size_t bucket) {
+            if (bucket < (2u << kSubBits)) return bucket;
+            int shift = static_cast<int>(bucket >> kSubBits) - 1;
+            uint64_t sub = bucket - (static_cast<uint64_t>(shift) << kSubBits);
+            return ((sub + 1) << shift) - 1;
+        }
+
+        vector<uint64_t> counts;
+        uint64_t total = 0;
+        double sum = 0;
+        uint64_t maxValue = 0;
+    };
+
+    struct LoadOptions {
+        string host = "127.0.0.1";
+        int port = 7070;
+        string replayPath;              // файл кадров с записанными запросами
+        int synthetic = 0;              // число синтетических запросов
+        long long catalogWorks = 10000; // размер каталога сервера (для id в синтетических лайках)
+        double rate = 0;                // запросов в секунду; 0 — закрытый контур
+        int connections = 8;
+        double durationSec = 10;
+        double warmupSec = 1;
+        double expectedIntervalUs = 0;  // для поправки в закрытом контуре
+        string histOut;                 // CSV с распределением задержек
+        string shmName;                 // вместо TCP — каналы разделяемой памяти сервера
+    };
+
+    // Чтение записанного потока запросов (формат кадров сервера).
+    bool loadReplay(const string &path, vector<string> &requests) {
+        ifstream in(path, ios::binary);
+        if (!in) return false;
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        size_t pos = 0;
+        while (pos < data.size()) {
+            size_t newline = data.find('\n', pos);
+            if (newline == string::npos) return false;
+            size_t length = stoull(data.substr(pos, newline - pos));
+            if (data.size() - newline - 1 < length) return false;
+            requests.push_back(data.substr(newline + 1, length));
+            pos = newline + 1 + length;
+        }
+        return true;
+    }
+
+    // Синтетические запросы к каталогу из catalogWorks работ: разные seed — разные пользователи.
+    bool makeSynthetic(const LoadOptions &options, vector<string> &requests) {
+        for (int i = 0; i < options.synthetic; i++) {
+            Gen::GenOptions gen;
+            gen.seed = static_cast<uint64_t>(i) + 1;
+            gen.works = options.catalogWorks;
+            gen.emitWorks = false;
+            string text;
+            if (!Gen::generateText(gen, text)) return false;
+            requests.push_back(move(text));
+        }
+        return true;
+    }
+
+    // Состояние одного прогона, общее для всех соединений.
+    struct LoadState {
+        const LoadOptions *options;
+        const vector<string> *requests;
+        chrono::steady_clock::time_point start, measureFrom, end;
+        atomic<uint64_t> nextIndex { 0 };
+        atomic<uint64_t> completed { 0 };
+        atomic<uint64_t> errors { 0 };
+        mutex guard;
+        LatencyHistogram histogram;
+    };
+
+    void runConnection(LoadState &state) {
+        using Clock = chrono::steady_clock;
+        const LoadOptions &options = *state.options;
+        const auto &requests = *state.requests;
+        LatencyHistogram local;
+        uint64_t expectedInterval = static_cast<uint64_t>(options.expectedIntervalUs * 1000);
+        double intervalNs = options.rate > 0 ? 1e9 / options.rate : 0;
+
+        // Транспорт соединения: TCP-сокет или захваченный канал разделяемой памяти.
+        int fd = -1;
+        unique_ptr<Net::FrameReader> reader;
+        Shm::Client shm;
+        if (options.shmName.empty()) {
+            fd = Net::connectTcp(options.host, options.port);
+            if (fd >= 0) reader.reset(new Net::FrameReader(fd));
+        }
+        if (options.shmName.empty() ? fd < 0 : !shm.connect(options.shmName)) {
+            state.errors++;
+            return;
+        }
+        auto call = [&](const string &request, string &response) {
+            return reader ? Net::writeFrame(fd, request) && reader->next(response) : shm.call(request, response);
+        };
+        string response;
+        while (true) {
+            uint64_t index = state.nextIndex++;
+            Clock::time_point intended;
+            if (options.rate > 0) {
+                intended = state.start + chrono::nanoseconds(static_cast<long long>(index * intervalNs));
+                if (intended >= state.end) break;
+                this_thread::sleep_until(intended);
+            } else {
+                intended = Clock::now();
+                if (intended >= state.end) break;
+            }
+            const string &request = requests[index % requests.size()];
+            bool ok = call(request, response);
+            auto done = Clock::now();
+            if (!ok || response.find("\"recommendations\"") == string::npos) {
+                state.errors++;
+                if (!ok) break;
+                continue;
+            }
+            if (intended < state.measureFrom) continue;
+            uint64_t latency = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(done - intended).count());
+            if (options.rate > 0) local.record(latency);
+            else local.recordCorrected(latency, expectedInterval);
+            state.completed++;
+        }
+        if (fd >= 0) close(fd);
+        lock_guard<mutex> lock(state.guard);
+        state.histogram.merge(local);
+    }
+
+    void printReport(const LoadState &state, double measuredSec) {
+        const auto &h = state.histogram;
+        auto us = [](uint64_t ns) { return ns / 1000.0; };
+        cout << fixed << setprecision(1);
+        cout << "completed: " << state.completed << "  errors: " << state.errors << "  window: " << measuredSec
+             << " s  throughput: " << state.completed / measuredSec << " req/s\n";
+        cout << "latency, us: mean " << h.mean() / 1000.0 << "  p50 " << us(h.percentile(50)) << "  p90 "
+             << us(h.percentile(90)) << "  p99 " << us(h.percentile(99)) << "  p99.9 " << us(h.percentile(99.9))
+             << "  p99.99 " << us(h.percentile(99.99)) << "  max " << us(h.maximum()) << "\n";
+        cout << "\n" << setw(12) << "percentile" << setw(16) << "latency, us" << "\n";
+        for (double q : { 0.0, 25.0, 50.0, 75.0, 90.0, 95.0, 99.0, 99.5, 99.9, 99.95, 99.99, 100.0 }) {
+            cout << setw(12) << setprecision(2) << q << setw(16) << setprecision(1) << us(h.percentile(q)) << "\n";
+        }
+    }
+
+    bool writeHistogram(const string &path, const LatencyHistogram &h) {
+        ofstream out(path);
+        if (!out) return false;
+        out << "percentile,latency_us\n" << fixed;
+        // Шкала как у HdrHistogram: всё гуще к хвосту (1 - 1/2^n).
+        for (int step = 0; step <= 200; step++) {
+            double q = 100.0 * (1.0 - pow(0.5, step / 10.0));
+            out << setprecision(5) << q << ',' << setprecision(3) << h.percentile(q) / 1000.0 << '\n';
+        }
+        out << setprecision(5) << 100.0 << ',' << setprecision(3) << h.maximum() / 1000.0 << '\n';
+        return static_cast<bool>(out);
+    }
+
+    // Точка входа режима --loadgen. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        LoadOptions options;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            auto value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : "0"; };
+            if (arg == "--host") options.host = value();
+            else if (arg == "--port") options.port = stoi(value());
+            else if (arg == "--replay") options.replayPath = value();
+            else if (arg == "--synthetic") options.synthetic = stoi(value());
+            else if (arg == "--catalog-works") options.catalogWorks = stoll(value());
+            else if (arg == "--rate") options.rate = stod(value());
+            else if (arg == "--connections") options.connections = stoi(value());
+            else if (arg == "--duration") options.durationSec = stod(value());
+            else if (arg == "--warmup") options.warmupSec = stod(value());
+            else if (arg == "--expected-interval-us") options.expectedIntervalUs = stod(value());
+            else if (arg == "--hist-out") options.histOut = value();
+            else if (arg == "--shm") options.shmName = value();
+            else {
+                cerr << "loadgen: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+
+        vector<string> requests;
+        if (!options.replayPath.empty() && !loadReplay(options.replayPath, requests)) {
+            cerr << "loadgen: не удалось прочитать " << options.replayPath << "\n";
+            return 1;
+        }
+        if (options.synthetic > 0 && !makeSynthetic(options, requests)) {
+            cerr << "loadgen: не удалось сгенерировать запросы\n";
+            return 1;
+        }
+        if (requests.empty() || options.connections <= 0 || options.durationSec <= 0) {
+            cerr << "loadgen: нужны --replay или --synthetic, а также положительные --connections и --duration\n";
+            return 2;
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+        LoadState state;
+        state.options = &options;
+        state.requests = &requests;
+        state.start = chrono::steady_clock::now();
+        state.measureFrom = state.start + chrono::nanoseconds(static_cast<long long>(options.warmupSec * 1e9));
+        state.end = state.measureFrom + chrono::nanoseconds(static_cast<long long>(options.durationSec * 1e9));
+
+        vector<thread> threads;
+        for (int i = 0; i < options.connections; i++) threads.emplace_back(runConnection, ref(state));
+        for (auto &t : threads) t.join();
+
+        printReport(state, options.durationSec);
+        if (!options.histOut.empty() && !writeHistogram(options.histOut, state.histogram)) {
+            cerr << "loadgen: не удалось записать " << options.histOut << "\n";
+            return 1;
+        }
+        return state.errors > 0 ? 1 : 0;
+    }
+
+} // namespace LoadGen
+
+//
+// --- Дифференциальная проверка оптимизированных путей (режим --difftest) ---
+//
+// Каждая проверка — пара функций «эталон / оптимизированный путь», строящих ранжирование по запросу.
+// Эталон — исходная реализация из RecSys (recommendContentBased и т. д.), оптимизированный путь — ускоренная.
+// Запросы генерируются случайно, с намеренными крайними случаями: повторы тегов, нулевые веса, одинаковые
+// работы (ничьи), нулевые метрики. Ранжирования сравниваются так:
+//   - у каждой работы оценки совпадают с допуском --tolerance (относительно max(1, |оценка|));
+//   - оценки на позициях 1..k совпадают с тем же допуском (порядок — с точностью до ничьих);
+//   - множества top-k совпадают, кроме работ с оценкой, равной (в пределах допуска) оценке на границе k.
+// Упавший случай сжимается до минимального (удаляются работы, теги, пользователи, упрощаются значения,
+// пока расхождение сохраняется) и печатается во входном формате для воспроизведения.
+// Новые оптимизированные пути добавляются в checks().
+//
+namespace DiffTest {
+
+    using Ranking = vector<pair<string, double>>;
+
+    struct Check {
+        string name;
+        function<Ranking(const RecSys::Request &)> reference;
+        function<Ranking(const RecSys::Request &, int k)> optimized;
+        bool topK = false;      // оптимизированный путь возвращает только первые k элементов
+    };
+
+    // Эталон переранжирования: признаки по исходным структурам запроса, прямой обход деревьев.
+    Ranking referenceRerank(const RecSys::Request &r, Ranking recs, const RecSys::TreeEnsemble &model) {
+        double maxViews = 0, maxTime = 0;
+        for (const auto &work : r.works) {
+            maxViews = max(maxViews, work.viewCount);
+            maxTime = max(maxTime, work.interactionTime);
+        }
+        unordered_map<string, double> collab;
+        for (const auto &p : RecSys::recommendCollaborative(r.similarUsers)) collab[p.first] = p.second;
+        for (auto &p : recs) {
+            float row[RecSys::kRerankFeatures] = {};
+            row[3] = static_cast<float>(collab.count(p.first) ? collab[p.first] : 0.0);
+            for (const auto &work : r.works) {
+                if (work.id != p.first) continue;
+                row[0] = static_cast<float>(RecSys::cosineSimilarity(r.user, work));
+                row[1] = static_cast<float>(maxViews > 0 ? work.viewCount / maxViews : 0);
+                row[2] = static_cast<float>(maxTime > 0 ? work.interactionTime / maxTime : 0);
+                for (const auto &tag : work.tags) {
+                    for (const auto &own : r.user.tags) {
+                        if (own.name == tag.name) {
+                            row[4] += 1;
+                            break;
+                        }
+                    }
+                }
+                break;
+            }
+            p.second = RecSys::evaluateTrees(model, row);
+        }
+        stable_sort(recs.begin(), recs.end(), [](auto &a, auto &b) { return a.second > b.second; });
+        return recs;
+    }
+
+    const RecSys::TreeEnsemble &checkEnsemble() {
+        static const RecSys::TreeEnsemble model = RecSys::randomEnsemble(50, 4, 7);
+        return model;
+    }
+
+    // Эталон объединённого списка: исходные функции и удаление исключённых работ.
+    Ranking referenceCombined(const RecSys::Request &r, const RecSys::MetricsConfig &config, double contentWeight,
+                              double collabWeight) {
+        return RecSys::removeConstrained(
+            RecSys::removeExcluded(
+                RecSys::combineRecommendations(RecSys::recommendContentBased(r.user, r.works, config),
+                                               RecSys::recommendCollaborative(r.similarUsers), contentWeight,
+                                               collabWeight),
+                r.excludedWorks),
+            r, r.works);
+    }
+
+    // Эталон MMR: наибольшее сходство с выбранными пересчитывается заново на каждом шаге (O(N·k²)).
+    Ranking referenceMmr(const RecSys::Catalog &catalog, Ranking recs, size_t topN, size_t k, double lambda) {
+        vector<uint32_t> index = RecSys::diversityCandidates(catalog, recs, topN);
+        size_t n = index.size();
+        vector<size_t> picked;
+        vector<char> taken(n, 0);
+        RecSys::TagScatter scatter(catalog);
+        while (picked.size() < min(k, n)) {
+            size_t best = n;
+            double bestValue = 0;
+            for (size_t c = 0; c < n; c++) {
+                if (taken[c]) continue;
+                double maxSim = 0;
+                for (size_t s : picked) {
+                    if (index[s] == UINT32_MAX || index[c] == UINT32_MAX) continue;
+                    scatter.load(index[s]);
+                    maxSim = max(maxSim, scatter.cosine(index[c]));
+                }
+                double value = lambda * recs[c].second - (1 - lambda) * maxSim;
+                if (best == n || value > bestValue) {
+                    best = c;
+                    bestValue = value;
+                }
+            }
+            taken[best] = 1;
+            picked.push_back(best);
+        }
+        RecSys::applySelection(recs, picked);
+        return recs;
+    }
+
+    // Эталон покрытия тегов: обычный жадный выбор, приросты всех кандидатов пересчитываются на каждом шаге.
+    Ranking referenceCoverage(const RecSys::Catalog &catalog, Ranking recs, size_t topN, size_t k, double lambda) {
+        vector<uint32_t> index = RecSys::diversityCandidates(catalog, recs, topN);
+        size_t n = index.size();
+        vector<size_t> picked;
+        vector<char> taken(n, 0);
+        RecSys::TagCoverage coverage(catalog);
+        while (picked.size() < min(k, n)) {
+            size_t best = n;
+            double bestGain = 0;
+            for (size_t c = 0; c < n; c++) {
+                if (taken[c]) continue;
+                double gain = lambda * recs[c].second + (1 - lambda) * coverage.gain(index[c]);
+                if (best == n || gain > bestGain) {
+                    best = c;
+                    bestGain = gain;
+                }
+            }
+            taken[best] = 1;
+            picked.push_back(best);
+            coverage.add(index[best]);
+        }
+        RecSys::applySelection(recs, picked);
+        return recs;
+    }
+
+    // Эталон подавления дубликатов: SimHash считается заново по тегам исходных работ, по разряду за раз,
+    // результат собирается в новый список.
+    Ranking referenceNearDuplicates(const RecSys::Request &r, const Ranking &recs, size_t limit, int maxDistance) {
+        unordered_map<string, const RecSys::Work *> byId;
+        for (const auto &work : r.works) byId.emplace(work.id, &work);
+        Ranking result;
+        vector<uint64_t> kept;
+        for (const auto &rec : recs) {
+            auto it = byId.find(rec.first);
+            double norm = 0;
+            if (it != byId.end()) {
+                for (const auto &tag : it->second->tags) norm += tag.value * tag.value;
+            }
+            if (result.size() < limit && norm > 0) {
+                uint64_t signature = 0;
+                for (int b = 0; b < 64; b++) {
+                    double sum = 0;
+                    for (const auto &tag : it->second->tags) {
+                        sum += ((RecSys::tagHash(tag.name) >> b) & 1) ? tag.value : -tag.value;
+                    }
+                    if (sum > 0) signature |= 1ULL << b;
+                }
+                bool duplicate = false;
+                for (uint64_t other : kept) {
+                    int distance = 0;
+                    for (int b = 0; b < 64; b++) distance += ((signature ^ other) >> b) & 1;
+                    if (distance <= maxDistance) duplicate = true;
+                }
+                if (duplicate) continue;
+                kept.push_back(signature);
+            }
+            result.push_back(rec);
+        }
+        return result;
+    }
+
+    // Квоты проверки выводятся из самого запроса, чтобы эталон и оптимизированный путь видели одни и те же.
+    RecSys::Request withQuotas(RecSys::Request r) {
+        r.maxPerPrimaryTag = 1 + r.numRecommendations % 3;
+        r.minFresh = r.numRecommendations / 2;
+        r.freshMaxViews = r.works.empty() ? 0 : r.works.front().viewCount;
+        return r;
+    }
+
+    // Эталон квот: полный объединённый список, основной тег по именам тегов исходной работы, счётчики
+    // пересчитываются по уже выбранным на каждом шаге.
+    Ranking referenceQuotas(const RecSys::Request &r) {
+        auto catalog = RecSys::buildCatalog(r.works);
+        RecSys::ScoringScratch scratch;
+        Ranking all = RecSys::rankSweep(r, catalog, { { r.config, r.contentWeight, r.collabWeight } },
+                                        numeric_limits<int>::max(), scratch).front();
+        auto rank = [&](const pair<string, double> &p) {
+            auto it = catalog.workIndex.find(p.first);
+            return it != catalog.workIndex.end() ? it->second : UINT32_MAX;
+        };
+        sort(all.begin(), all.end(), [&](auto &a, auto &b) {
+            if (a.second != b.second) return a.second > b.second;
+            if (rank(a) != rank(b)) return rank(a) < rank(b);
+            return a.first < b.first;
+        });
+        auto primary = [&](const pair<string, double> &p) {
+            string tag;
+            double best = 0;
+            for (const auto &work : r.works) {
+                if (work.id != p.first) continue;
+                for (const auto &t : work.tags) {
+                    if (tag.empty() || t.value > best) {
+                        tag = t.name;
+                        best = t.value;
+                    }
+                }
+            }
+            return tag;
+        };
+        auto fresh = [&](const pair<string, double> &p) {
+            uint32_t i = rank(p);
+            return i != UINT32_MAX && catalog.works[i].viewCount <= r.freshMaxViews;
+        };
+        size_t slots = static_cast<size_t>(max(r.numRecommendations, 0));
+        Ranking selected, deferred;
+        auto capped = [&](const pair<string, double> &p) {
+            string tag = primary(p);
+            if (tag.empty()) return false;
+            int count = 0;
+            for (const auto &s : selected) count += primary(s) == tag;
+            return count >= r.maxPerPrimaryTag;
+        };
+        for (const auto &p : all) {
+            if (selected.size() >= slots) break;
+            if (capped(p)) continue;
+            int freshCount = 0;
+            for (const auto &s : selected) freshCount += fresh(s);
+            size_t missing = static_cast<size_t>(max(r.minFresh - freshCount, 0));
+            if (!fresh(p) && slots - selected.size() <= missing) {
+                if (deferred.size() < slots) deferred.push_back(p);
+                continue;
+            }
+            selected.push_back(p);
+        }
+        for (const auto &p : deferred) {
+            if (selected.size() < slots && !capped(p)) selected.push_back(p);
+        }
+        stable_sort(selected.begin(), selected.end(), [](auto &a, auto &b) { return a.second > b.second; });
+        return selected;
+    }
+
+    // Запрос через C ABI: структуры собираются из запроса, результат упорядочивается по оценке
+    // (рандомизация без случайной доли только перемешивает первые k).
+    Ranking recommendViaLibrary(const RecSys::Request &r, int k) {
+        vector<vector<recsys_tag>> tags(r.works.size());
+        vector<recsys_work> works(r.works.size());
+        for (size_t i = 0; i < r.works.size(); i++) {
+            for (const auto &tag : r.works[i].tags) tags[i].push_back({ tag.name.c_str(), tag.value });
+            works[i] = { r.works[i].id.c_str(), tags[i].data(), tags[i].size(), r.works[i].viewCount,
+                         r.works[i].interactionTime };
+        }
+        recsys::Engine engine(works.data(), works.size());
+        vector<recsys_tag> profile;
+        for (const auto &tag : r.user.tags) profile.push_back({ tag.name.c_str(), tag.value });
+        vector<vector<const char *>> liked(r.similarUsers.size());
+        vector<recsys_similar_user> users;
+        for (size_t u = 0; u < r.similarUsers.size(); u++) {
+            for (const auto &id : r.similarUsers[u].likedWorks) liked[u].push_back(id.c_str());
+            users.push_back({ r.similarUsers[u].id.c_str(), r.similarUsers[u].similarity, liked[u].data(),
+                              liked[u].size() });
+        }
+        vector<const char *> excluded;
+        for (const auto &id : r.excludedWorks) excluded.push_back(id.c_str());
+        recsys_request request;
+        recsys_request_init(&request);
+        request.profile = profile.data();
+        request.profile_len = profile.size();
+        request.similar_users = users.data();
+        request.num_similar_users = users.size();
+        request.num_recommendations = k;
+        request.use_metrics = r.config.useMetrics;
+        request.weight_views = r.config.weightViews;
+        request.weight_time = r.config.weightTime;
+        request.weight_tags = r.config.weightTags;
+        request.content_weight = r.contentWeight;
+        request.collab_weight = r.collabWeight;
+        request.excluded_works = excluded.data();
+        request.num_excluded = excluded.size();
+        request.seed = 1;
+        vector<recsys_result> out(static_cast<size_t>(max(k, 0)));
+        long count = engine.recommend(request, out.data(), out.size());
+        Ranking result;
+        for (long i = 0; i < count; i++) result.push_back({ out[i].id ? out[i].id : "", out[i].score });
+        stable_sort(result.begin(), result.end(), [](auto &a, auto &b) { return a.second > b.second; });
+        return result;
+    }
+
+    // Контентные рекомендации по каталогу, прошедшему через три файла-шарда и их параллельную загрузку.
+    Ranking recommendViaShards(const RecSys::Request &r, const RecSys::ShardLoadOptions &options = {}) {
+        string base = "/tmp/recsys-difftest-" + to_string(getpid()) + ".";
+        vector<string> paths;
+        for (size_t s = 0; s < 3; s++) {
+            vector<RecSys::Work> part(r.works.begin() + r.works.size() * s / 3,
+                                      r.works.begin() + r.works.size() * (s + 1) / 3);
+            RecSys::saveCatalog(base + to_string(s), part);
+            paths.push_back(base + to_string(s));
+        }
+        vector<RecSys::Work> works;
+        bool ok = RecSys::loadCatalogShards(paths, works, options);
+        for (const auto &path : paths) remove(path.c_str());
+        if (!ok) return {};
+        return RecSys::recommendContentBasedIndexed(r.user, RecSys::buildCatalog(works), r.config);
+    }
+
+    vector<Check> checks() {
+        return {
+            { "content-indexed",
+              [](const RecSys::Request &r) {
+                  return RecSys::recommendContentBased(r.user, r.works, r.config);
+              },
+              [](const RecSys::Request &r, int) {
+                  return RecSys::recommendContentBasedIndexed(r.user, RecSys::buildCatalog(r.works), r.config);
+              } },
+            { "combined-indexed",
+              [](const RecSys::Request &r) {
+                  return RecSys::combineRecommendations(RecSys::recommendContentBased(r.user, r.works, r.config),
+                                                        RecSys::recommendCollaborative(r.similarUsers), 0.5, 0.5);
+              },
+              [](const RecSys::Request &r, int) {
+                  auto catalog = RecSys::buildCatalog(r.works);
+                  return RecSys::combineRecommendations(
+                      RecSys::recommendContentBasedIndexed(r.user, catalog, r.config),
+                      RecSys::recommendCollaborative(r.similarUsers), 0.5, 0.5);
+              } },
+            { "combined-batch-topk",
+              [](const RecSys::Request &r) { return referenceCombined(r, r.config, 0.5, 0.5); },
+              [](const RecSys::Request &r, int k) {
+                  return RecSys::rankBatch({ r }, RecSys::buildCatalog(r.works), k, 0.5, 0.5, 1).front();
+              },
+              true },
+            { "sweep-topk",
+              [](const RecSys::Request &r) {
+                  // Эталон для второй конфигурации перебора: те же работы, другие веса.
+                  return referenceCombined(r, { true, 0.3, 0.05, 0.7 }, 0.8, 0.2);
+              },
+              [](const RecSys::Request &r, int k) {
+                  RecSys::ScoringScratch scratch;
+                  vector<RecSys::SweepConfig> configs { { r.config, 0.5, 0.5 }, { { true, 0.3, 0.05, 0.7 }, 0.8, 0.2 } };
+                  return RecSys::rankSweep(r, RecSys::buildCatalog(r.works), configs, k, scratch)[1];
+              },
+              true },
+            { "staged-unbounded",
+              [](const RecSys::Request &r) { return referenceCombined(r, r.config, 0.5, 0.5); },
+              [](const RecSys::Request &r, int) {
+                  // Без ограничений бюджетов кандидаты — весь каталог и все лайки, результат точный.
+                  RecSys::StageBudgets budgets { 0, 0, 0, 0, 0 };
+                  return RecSys::rankStaged(r, RecSys::buildCatalog(r.works), budgets);
+              } },
+            { "pipeline-indexed",
+              [](const RecSys::Request &r) { return referenceCombined(r, r.config, r.contentWeight, r.collabWeight); },
+              [](const RecSys::Request &r, int) { return RecSys::rankIndexed(r, RecSys::buildCatalog(r.works)); } },
+            { "mmr-incremental",
+              [](const RecSys::Request &r) {
+                  auto catalog = RecSys::buildCatalog(r.works);
+                  return referenceMmr(catalog, RecSys::rankIndexed(r, catalog), 20, r.numRecommendations, 0.6);
+              },
+              [](const RecSys::Request &r, int) {
+                  RecSys::Request c = r;
+                  c.diversity = "mmr";
+                  c.diversityLambda = 0.6;
+                  c.diversityTop = 20;
+                  auto catalog = RecSys::buildCatalog(r.works);
+                  auto recs = RecSys::rankIndexed(c, catalog);
+                  RecSys::diversify(c, catalog, recs);
+                  return recs;
+              } },
+            { "coverage-lazy",
+              [](const RecSys::Request &r) {
+                  auto catalog = RecSys::buildCatalog(r.works);
+                  return referenceCoverage(catalog, RecSys::rankIndexed(r, catalog), 20, r.numRecommendations, 0.5);
+              },
+              [](const RecSys::Request &r, int) {
+                  RecSys::Request c = r;
+                  c.diversity = "coverage";
+                  c.diversityLambda = 0.5;
+                  c.diversityTop = 20;
+                  auto catalog = RecSys::buildCatalog(r.works);
+                  auto recs = RecSys::rankIndexed(c, catalog);
+                  RecSys::diversify(c, catalog, recs);
+                  return recs;
+              } },
+            { "simhash-dedup",
+              [](const RecSys::Request &r) {
+                  auto recs = RecSys::rankIndexed(r, RecSys::buildCatalog(r.works));
+                  return referenceNearDuplicates(r, recs, static_cast<size_t>(max(r.numRecommendations, 0)), 24);
+              },
+              [](const RecSys::Request &r, int) {
+                  RecSys::Request c = r;
+                  c.nearDuplicateDistance = 24;
+                  auto catalog = RecSys::buildCatalog(r.works);
+                  auto recs = RecSys::rankIndexed(c, catalog);
+                  RecSys::diversify(c, catalog, recs);
+                  return recs;
+              } },
+            { "simhash-dedup-randomized",
+              [](const RecSys::Request &r) {
+                  // Случайная доля берётся только из проверенных max(k, diversityTop) работ.
+                  size_t limit = static_cast<size_t>(max(r.numRecommendations, 3));
+                  auto recs = referenceNearDuplicates(r, RecSys::rankIndexed(r, RecSys::buildCatalog(r.works)), limit,
+                                                      24);
+                  if (recs.size() > limit) recs.resize(limit);
+                  return RecSys::getRandomizedRecommendations(recs, r.numRecommendations, 0.4, 42);
+              },
+              [](const RecSys::Request &r, int) {
+                  RecSys::Request c = r;
+                  c.nearDuplicateDistance = 24;
+                  c.diversityTop = 3;
+                  c.randomFactor = 0.4;
+                  c.randomSeed = 42;
+                  return RecSys::recommend(c, RecSys::buildCatalog(r.works));
+              } },
+            { "quota-streaming",
+              [](const RecSys::Request &r) { return referenceQuotas(withQuotas(r)); },
+              [](const RecSys::Request &r, int) {
+                  RecSys::ScoringScratch scratch;
+                  return RecSys::rankWithQuotas(withQuotas(r), RecSys::buildCatalog(r.works), scratch);
+              } },
+            { "anytime-unbounded",
+              [](const RecSys::Request &r) { return referenceCombined(r, r.config, r.contentWeight, r.collabWeight); },
+              [](const RecSys::Request &r, int k) {
+                  // Бюджет не истекает: обход блоков по границам с досрочной остановкой должен дать точный top-k.
+                  bool approximate = false;
+                  return RecSys::rankAnytime(r, RecSys::buildCatalog(r.works), static_cast<size_t>(k),
+                                             chrono::steady_clock::time_point::max(), nullptr, approximate);
+              },
+              true },
+            { "anytime-unbounded-quotas",
+              [](const RecSys::Request &r) {
+                  // recommend перемешивает выдачу, поэтому эталон перемешивается с тем же зерном.
+                  return RecSys::getRandomizedRecommendations(referenceQuotas(withQuotas(r)), r.numRecommendations, 0,
+                                                              42);
+              },
+              [](const RecSys::Request &r, int) {
+                  // Бюджет не истекает: квоты должны заполниться как по полному списку, без пометки приближённой.
+                  RecSys::Request c = withQuotas(r);
+                  c.deadlineMs = 1e6;
+                  c.randomSeed = 42;
+                  bool approximate = false;
+                  auto recs = RecSys::recommend(c, RecSys::buildCatalog(r.works), nullptr, nullptr, &approximate);
+                  if (approximate) recs.clear();
+                  return recs;
+              } },
+            { "catalog-shards",
+              [](const RecSys::Request &r) { return RecSys::recommendContentBased(r.user, r.works, r.config); },
+              [](const RecSys::Request &r, int) { return recommendViaShards(r); } },
+            { "catalog-shards-uring-failure",
+              [](const RecSys::Request &r) { return RecSys::recommendContentBased(r.user, r.works, r.config); },
+              [](const RecSys::Request &r, int) {
+                  // Мелкие блоки дают несколько отправок; вторая отказывает, когда первые чтения ещё в полёте,
+                  // и остаток дочитывает pread.
+                  RecSys::ShardLoadOptions options;
+                  options.chunkBytes = 16;
+                  options.uringFailAfter = 1;
+                  return recommendViaShards(r, options);
+              } },
+            { "c-abi",
+              [](const RecSys::Request &r) {
+                  // Ограничения по тегам в версии 1 интерфейса не передаются.
+                  RecSys::Request c = r;
+                  c.requiredTags.clear();
+                  c.forbiddenTags.clear();
+                  return referenceCombined(c, c.config, c.contentWeight, c.collabWeight);
+              },
+              recommendViaLibrary,
+              true },
+            { "rerank-quickscorer",
+              [](const RecSys::Request &r) {
+                  return referenceRerank(
+                      r,
+                      RecSys::combineRecommendations(RecSys::recommendContentBased(r.user, r.works, r.config),
+                                                     RecSys::recommendCollaborative(r.similarUsers), 0.5, 0.5),
+                      checkEnsemble());
+              },
+              [](const RecSys::Request &r, int) {
+                  auto catalog = RecSys::buildCatalog(r.works);
+                  auto recs = RecSys::combineRecommendations(
+                      RecSys::recommendContentBasedIndexed(r.user, catalog, r.config),
+                      RecSys::recommendCollaborative(r.similarUsers), 0.5, 0.5);
+                  RecSys::Reranker reranker { RecSys::buildQuickScorer(checkEnsemble()), 1000 };
+                  RecSys::rerank(r, catalog, reranker, recs);
+                  return recs;
+              } },
+        };
+    }
+
+    struct DiffOptions {
+        int cases = 500;
+        uint64_t seed = 1;
+        int k = 10;
+        double tolerance = 1e-9;
+        string filter;
+        string outDir;          // куда сохранить минимальные упавшие случаи
+    };
+
+    // Случайный запрос небольшого размера: маленький словарь, чтобы теги часто пересекались.
+    RecSys::Request randomRequest(uint64_t seed) {
+        Gen::Rng rng(seed);
+        RecSys::Request r;
+        int vocabulary = 2 + static_cast<int>(rng.below(12));
+        auto tagValue = [&]() {
+            double u = rng.uniform();
+            if (u < 0.1) return 0.0;
+            if (u < 0.3) return 1.0;
+            return static_cast<double>(1 + rng.below(1000)) / 1000.0;
+        };
+        auto randomTags = [&](int maxCount) {
+            vector<RecSys::Tag> tags;
+            int count = static_cast<int>(rng.below(maxCount + 1));
+            for (int i = 0; i < count; i++) {
+                tags.push_back({ "t" + to_string(rng.below(vocabulary)), tagValue() });
+            }
+            return tags;
+        };
+        r.user.tags = randomTags(8);
+        int numWorks = 1 + static_cast<int>(rng.below(40));
+        bool noMetrics = rng.uniform() < 0.1;
+        for (int i = 0; i < numWorks; i++) {
+            RecSys::Work work;
+            work.id = "w" + to_string(i);
+            if (i > 0 && rng.uniform() < 0.15) {
+                // Копия одной из предыдущих работ — источник ничьих.
+                const RecSys::Work &copy = r.works[rng.below(r.works.size())];
+                work.tags = copy.tags;
+                work.viewCount = copy.viewCount;
+                work.interactionTime = copy.interactionTime;
+            } else {
+                work.tags = randomTags(6);
+                work.viewCount = noMetrics ? 0 : static_cast<double>(rng.below(10000));
+                work.interactionTime = noMetrics ? 0 : static_cast<double>(rng.below(600));
+            }
+            r.works.push_back(work);
+        }
+        int numUsers = static_cast<int>(rng.below(6));
+        for (int u = 0; u < numUsers; u++) {
+            RecSys::SimilarUser user { "u" + to_string(u), static_cast<double>(rng.below(1001)) / 1000.0, {} };
+            int likes = static_cast<int>(rng.below(8));
+            for (int j = 0; j < likes; j++) {
+                // Иногда лайк на работу вне каталога — она попадает только в коллаборативную часть.
+                user.likedWorks.push_back("w" + to_string(rng.below(numWorks + 3)));
+            }
+            r.similarUsers.push_back(user);
+        }
+        r.numRecommendations = 1 + static_cast<int>(rng.below(10));
+        r.randomFactor = 0;
+        r.config = { rng.uniform() < 0.8, rng.uniform(), rng.uniform(), rng.uniform() < 0.1 ? 0.0 : 1.0 };
+        if (rng.uniform() < 0.3) {
+            // Исключения: работы каталога и лайкнутые работы вне его, иногда с повторами.
+            int excluded = 1 + static_cast<int>(rng.below(5));
+            for (int i = 0; i < excluded; i++) r.excludedWorks.push_back("w" + to_string(rng.below(numWorks + 3)));
+        }
+        if (rng.uniform() < 0.3) {
+            // Ограничения по тегам; имя вне словаря даёт пустое пересечение.
+            int required = static_cast<int>(rng.below(3)), forbidden = static_cast<int>(rng.below(2));
+            for (int i = 0; i < required; i++) r.requiredTags.push_back("t" + to_string(rng.below(vocabulary + 1)));
+            for (int i = 0; i < forbidden; i++) r.forbiddenTags.push_back("t" + to_string(rng.below(vocabulary + 1)));
+        }
+        return r;
+    }
+
+    bool close(double a, double b, double tolerance) {
+        return fabs(a - b) <= tolerance * max(1.0, fabs(a));
+    }
+
+    // Сравнение ранжирований. Возвращает пустую строку, если они эквивалентны, иначе описание расхождения.
+    // Если topK, оптимизированный путь вернул только первые k элементов, и оценки сверяются лишь для них.
+    string compareRankings(const Ranking &ref, const Ranking &opt, int k, double tolerance, bool topK) {
+        size_t expected = topK ? min(ref.size(), static_cast<size_t>(max(k, 0))) : ref.size();
+        if (opt.size() != expected) {
+            return "размер: ожидалось " + to_string(expected) + ", оптимизированный " + to_string(opt.size());
+        }
+        unordered_map<string, double> refScores;
+        for (const auto &p : ref) refScores[p.first] = p.second;
+        if (!topK && refScores.size() != ref.size()) return "повтор идентификатора в эталоне";
+        unordered_map<string, int> seen;
+        for (const auto &p : opt) {
+            if (seen[p.first]++ > 0) return "повтор работы " + p.first;
+            auto it = refScores.find(p.first);
+            if (it == refScores.end()) return "лишняя работа " + p.first;
+            if (!close(it->second, p.second, tolerance)) {
+                ostringstream msg;
+                msg << setprecision(17) << "оценка " << p.first << ": " << it->second << " против " << p.second;
+                return msg.str();
+            }
+        }
+        size_t top = min(ref.size(), static_cast<size_t>(max(k, 0)));
+        for (size_t i = 0; i < top; i++) {
+            if (!close(ref[i].second, opt[i].second, tolerance)) {
+                ostringstream msg;
+                msg << setprecision(17) << "позиция " << i + 1 << ": " << ref[i].first << "=" << ref[i].second
+                    << " против " << opt[i].first << "=" << opt[i].second;
+                return msg.str();
+            }
+        }
+        if (top == 0) return "";
+        // Работы строго выше границы top-k обязаны попасть в top-k обоих ранжирований.
+        double boundary = ref[top - 1].second;
+        unordered_map<string, bool> optTop;
+        for (size_t i = 0; i < top; i++) optTop[opt[i].first] = true;
+        for (size_t i = 0; i < top; i++) {
+            if (close(ref[i].second, boundary, tolerance)) continue;
+            if (!optTop.count(ref[i].first)) return "top-" + to_string(top) + " без " + ref[i].first;
+        }
+        return "";
+    }
+
+    string runCheck(const Check &check, const RecSys::Request &request, const DiffOptions &options) {
+        return compareRankings(check.reference(request), check.optimized(request, options.k), options.k,
+                               options.tolerance, check.topK);
+    }
+
+    // Жадное сжатие упавшего случая: применяем упрощения, пока расхождение сохраняется.
+    RecSys::Request shrink(RecSys::Request request, const function<bool(const RecSys::Request &)> &fails) {
+        bool changed = true;
+        auto attempt = [&](RecSys::Request candidate) {
+            if (!fails(candidate)) return false;
+            request = move(candidate);
+            changed = true;
+            return true;
+        };
+        while (changed) {
+            changed = false;
+            // Сначала крупные шаги: отбрасываем половины каталога.
+            for (size_t chunk = request.works.size() / 2; chunk >= 1; chunk /= 2) {
+                for (size_t start = 0; start + chunk <= request.works.size();) {
+                    RecSys::Request c = request;
+                    c.works.erase(c.works.begin() + start, c.works.begin() + start + chunk);
+                    if (!attempt(move(c))) start += chunk;
+                }
+            }
+            for (size_t u = 0; u < request.similarUsers.size();) {
+                RecSys::Request c = request;
+                c.similarUsers.erase(c.similarUsers.begin() + u);
+                if (!attempt(move(c))) u++;
+            }
+            for (auto member : { &RecSys::Request::excludedWorks, &RecSys::Request::requiredTags,
+                                 &RecSys::Request::forbiddenTags }) {
+                for (size_t j = 0; j < (request.*member).size();) {
+                    RecSys::Request c = request;
+                    (c.*member).erase((c.*member).begin() + j);
+                    if (!attempt(move(c))) j++;
+                }
+            }
+            for (size_t u = 0; u < request.similarUsers.size(); u++) {
+                for (size_t j = 0; j < request.similarUsers[u].likedWorks.size();) {
+                    RecSys::Request c = request;
+                    c.similarUsers[u].likedWorks.erase(c.similarUsers[u].likedWorks.begin() + j);
+                    if (!attempt(move(c))) j++;
+                }
+            }
+            for (size_t t = 0; t < request.user.tags.size();) {
+                RecSys::Request c = request;
+                c.user.tags.erase(c.user.tags.begin() + t);
+                if (!attempt(move(c))) t++;
+            }
+            for (size_t w = 0; w < request.works.size(); w++) {
+                for (size_t t = 0; t < request.works[w].tags.size();) {
+                    RecSys::Request c = request;
+                    c.works[w].tags.erase(c.works[w].tags.begin() + t);
+                    if (!attempt(move(c))) t++;
+                }
+                if (request.works[w].viewCount != 0) {
+                    RecSys::Request c = request;
+                    c.works[w].viewCount = 0;
+                    attempt(move(c));
+                }
+                if (request.works[w].interactionTime != 0) {
+                    RecSys::Request c = request;
+                    c.works[w].interactionTime = 0;
+                    attempt(move(c));
+                }
+                for (size_t t = 0; t < request.works[w].tags.size(); t++) {
+                    if (request.works[w].tags[t].value == 1.0) continue;
+                    RecSys::Request c = request;
+                    c.works[w].tags[t].value = 1.0;
+                    attempt(move(c));
+                }
+            }
+            for (size_t t = 0; t < request.user.tags.size(); t++) {
+                if (request.user.tags[t].value == 1.0) continue;
+                RecSys::Request c = request;
+                c.user.tags[t].value = 1.0;
+                attempt(move(c));
+            }
+        }
+        return request;
+    }
+
+    // Точка входа режима --difftest. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        DiffOptions options;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            auto value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : "0"; };
+            if (arg == "--cases") options.cases = stoi(value());
+            else if (arg == "--seed") options.seed = stoull(value());
+            else if (arg == "--k") options.k = stoi(value());
+            else if (arg == "--tolerance") options.tolerance = stod(value());
+            else if (arg == "--filter") options.filter = value();
+            else if (arg == "--out-dir") options.outDir = value();
+            else {
+                cerr << "difftest: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+
+        int failures = 0;
+        for (const auto &check : checks()) {
+            if (!options.filter.empty() && check.name.find(options.filter) == string::npos) continue;
+            int passed = 0;
+            for (int c = 0; c < options.cases; c++) {
+                uint64_t seed = options.seed + static_cast<uint64_t>(c);
+                RecSys::Request request = randomRequest(seed);
+                string diff = runCheck(check, request, options);
+                if (diff.empty()) {
+                    passed++;
+                    continue;
+                }
+                failures++;
+                RecSys::Request minimal = shrink(request, [&](const RecSys::Request &r) {
+                    return !runCheck(check, r, options).empty();
+                });
+                cout << "FAIL " << check.name << " seed=" << seed << ": " << diff << "\n"
+                     << "  после сжатия: " << runCheck(check, minimal, options) << "\n";
+                writeRequest(cout, minimal);
+                if (!options.outDir.empty()) {
+                    ofstream out(options.outDir + "/difftest-" + check.name + "-" + to_string(seed) + ".txt");
+                    writeRequest(out, minimal);
+                }
+                break; // один сжатый случай на проверку достаточно
+            }
+            cout << check.name << ": " << passed << " совпадений\n";
+        }
+        return failures > 0 ? 1 : 0;
+    }
+
+} // namespace DiffTest
+
+//
+// --- Оценка приближённого поиска: полнота и задержка (режим --recall) ---
+//
+// Набор запросов прогоняется через точный recommendContentBased и через каждый приближённый режим
+// с каждым набором параметров. Для каждой точки считаются recall@k и NDCG@k относительно точного
+// top-k (с учётом ничьих на границе) и распределение задержки приближённого пути.
+// Точки пишутся в CSV с отметкой Парето-оптимальности по паре (recall@k выше, p99 задержки ниже) —
+// по ней выбираются безопасные параметры. Новые приближённые режимы добавляются в settings().
+//
+namespace Recall {
+
+    using Ranking = vector<pair<string, double>>;
+
+    // Один набор параметров одного приближённого режима.
+    struct Setting {
+        string mode;
+        string params;
+        function<Ranking(const RecSys::UserProfile &, const RecSys::MetricsConfig &, int)> run;
+    };
+
+    vector<Setting> settings(const RecSys::Catalog &catalog) {
+        vector<Setting> result;
+        // Точный путь по индексу — базовая точка для задержки (полнота должна быть 1).
+        result.push_back({ "exact-indexed", "-", [&catalog](const RecSys::UserProfile &user,
+                                                             const RecSys::MetricsConfig &config, int k) {
+            auto recs = RecSys::recommendContentBasedIndexed(user, catalog, config);
+            recs.resize(min(recs.size(), static_cast<size_t>(k)));
+            return recs;
+        } });
+        for (int profileTags : { 2, 4, 8, 16, 0 }) {
+            for (int postings : { 100, 1000, 10000, 0 }) {
+                RecSys::ApproxParams params { profileTags, postings };
+                result.push_back({ "pruned", "profile_tags=" + to_string(profileTags) + ";postings=" + to_string(postings),
+                                   [&catalog, params](const RecSys::UserProfile &user,
+                                                      const RecSys::MetricsConfig &config, int k) {
+                    return RecSys::recommendContentBasedApprox(user, catalog, config, k, params);
+                } });
+            }
+        }
+        return result;
+    }
+
+    struct RecallOptions {
+        string catalogPath;
+        long long works = 100000;   // размер синтетического каталога, если --catalog не задан
+        int queries = 50;
+        int k = 10;
+        string filter;              // подстрока имени режима
+        string outPath;             // CSV со всеми точками и отметкой Парето
+    };
+
+    // Точность одной точки по всем запросам.
+    struct Point {
+        string mode, params;
+        double recall = 0, ndcg = 0;
+        double meanUs = 0, p50Us = 0, p95Us = 0, p99Us = 0;
+        bool pareto = false;
+    };
+
+    // Доля точного top-k в приближённом: работа засчитывается, если её точная оценка не ниже k-й
+    // (ничьи на границе взаимозаменяемы).
+    double recallAtK(const Ranking &exact, const unordered_map<string, double> &exactScores,
+                     const Ranking &approx, int k) {
+        size_t top = min(exact.size(), static_cast<size_t>(k));
+        if (top == 0) return 1;
+        double boundary = exact[top - 1].second;
+        size_t hits = 0;
+        for (size_t i = 0; i < min(approx.size(), top); i++) {
+            auto it = exactScores.find(approx[i].first);
+            if (it != exactScores.end() && it->second >= boundary - 1e-12) hits++;
+        }
+        return static_cast<double>(min(hits, top)) / top;
+    }
+
+    // NDCG@k с точными оценками в роли релевантности.
+    double ndcgAtK(const Ranking &exact, const unordered_map<string, double> &exactScores,
+                   const Ranking &approx, int k) {
+        double dcg = 0, ideal = 0;
+        for (size_t i = 0; i < min(exact.size(), static_cast<size_t>(k)); i++) {
+            ideal += max(exact[i].second, 0.0) / log2(i + 2.0);
+        }
+        for (size_t i = 0; i < min(approx.size(), static_cast<size_t>(k)); i++) {
+            auto it = exactScores.find(approx[i].first);
+            if (it != exactScores.end()) dcg += max(it->second, 0.0) / log2(i + 2.0);
+        }
+        return ideal > 0 ? dcg / ideal : 1;
+    }
+
+    double percentileOf(vector<double> values, double q) {
+        if (values.empty()) return 0;
+        sort(values.begin(), values.end());
+        size_t rank = static_cast<size_t>(ceil(q / 100.0 * values.size()));
+        return values[min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+    }
+
+    // Точка Парето-оптимальна, если никакая другая не лучше по полноте и не хуже по p99 (и наоборот).
+    void markPareto(vector<Point> &points) {
+        for (auto &p : points) {
+            p.pareto = true;
+            for (const auto &q : points) {
+                bool noWorse = q.recall >= p.recall && q.p99Us <= p.p99Us;
+                bool better = q.recall > p.recall || q.p99Us < p.p99Us;
+                if (noWorse && better) {
+                    p.pareto = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Точка входа режима --recall. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        RecallOptions options;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            auto value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : "0"; };
+            if (arg == "--catalog") options.catalogPath = value();
+            else if (arg == "--works") options.works = stoll(value());
+            else if (arg == "--queries") options.queries = stoi(value());
+            else if (arg == "--k") options.k = stoi(value());
+            else if (arg == "--filter") options.filter = value();
+            else if (arg == "--out") options.outPath = value();
+            else {
+                cerr << "recall: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+
+        // Каталог: бинарный файл или синтетический от Gen.
+        vector<RecSys::Work> works;
+        if (!Gen::loadOrGenerateWorks(options.catalogPath, options.works, works)) {
+            cerr << "recall: не удалось загрузить каталог " << options.catalogPath << "\n";
+            return 1;
+        }
+        RecSys::Catalog catalog = RecSys::buildCatalog(works);
+
+        // Запросы и точные ответы эталонной реализации.
+        vector<RecSys::Request> queries;
+        vector<Ranking> exact;
+        vector<unordered_map<string, double>> exactScores;
+        for (int q = 0; q < options.queries; q++) {
+            RecSys::Request request;
+            if (!Gen::syntheticRequest(1000 + static_cast<uint64_t>(q), static_cast<long long>(works.size()), request)) {
+                return 1;
+            }
+            Ranking ranking = RecSys::recommendContentBased(request.user, works, request.config);
+            exactScores.emplace_back(ranking.begin(), ranking.end());
+            ranking.resize(min(ranking.size(), static_cast<size_t>(options.k)));
+            exact.push_back(move(ranking));
+            queries.push_back(move(request));
+        }
+
+        vector<Point> points;
+        for (const auto &setting : settings(catalog)) {
+            if (!options.filter.empty() && setting.mode.find(options.filter) == string::npos) continue;
+            Point point { setting.mode, setting.params };
+            vector<double> latencies;
+            for (size_t q = 0; q < queries.size(); q++) {
+                auto start = chrono::steady_clock::now();
+                Ranking approx = setting.run(queries[q].user, queries[q].config, options.k);
+                latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+                point.recall += recallAtK(exact[q], exactScores[q], approx, options.k);
+                point.ndcg += ndcgAtK(exact[q], exactScores[q], approx, options.k);
+            }
+            size_t n = max<size_t>(queries.size(), 1);
+            point.recall /= n;
+            point.ndcg /= n;
+            for (double l : latencies) point.meanUs += l / n;
+            point.p50Us = percentileOf(latencies, 50);
+            point.p95Us = percentileOf(latencies, 95);
+            point.p99Us = percentileOf(latencies, 99);
+            points.push_back(point);
+        }
+        markPareto(points);
+
+        cout << left << setw(16) << "mode" << setw(32) << "params" << right << setw(10) << "recall@k"
+             << setw(10) << "ndcg@k" << setw(12) << "mean, us" << setw(12) << "p50, us" << setw(12) << "p99, us"
+             << setw(8) << "pareto" << "\n" << fixed;
+        for (const auto &p : points) {
+            cout << left << setw(16) << p.mode << setw(32) << p.params << right << setprecision(4) << setw(10)
+                 << p.recall << setw(10) << p.ndcg << setprecision(1) << setw(12) << p.meanUs << setw(12) << p.p50Us
+                 << setw(12) << p.p99Us << setw(8) << (p.pareto ? "*" : "") << "\n";
+        }
+        if (!options.outPath.empty()) {
+            ofstream out(options.outPath);
+            out << "mode,params,k,recall_at_k,ndcg_at_k,mean_us,p50_us,p95_us,p99_us,pareto\n" << setprecision(6);
+            for (const auto &p : points) {
+                out << p.mode << ',' << p.params << ',' << options.k << ',' << p.recall << ',' << p.ndcg << ','
+                    << p.meanUs << ',' << p.p50Us << ',' << p.p95Us << ',' << p.p99Us << ',' << (p.pareto ? 1 : 0)
+                    << '\n';
+            }
+            if (!out) {
+                cerr << "recall: не удалось записать " << options.outPath << "\n";
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+} // namespace Recall
+
+//
+// --- Перебор конфигураций весов за один проход (режим --sweep) ---
+//
+// Запрос читается со стандартного ввода (как в основном режиме, с --catalog), и для каждой конфигурации
+// (useMetrics, weightViews, weightTime, weightTags, contentWeight, collabWeight) выводится top-k
+// без рандомизации. Конфигурации задаются файлом (--configs, по одной на строку в этом порядке)
+// или сеткой: декартово произведение списков --grid-views, --grid-time, --grid-tags, --grid-content, --grid-collab.
+//
+namespace Sweep {
+
+    vector<double> parseList(const string &text) {
+        vector<double> values;
+        stringstream ss(text);
+        string item;
+        while (getline(ss, item, ',')) {
+            if (!trim(item).empty()) values.push_back(stod(item));
+        }
+        return values;
+    }
+
+    // Разбор аргументов сетки и файла конфигураций; возвращает true, если аргумент распознан.
+    struct GridArgs {
+        vector<double> views { 0.2 }, time { 0.1 }, tags { 1.0 }, content { 0.5 }, collab { 0.5 };
+        bool grid = false;
+        string configsPath;
+
+        bool parse(const string &arg, const function<string()> &value) {
+            if (arg == "--grid-views") views = parseList(value());
+            else if (arg == "--grid-time") time = parseList(value());
+            else if (arg == "--grid-tags") tags = parseList(value());
+            else if (arg == "--grid-content") content = parseList(value());
+            else if (arg == "--grid-collab") collab = parseList(value());
+            else if (arg == "--configs") configsPath = value();
+            else return false;
+            if (arg != "--configs") grid = true;
+            return true;
+        }
+
+        bool any() const { return grid || !configsPath.empty(); }
+
+        bool build(vector<RecSys::SweepConfig> &configs) const {
+            if (!configsPath.empty()) {
+                ifstream in(configsPath);
+                if (!in) return false;
+                string line;
+                while (getline(in, line)) {
+                    if (trim(line).empty() || trim(line)[0] == '#') continue;
+                    istringstream row(line);
+                    int useMetrics;
+                    RecSys::SweepConfig config;
+                    if (!(row >> useMetrics >> config.metrics.weightViews >> config.metrics.weightTime
+                              >> config.metrics.weightTags >> config.contentWeight >> config.collabWeight)) {
+                        return false;
+                    }
+                    config.metrics.useMetrics = useMetrics != 0;
+                    configs.push_back(config);
+                }
+            }
+            if (grid) {
+                for (double v : views)
+                    for (double t : time)
+                        for (double g : tags)
+                            for (double c : content)
+                                for (double l : collab) configs.push_back({ { true, v, t, g }, c, l });
+            }
+            return true;
+        }
+    };
+
+    // Точка входа режима --sweep. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        string catalogPath;
+        int k = 0;
+        GridArgs grid;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            function<string()> value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : "0"; };
+            if (arg == "--catalog") catalogPath = value();
+            else if (arg == "--k") k = stoi(value());
+            else if (!grid.parse(arg, value)) {
+                cerr << "sweep: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+        vector<RecSys::SweepConfig> configs;
+        if (!grid.build(configs) || configs.empty()) {
+            cerr << "sweep: нужны --configs или --grid-*\n";
+            return 2;
+        }
+        RecSys::Request request;
+        if (!readRequest(cin, request)) {
+            cerr << "Некорректные входные данные\n";
+            return 1;
+        }
+        vector<RecSys::Work> works;
+        if (!catalogPath.empty() && !RecSys::loadCatalog(catalogPath, works)) {
+            cerr << "Не удалось загрузить каталог " << catalogPath << "\n";
+            return 1;
+        }
+        works.insert(works.end(), make_move_iterator(request.works.begin()), make_move_iterator(request.works.end()));
+        RecSys::Catalog catalog = RecSys::buildCatalog(move(works));
+        RecSys::ScoringScratch scratch;
+        auto results = RecSys::rankSweep(request, catalog, configs, k > 0 ? k : request.numRecommendations, scratch);
+
+        cout << "{\n  \"sweep\": [\n";
+        for (size_t c = 0; c < configs.size(); c++) {
+            const auto &config = configs[c];
+            cout << "    { \"config\": { \"use_metrics\": " << (config.metrics.useMetrics ? 1 : 0)
+                 << ", \"weight_views\": " << config.metrics.weightViews << ", \"weight_time\": "
+                 << config.metrics.weightTime << ", \"weight_tags\": " << config.metrics.weightTags
+                 << ", \"content_weight\": " << config.contentWeight << ", \"collab_weight\": "
+                 << config.collabWeight << " },\n      \"recommendations\": [";
+            for (size_t i = 0; i < results[c].size(); i++) {
+                cout << (i ? ", " : " ") << "{ \"id\": \"" << results[c][i].first << "\", \"score\": "
+                     << results[c][i].second << " }";
+            }
+            cout << " ] }" << (c + 1 < configs.size() ? "," : "") << "\n";
+        }
+        cout << "  ]\n}\n";
+        return 0;
+    }
+
+} // namespace Sweep
+
+//
+// --- Оффлайн-оценка качества ранжирования (режим --eval) ---
+//
+// Для каждого пользователя известны отложенные (held-out) понравившиеся работы. Полный конвейер
+// без рандомизации (пакетный RecSys::rankBatch, все пользователи параллельно) строит top-k,
+// по которому считаются precision@k, recall@k, MAP@k и NDCG@k (бинарная релевантность).
+//
+// Формат файла пользователей (--users): последовательность блоков
+//   EVAL_USER
+//   <секции запроса во входном формате: USER_PROFILE, SIMILAR_USERS, METRICS_CONFIG; WORKS игнорируется>
+//   HELD_OUT
+//   <число работ>
+//   Для каждой: <идентификатор работы>
+// Без --users пользователи генерируются Gen: отложенными становятся лайки самого похожего пользователя.
+// С --grid-* или --configs (см. Sweep) все конфигурации весов оцениваются за один проход на пользователя.
+//
+namespace Eval {
+
+    struct EvalUser {
+        RecSys::Request request;
+        vector<string> heldOut;
+    };
+
+    struct EvalOptions {
+        string catalogPath;
+        long long works = 100000;       // размер синтетического каталога, если --catalog не задан
+        string usersPath;
+        int synthetic = 200;            // число синтетических пользователей, если --users не задан
+        int k = 10;
+        int threads = 0;
+        double contentWeight = 0.5;
+        double collabWeight = 0.5;
+        bool overrideConfig = false;    // --metrics-config заменяет METRICS_CONFIG всех пользователей
+        RecSys::MetricsConfig config { true, 0.2, 0.1, 1.0 };
+        Sweep::GridArgs grid;           // с --grid-* / --configs оцениваются все конфигурации за один проход
+        bool staged = false;            // двухэтапный конвейер с бюджетами budgets (без сетки)
+        RecSys::StageBudgets budgets;
+    };
+
+    bool readUsers(const string &path, vector<EvalUser> &users) {
+        ifstream in(path);
+        if (!in) return false;
+        vector<string> blocks;
+        readBlocks(in, "EVAL_USER", blocks);
+        for (const auto &block : blocks) {
+            EvalUser user;
+            istringstream request(block);
+            if (!readRequest(request, user.request)) return false;
+            istringstream held(block);
+            if (seekSection(held, "HELD_OUT")) {
+                int count = 0;
+                held >> count;
+                for (int i = 0; i < count && held; i++) {
+                    string id;
+                    held >> id;
+                    user.heldOut.push_back(id);
+                }
+            }
+            user.request.works.clear();
+            users.push_back(move(user));
+        }
+        return true;
+    }
+
+    bool makeSyntheticUsers(const EvalOptions &options, long long catalogWorks, vector<EvalUser> &users) {
+        for (int u = 0; u < options.synthetic; u++) {
+            EvalUser user;
+            if (!Gen::syntheticRequest(5000 + static_cast<uint64_t>(u), catalogWorks, user.request)) return false;
+            auto &similar = user.request.similarUsers;
+            auto best = max_element(similar.begin(), similar.end(), [](auto &a, auto &b) {
+                return a.similarity < b.similarity;
+            });
+            if (best == similar.end()) continue;
+            for (const auto &id : best->likedWorks) {
+                if (find(user.heldOut.begin(), user.heldOut.end(), id) == user.heldOut.end()) user.heldOut.push_back(id);
+            }
+            similar.erase(best);
+            users.push_back(move(user));
+        }
+        return true;
+    }
+
+    struct Metrics {
+        double precision = 0, recall = 0, map = 0, ndcg = 0;
+    };
+
+    Metrics evaluate(const vector<pair<string, double>> &ranked, const vector<string> &heldOut, int k) {
+        Metrics m;
+        unordered_map<string, bool> relevant;
+        for (const auto &id : heldOut) relevant[id] = true;
+        size_t top = min(ranked.size(), static_cast<size_t>(k));
+        int hits = 0;
+        double dcg = 0, sumPrecision = 0;
+        for (size_t i = 0; i < top; i++) {
+            if (!relevant.count(ranked[i].first)) continue;
+            hits++;
+            sumPrecision += static_cast<double>(hits) / (i + 1);
+            dcg += 1.0 / log2(i + 2.0);
+        }
+        double ideal = 0;
+        for (size_t i = 0; i < min(relevant.size(), static_cast<size_t>(k)); i++) ideal += 1.0 / log2(i + 2.0);
+        m.precision = k > 0 ? static_cast<double>(hits) / k : 0;
+        m.recall = relevant.empty() ? 0 : static_cast<double>(hits) / relevant.size();
+        m.map = relevant.empty() ? 0 : sumPrecision / min(relevant.size(), static_cast<size_t>(k));
+        m.ndcg = ideal > 0 ? dcg / ideal : 0;
+        return m;
+    }
+
+    // Точка входа режима --eval. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        EvalOptions options;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            function<string()> value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : "0"; };
+            if (options.grid.parse(arg, value) || parseBudgetArg(arg, value, options.budgets)) continue;
+            if (arg == "--catalog") options.catalogPath = value();
+            else if (arg == "--works") options.works = stoll(value());
+            else if (arg == "--staged") options.staged = true;
+            else if (arg == "--users") options.usersPath = value();
+            else if (arg == "--synthetic") options.synthetic = stoi(value());
+            else if (arg == "--k") options.k = stoi(value());
+            else if (arg == "--threads") options.threads = stoi(value());
+            else if (arg == "--content-weight") options.contentWeight = stod(value());
+            else if (arg == "--collab-weight") options.collabWeight = stod(value());
+            else if (arg == "--weights") {
+                RecSys::Request weights;
+                if (!loadWeights(value(), weights)) {
+                    cerr << "eval: не удалось загрузить веса\n";
+                    return 1;
+                }
+                options.config = weights.config;
+                options.contentWeight = weights.contentWeight;
+                options.collabWeight = weights.collabWeight;
+                options.overrideConfig = true;
+            } else if (arg == "--metrics-config") {
+                istringstream in(value());
+                int useMetrics = 0;
+                in >> useMetrics >> options.config.weightViews >> options.config.weightTime >> options.config.weightTags;
+                options.config.useMetrics = useMetrics != 0;
+                options.overrideConfig = true;
+            } else {
+                cerr << "eval: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+
+        vector<RecSys::Work> works;
+        if (!Gen::loadOrGenerateWorks(options.catalogPath, options.works, works)) {
+            cerr << "eval: не удалось загрузить каталог " << options.catalogPath << "\n";
+            return 1;
+        }
+        long long catalogWorks = static_cast<long long>(works.size());
+        RecSys::Catalog catalog = RecSys::buildCatalog(move(works));
+
+        vector<EvalUser> users;
+        bool loaded = options.usersPath.empty() ? makeSyntheticUsers(options, catalogWorks, users)
+                                                : readUsers(options.usersPath, users);
+        if (!loaded) {
+            cerr << "eval: не удалось прочитать пользователей\n";
+            return 1;
+        }
+        users.erase(remove_if(users.begin(), users.end(), [](const EvalUser &u) { return u.heldOut.empty(); }),
+                    users.end());
+        if (users.empty()) {
+            cerr << "eval: нет пользователей с отложенными работами\n";
+            return 1;
+        }
+
+        vector<RecSys::Request> requests;
+        requests.reserve(users.size());
+        for (const auto &user : users) {
+            requests.push_back(user.request);
+            if (options.overrideConfig) requests.back().config = options.config;
+        }
+        vector<RecSys::SweepConfig> configs;
+        if (options.grid.any() && !options.grid.build(configs)) {
+            cerr << "eval: некорректные конфигурации\n";
+            return 2;
+        }
+        if (options.staged && !configs.empty()) {
+            cerr << "eval: --staged не сочетается с перебором конфигураций\n";
+            return 2;
+        }
+
+        // Без сетки — одна конфигурация с весами из запросов; с сеткой — все конфигурации за проход на пользователя.
+        auto start = chrono::steady_clock::now();
+        vector<vector<vector<pair<string, double>>>> ranked;
+        if (options.staged) {
+            ranked.resize(requests.size());
+            RecSys::parallelFor(requests.size(), options.threads, [&](size_t u, RecSys::ScoringScratch &) {
+                RecSys::Request request = requests[u];
+                request.contentWeight = options.contentWeight;
+                request.collabWeight = options.collabWeight;
+                auto recs = RecSys::rankStaged(request, catalog, options.budgets);
+                recs.resize(min(recs.size(), static_cast<size_t>(max(options.k, 0))));
+                ranked[u] = { move(recs) };
+            });
+        } else if (configs.empty()) {
+            for (auto &r : RecSys::rankBatch(requests, catalog, options.k, options.contentWeight,
+                                             options.collabWeight, options.threads)) {
+                ranked.push_back({ move(r) });
+            }
+        } else {
+            ranked = RecSys::rankSweepBatch(requests, catalog, configs, options.k, options.threads);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        size_t numConfigs = max<size_t>(configs.size(), 1);
+        double n = static_cast<double>(users.size());
+        cout << fixed << setprecision(4) << "users: " << users.size() << "  k: " << options.k
+             << "  configs: " << numConfigs << "  time: " << seconds << " s\n";
+        cout << setw(44) << left << "config" << right << setw(12) << "precision" << setw(10) << "recall"
+             << setw(10) << "MAP" << setw(10) << "NDCG" << "\n";
+        for (size_t c = 0; c < numConfigs; c++) {
+            Metrics total;
+            for (size_t u = 0; u < users.size(); u++) {
+                Metrics m = evaluate(ranked[u][c], users[u].heldOut, options.k);
+                total.precision += m.precision;
+                total.recall += m.recall;
+                total.map += m.map;
+                total.ndcg += m.ndcg;
+            }
+            ostringstream name;
+            if (configs.empty()) {
+                name << (options.staged ? "staged" : "request");
+            } else {
+                const auto &config = configs[c];
+                name << setprecision(3) << config.metrics.useMetrics << " " << config.metrics.weightViews << " "
+                     << config.metrics.weightTime << " " << config.metrics.weightTags << " " << config.contentWeight
+                     << " " << config.collabWeight;
+            }
+            cout << setw(44) << left << name.str() << right << setw(12) << total.precision / n << setw(10)
+                 << total.recall / n << setw(10) << total.map / n << setw(10) << total.ndcg / n << "\n";
+        }
+        return 0;
+    }
+
+} // namespace Eval
+
+//
+// --- Обучение весов объединения по логам кликов (режим --train) ---
+//
+// По логу показов и кликов обучается линейная (квадратичная ошибка) или логистическая модель над
+// признаками RecSys::componentFeatures. Признаки выгружаются в плотную матрицу float (строка на показ)
+// теми же столбцами, что и при оценке, пользователи обрабатываются параллельно. Обучение —
+// стохастический градиентный спуск по стандартизованным признакам: в каждой эпохе потоки проходят
+// свои части данных от общих весов, затем веса усредняются (детерминированно при фиксированном --seed).
+// Результат пишется файлом весов (секции METRICS_CONFIG и COMBINE_WEIGHTS), который принимают
+// основной режим, --serve и --eval через --weights. С --model gbdt по признакам переранжирования
+// обучается ансамбль деревьев (файл модели для --rerank, формат — у RecSys::readEnsemble).
+//
+// Формат лога (--log): последовательность блоков
+//   CLICK_USER
+//   <секции запроса: USER_PROFILE, SIMILAR_USERS>
+//   IMPRESSIONS
+//   <число показов>
+//   Для каждого: <идентификатор работы> <клик 0/1>
+// Без --log лог генерируется: клики разыгрываются по скрытой логистической модели (--synthetic пользователей).
+//
+namespace Train {
+
+    struct Impression {
+        string workId;
+        float clicked;
+    };
+
+    struct LogUser {
+        RecSys::Request request;
+        vector<Impression> impressions;
+    };
+
+    struct TrainOptions {
+        string catalogPath;
+        long long works = 50000;
+        string logPath;
+        int synthetic = 500;
+        int threads = 0;
+        int epochs = 20;
+        double learningRate = 0.05;
+        double l2 = 1e-4;
+        bool logistic = true;
+        bool gbdt = false;          // --model gbdt: ансамбль деревьев для переранжирования вместо весов
+        int trees = 100;
+        int depth = 4;
+        double shrinkage = 0.1;
+        uint64_t seed = 1;
+        string outPath = "-";
+    };
+
+    // Плотная матрица признаков: rows строк по width столбцов.
+    struct FeatureMatrix {
+        size_t rows = 0;
+        int width = RecSys::kNumFeatures;
+        vector<float> x;
+        vector<float> y;
+    };
+
+    bool readLog(const string &path, vector<LogUser> &users) {
+        ifstream in(path);
+        if (!in) return false;
+        vector<string> blocks;
+        readBlocks(in, "CLICK_USER", blocks);
+        for (const auto &block : blocks) {
+            LogUser user;
+            istringstream request(block);
+            if (!readRequest(request, user.request)) return false;
+            istringstream log(block);
+            if (seekSection(log, "IMPRESSIONS")) {
+                int count = 0;
+                log >> count;
+                for (int i = 0; i < count && log; i++) {
+                    Impression impression;
+                    log >> impression.workId >> impression.clicked;
+                    user.impressions.push_back(impression);
+                }
+            }
+            users.push_back(move(user));
+        }
+        return true;
+    }
+
+    // Синтетический лог: показы — верх выдачи и случайные работы, клики — по скрытой модели.
+    bool makeSyntheticLog(const TrainOptions &options, const RecSys::Catalog &catalog, vector<LogUser> &users) {
+        const double hidden[RecSys::kNumFeatures] = { 4.0, 1.5, 0.5, 2.0 };
+        const double hiddenBias = -3.0;
+        Gen::Rng rng(options.seed);
+        RecSys::ScoringScratch scratch;
+        long long n = static_cast<long long>(catalog.works.size());
+        for (int u = 0; u < options.synthetic; u++) {
+            LogUser user;
+            if (!Gen::syntheticRequest(9000 + static_cast<uint64_t>(u), n, user.request)) return false;
+            vector<string> shown;
+            for (const auto &p : RecSys::rankCombinedTopK(user.request, catalog, 20, 0.5, 0.5, scratch)) {
+                shown.push_back(p.first);
+            }
+            for (int j = 0; j < 20; j++) shown.push_back(catalog.works[rng.below(n)].id);
+            RecSys::computeComponents(user.request, catalog, scratch);
+            for (const auto &id : shown) {
+                float row[RecSys::kNumFeatures];
+                RecSys::componentFeatures(catalog, scratch.columns, id, row);
+                double z = hiddenBias;
+                for (int f = 0; f < RecSys::kNumFeatures; f++) z += hidden[f] * row[f];
+                user.impressions.push_back({ id, rng.uniform() < 1.0 / (1.0 + exp(-z)) ? 1.0f : 0.0f });
+            }
+            users.push_back(move(user));
+        }
+        return true;
+    }
+
+    // Выгрузка признаков: столбцы каждого пользователя считаются один раз, строки пишутся на свои места.
+    // rerank — признаки переранжирования (RecSys::rerankFeatures) вместо компонентных.
+    FeatureMatrix exportFeatures(const vector<LogUser> &users, const RecSys::Catalog &catalog, int threads,
+                                 bool rerank) {
+        const int f = rerank ? RecSys::kRerankFeatures : RecSys::kNumFeatures;
+        vector<size_t> offsets(users.size() + 1, 0);
+        for (size_t u = 0; u < users.size(); u++) offsets[u + 1] = offsets[u] + users[u].impressions.size();
+        FeatureMatrix m;
+        m.rows = offsets.back();
+        m.width = f;
+        m.x.resize(m.rows * f);
+        m.y.resize(m.rows);
+        RecSys::parallelFor(users.size(), threads, [&](size_t u, RecSys::ScoringScratch &scratch) {
+            RecSys::RerankContext context;
+            if (rerank) context = RecSys::rerankContext(users[u].request, catalog);
+            else RecSys::computeComponents(users[u].request, catalog, scratch);
+            for (size_t j = 0; j < users[u].impressions.size(); j++) {
+                size_t row = offsets[u] + j;
+                const string &id = users[u].impressions[j].workId;
+                if (rerank) RecSys::rerankFeatures(catalog, context, id, &m.x[row * f]);
+                else RecSys::componentFeatures(catalog, scratch.columns, id, &m.x[row * f]);
+                m.y[row] = users[u].impressions[j].clicked;
+            }
+        });
+        return m;
+    }
+
+    // Обученная модель в исходном масштабе признаков: score = bias + sum(coef[i] * x[i]).
+    struct Model {
+        double coef[RecSys::kNumFeatures] = {};
+        double bias = 0;
+        double loss = 0;
+    };
+
+    Model fit(const FeatureMatrix &m, const TrainOptions &options) {
+        const int f = RecSys::kNumFeatures;
+        // Стандартизация: SGD сходится одинаково для признаков разного масштаба.
+        double mean[f] = {}, scale[f] = {};
+        for (size_t r = 0; r < m.rows; r++) {
+            for (int j = 0; j < f; j++) mean[j] += m.x[r * f + j];
+        }
+        for (int j = 0; j < f; j++) mean[j] /= max<size_t>(m.rows, 1);
+        for (size_t r = 0; r < m.rows; r++) {
+            for (int j = 0; j < f; j++) scale[j] += (m.x[r * f + j] - mean[j]) * (m.x[r * f + j] - mean[j]);
+        }
+        for (int j = 0; j < f; j++) {
+            double sd = sqrt(scale[j] / max<size_t>(m.rows, 1));
+            scale[j] = sd > 1e-12 ? 1.0 / sd : 0;
+        }
+
+        int threads = options.threads > 0 ? options.threads : static_cast<int>(max(1u, thread::hardware_concurrency()));
+        threads = static_cast<int>(min<size_t>(static_cast<size_t>(threads), max<size_t>(m.rows, 1)));
+        auto predict = [&](const double *w, size_t r) {
+            double z = w[f];
+            for (int j = 0; j < f; j++) z += w[j] * (m.x[r * f + j] - mean[j]) * scale[j];
+            return options.logistic ? 1.0 / (1.0 + exp(-z)) : z;
+        };
+
+        vector<double> w(f + 1, 0.0);
+        for (int epoch = 0; epoch < options.epochs; epoch++) {
+            double rate = options.learningRate / sqrt(1.0 + epoch);
+            vector<vector<double>> local(threads, w);
+            vector<thread> pool;
+            for (int t = 0; t < threads; t++) {
+                pool.emplace_back([&, t]() {
+                    size_t begin = m.rows * t / threads, end = m.rows * (t + 1) / threads;
+                    vector<size_t> order(end - begin);
+                    for (size_t i = 0; i < order.size(); i++) order[i] = begin + i;
+                    Gen::Rng rng(options.seed * 1000003 + epoch * 131 + t);
+                    for (size_t i = order.size(); i > 1; i--) swap(order[i - 1], order[rng.below(i)]);
+                    double *wt = local[t].data();
+                    for (size_t r : order) {
+                        // Для логистической и квадратичной ошибки градиент по z одинаков: прогноз - метка.
+                        double g = predict(wt, r) - m.y[r];
+                        for (int j = 0; j < f; j++) {
+                            wt[j] -= rate * (g * (m.x[r * f + j] - mean[j]) * scale[j] + options.l2 * wt[j]);
+                        }
+                        wt[f] -= rate * g;
+                    }
+                });
+            }
+            for (auto &t : pool) t.join();
+            for (int j = 0; j <= f; j++) {
+                w[j] = 0;
+                for (int t = 0; t < threads; t++) w[j] += local[t][j] / threads;
+            }
+        }
+
+        Model model;
+        model.bias = w[f];
+        for (int j = 0; j < f; j++) {
+            model.coef[j] = w[j] * scale[j];
+            model.bias -= model.coef[j] * mean[j];
+        }
+        for (size_t r = 0; r < m.rows; r++) {
+            double p = predict(w.data(), r);
+            if (options.logistic) {
+                p = min(max(p, 1e-12), 1 - 1e-12);
+                model.loss -= m.y[r] * log(p) + (1 - m.y[r]) * log(1 - p);
+            } else {
+                model.loss += (p - m.y[r]) * (p - m.y[r]);
+            }
+        }
+        model.loss /= max<size_t>(m.rows, 1);
+        return model;
+    }
+
+    // Перевод коэффициентов в веса запроса. Свободный член на порядок не влияет и отбрасывается,
+    // коэффициенты нормируются на сумму модулей (порядок от положительного множителя не зависит).
+    RecSys::Request modelWeights(const Model &model) {
+        double norm = 0;
+        for (double c : model.coef) norm += fabs(c);
+        if (norm == 0) norm = 1;
+        RecSys::Request weights;
+        weights.config = { true, model.coef[1] / norm, model.coef[2] / norm, model.coef[0] / norm };
+        weights.contentWeight = 1.0;
+        weights.collabWeight = model.coef[3] / norm;
+        return weights;
+    }
+
+    // Градиентный бустинг деревьев (логистическая или квадратичная ошибка) по гистограммам: значения
+    // признака заранее разбиты на kBins корзин по квантилям, порог узла — верхняя граница корзины.
+    // Деревья строятся в глубину не больше depth, узлы нумеруются в порядке создания (потомки после родителя).
+    RecSys::TreeEnsemble fitTrees(const FeatureMatrix &m, const TrainOptions &options, double &loss) {
+        const int kBins = 64;
+        const double lambda = 1.0;
+        const int f = m.width;
+        // Границы корзин: квантили различных значений признака.
+        vector<vector<float>> edges(f);
+        vector<uint8_t> bins(m.rows * f);
+        for (int j = 0; j < f; j++) {
+            vector<float> values(m.rows);
+            for (size_t r = 0; r < m.rows; r++) values[r] = m.x[r * f + j];
+            sort(values.begin(), values.end());
+            values.erase(unique(values.begin(), values.end()), values.end());
+            for (int b = 1; b < kBins && values.size() > 1; b++) {
+                float edge = values[(values.size() - 1) * b / kBins];
+                if (edges[j].empty() || edge > edges[j].back()) edges[j].push_back(edge);
+            }
+            for (size_t r = 0; r < m.rows; r++) {
+                bins[r * f + j] = static_cast<uint8_t>(lower_bound(edges[j].begin(), edges[j].end(), m.x[r * f + j]) -
+                                                       edges[j].begin());
+            }
+        }
+
+        RecSys::TreeEnsemble model;
+        double mean = 0;
+        for (float y : m.y) mean += y;
+        mean /= max<size_t>(m.rows, 1);
+        model.base = options.logistic ? log(max(mean, 1e-6) / max(1 - mean, 1e-6)) : mean;
+        vector<double> prediction(m.rows, model.base), grad(m.rows), hess(m.rows);
+        int depth = min(max(options.depth, 1), 6);   // не больше 64 листьев
+
+        for (int t = 0; t < options.trees; t++) {
+            for (size_t r = 0; r < m.rows; r++) {
+                if (options.logistic) {
+                    double p = 1.0 / (1.0 + exp(-prediction[r]));
+                    grad[r] = p - m.y[r];
+                    hess[r] = max(p * (1 - p), 1e-6);
+                } else {
+                    grad[r] = prediction[r] - m.y[r];
+                    hess[r] = 1.0;
+                }
+            }
+            vector<RecSys::TreeNode> tree;
+            vector<size_t> all(m.rows);
+            for (size_t r = 0; r < m.rows; r++) all[r] = r;
+            function<void(int, vector<size_t> &, int)> grow = [&](int node, vector<size_t> &rows, int level) {
+                double g = 0, h = 0;
+                for (size_t r : rows) {
+                    g += grad[r];
+                    h += hess[r];
+                }
+                int bestFeature = -1, bestBin = 0;
+                double bestGain = 1e-9;
+                if (level < depth && rows.size() > 1) {
+                    for (int j = 0; j < f; j++) {
+                        int numBins = static_cast<int>(edges[j].size()) + 1;
+                        vector<double> hg(numBins, 0), hh(numBins, 0);
+                        for (size_t r : rows) {
+                            hg[bins[r * f + j]] += grad[r];
+                            hh[bins[r * f + j]] += hess[r];
+                        }
+                        double gl = 0, hl = 0;
+                        for (int b = 0; b + 1 < numBins; b++) {
+                            gl += hg[b];
+                            hl += hh[b];
+                            double gr = g - gl, hr = h - hl;
+                            if (hl < 1e-3 || hr < 1e-3) continue;
+                            double gain = gl * gl / (hl + lambda) + gr * gr / (hr + lambda) - g * g / (h + lambda);
+                            if (gain > bestGain) {
+                                bestGain = gain;
+                                bestFeature = j;
+                                bestBin = b;
+                            }
+                        }
+                    }
+                }
+                if (bestFeature < 0) {
+                    double value = -g / (h + lambda) * options.shrinkage;
+                    tree[node].value = value;
+                    for (size_t r : rows) prediction[r] += value;
+                    return;
+                }
+                vector<size_t> left, right;
+                for (size_t r : rows) (bins[r * f + bestFeature] <= bestBin ? left : right).push_back(r);
+                rows.clear();
+                rows.shrink_to_fit();
+                int l = static_cast<int>(tree.size());
+                tree[node].feature = bestFeature;
+                tree[node].threshold = edges[bestFeature][bestBin];
+                tree[node].left = l;
+                tree[node].right = l + 1;
+                tree.resize(tree.size() + 2);
+                grow(l, left, level + 1);
+                grow(l + 1, right, level + 1);
+            };
+            tree.resize(1);
+            grow(0, all, 0);
+            model.trees.push_back(move(tree));
+        }
+
+        loss = 0;
+        for (size_t r = 0; r < m.rows; r++) {
+            if (options.logistic) {
+                double p = min(max(1.0 / (1.0 + exp(-prediction[r])), 1e-12), 1 - 1e-12);
+                loss -= m.y[r] * log(p) + (1 - m.y[r]) * log(1 - p);
+            } else {
+                loss += (prediction[r] - m.y[r]) * (prediction[r] - m.y[r]);
+            }
+        }
+        loss /= max<size_t>(m.rows, 1);
+        return model;
+    }
+
+    bool writeOutput(const string &path, const string &text) {
+        if (path == "-") {
+            cout << text;
+            return true;
+        }
+        ofstream out(path);
+        out << text;
+        if (!out) {
+            cerr << "train: не удалось записать " << path << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Точка входа режима --train. Возвращает код завершения процесса.
+    int run(int argc, char **argv) {
+        TrainOptions options;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            auto value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : "0"; };
+            if (arg == "--catalog") options.catalogPath = value();
+            else if (arg == "--works") options.works = stoll(value());
+            else if (arg == "--log") options.logPath = value();
+            else if (arg == "--synthetic") options.synthetic = stoi(value());
+            else if (arg == "--threads") options.threads = stoi(value());
+            else if (arg == "--epochs") options.epochs = stoi(value());
+            else if (arg == "--learning-rate") options.learningRate = stod(value());
+            else if (arg == "--l2") options.l2 = stod(value());
+            else if (arg == "--loss") options.logistic = value() != "linear";
+            else if (arg == "--model") options.gbdt = value() == "gbdt";
+            else if (arg == "--trees") options.trees = stoi(value());
+            else if (arg == "--depth") options.depth = stoi(value());
+            else if (arg == "--shrinkage") options.shrinkage = stod(value());
+            else if (arg == "--seed") options.seed = stoull(value());
+            else if (arg == "--out") options.outPath = value();
+            else {
+                cerr << "train: неизвестный аргумент " << arg << "\n";
+                return 2;
+            }
+        }
+
+        vector<RecSys::Work> works;
+        if (!Gen::loadOrGenerateWorks(options.catalogPath, options.works, works)) {
+            cerr << "train: не удалось загрузить каталог " << options.catalogPath << "\n";
+            return 1;
+        }
+        RecSys::Catalog catalog = RecSys::buildCatalog(move(works));
+        vector<LogUser> users;
+        bool loaded = options.logPath.empty() ? makeSyntheticLog(options, catalog, users) : readLog(options.logPath, users);
+        if (!loaded) {
+            cerr << "train: не удалось прочитать лог\n";
+            return 1;
+        }
+
+        auto start = chrono::steady_clock::now();
+        FeatureMatrix matrix = exportFeatures(users, catalog, options.threads, options.gbdt);
+        double exportSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (matrix.rows == 0) {
+            cerr << "train: в логе нет показов\n";
+            return 1;
+        }
+        start = chrono::steady_clock::now();
+        if (options.gbdt) {
+            double loss = 0;
+            RecSys::TreeEnsemble ensemble = fitTrees(matrix, options, loss);
+            double fitSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cerr << fixed << setprecision(4) << "train: " << matrix.rows << " показов, выгрузка " << exportSec
+                 << " с, обучение " << fitSec << " с, " << ensemble.trees.size() << " деревьев, "
+                 << (options.logistic ? "logloss " : "mse ") << loss << "\n";
+            ostringstream text;
+            RecSys::writeEnsemble(text, ensemble);
+            return writeOutput(options.outPath, text.str()) ? 0 : 1;
+        }
+        Model model = fit(matrix, options);
+        double fitSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cerr << fixed << setprecision(4) << "train: " << matrix.rows << " показов, выгрузка " << exportSec
+             << " с, обучение " << fitSec << " с, " << (options.logistic ? "logloss " : "mse ") << model.loss
+             << "\n  коэффициенты (cosine, views, time, collab): " << model.coef[0] << " " << model.coef[1] << " "
+             << model.coef[2] << " " << model.coef[3] << ", свободный член " << model.bias << "\n";
+
+        RecSys::Request weights = modelWeights(model);
+        ostringstream text;
+        text << setprecision(17) << "METRICS_CONFIG\n1 " << weights.config.weightViews << " "
+             << weights.config.weightTime << " " << weights.config.weightTags << "\nCOMBINE_WEIGHTS\n"
+             << weights.contentWeight << " " << weights.collabWeight << "\n";
+        return writeOutput(options.outPath, text.str()) ? 0 : 1;
+    }
+
+} // namespace Train
+
+//
+// --- Встраиваемая библиотека (C ABI, объявления — в recsys.h) ---
+//
+// Движок — индексированный каталог; запрос из структуры переводится в RecSys::Request без разбора текста
+// и выполняется тем же конвейером, что основной режим с --catalog. С -DRECSYS_LIBRARY файл собирается
+// без main в разделяемую библиотеку. Исключения (нехватка памяти) не пересекают границу C: функции,
+// которые выделяют память, возвращают NULL или -1.
+//
+struct recsys_engine {
+    RecSys::Catalog catalog;
+};
+
+extern "C" {
+
+int recsys_api_version(void) { return RECSYS_API_VERSION; }
+
+void recsys_request_init(recsys_request *request) {
+    if (!request) return;
+    *request = recsys_request();
+    request->struct_size = sizeof(recsys_request);
+    request->weight_tags = 1.0;
+    request->content_weight = 0.5;
+    request->collab_weight = 0.5;
+}
+
+recsys_engine *recsys_open(const char *catalog_path) {
+    try {
+        vector<RecSys::Work> works;
+        if (!catalog_path || !RecSys::loadCatalog(catalog_path, works)) return nullptr;
+        return new recsys_engine { RecSys::buildCatalog(move(works)) };
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+recsys_engine *recsys_create(const recsys_work *works, size_t num_works) {
+    try {
+        if (!works && num_works > 0) return nullptr;
+        vector<RecSys::Work> converted(num_works);
+        for (size_t i = 0; i < num_works; i++) {
+            if (!works[i].id || (!works[i].tags && works[i].num_tags > 0)) return nullptr;
+            converted[i].id = works[i].id;
+            for (size_t t = 0; t < works[i].num_tags; t++) {
+                if (!works[i].tags[t].name) return nullptr;
+                converted[i].tags.push_back({ works[i].tags[t].name, works[i].tags[t].value });
+            }
+            converted[i].viewCount = works[i].view_count;
+            converted[i].interactionTime = works[i].interaction_time;
+        }
+        return new recsys_engine { RecSys::buildCatalog(move(converted)) };
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+size_t recsys_num_works(const recsys_engine *engine) { return engine ? engine->catalog.works.size() : 0; }
+
+// Размер recsys_request первой версии интерфейса (RECSYS_API_VERSION 1): меньшие struct_size отвергаются.
+static const size_t kRecsysRequestV1Size = offsetof(recsys_request, seed) + sizeof(uint64_t);
+
+long recsys_recommend(const recsys_engine *engine, const recsys_request *caller, recsys_result *out,
+                      size_t capacity) {
+    try {
+        if (!engine || !caller || caller->struct_size < kRecsysRequestV1Size || (!out && capacity > 0)) return -1;
+        // Вызывающий, собранный со старым recsys.h, передаёт структуру короче нашей: копируются только поля,
+        // которые она покрывает, остальные берут значения по умолчанию; поля новее нашей версии пропускаются.
+        recsys_request copy;
+        recsys_request_init(&copy);
+        memcpy(&copy, caller, min(caller->struct_size, sizeof(recsys_request)));
+        const recsys_request *request = &copy;
+        if ((!request->profile && request->profile_len > 0)
+            || (!request->similar_users && request->num_similar_users > 0)
+            || (!request->excluded_works && request->num_excluded > 0)) {
+            return -1;
+        }
+        RecSys::Request r;
+        for (size_t t = 0; t < request->profile_len; t++) {
+            if (!request->profile[t].name) return -1;
+            r.user.tags.push_back({ request->profile[t].name, request->profile[t].value });
+        }
+        for (size_t u = 0; u < request->num_similar_users; u++) {
+            const recsys_similar_user &user = request->similar_users[u];
+            if (!user.liked_works && user.num_liked > 0) return -1;
+            RecSys::SimilarUser converted { user.id ? user.id : "", user.similarity, {} };
+            for (size_t w = 0; w < user.num_liked; w++) {
+                if (!user.liked_works[w]) return -1;
+                converted.likedWorks.push_back(user.liked_works[w]);
+            }
+            r.similarUsers.push_back(move(converted));
+        }
+        for (size_t e = 0; e < request->num_excluded; e++) {
+            if (!request->excluded_works[e]) return -1;
+            r.excludedWorks.push_back(request->excluded_works[e]);
+        }
+        r.numRecommendations = request->num_recommendations;
+        r.randomFactor = request->random_factor;
+        r.config = { request->use_metrics != 0, request->weight_views, request->weight_time, request->weight_tags };
+        r.contentWeight = request->content_weight;
+        r.collabWeight = request->collab_weight;
+        r.randomSeed = request->seed;
+
+        auto recs = RecSys::recommend(r, engine->catalog);
+        size_t count = min(recs.size(), capacity);
+        for (size_t i = 0; i < count; i++) {
+            const char *id = nullptr;
+            auto it = engine->catalog.workIndex.find(recs[i].first);
+            if (it != engine->catalog.workIndex.end()) {
+                id = engine->catalog.works[it->second].id.c_str();
+            } else {
+                // Работа вне каталога пришла из лайков похожих пользователей — указатель на строку запроса.
+                for (size_t u = 0; u < request->num_similar_users && !id; u++) {
+                    const recsys_similar_user &user = request->similar_users[u];
+                    for (size_t w = 0; w < user.num_liked && !id; w++) {
+                        if (recs[i].first == user.liked_works[w]) id = user.liked_works[w];
+                    }
+                }
+            }
+            out[i] = { id, recs[i].second };
+        }
+        return static_cast<long>(count);
+    } catch (...) {
+        return -1;
+    }
+}
+
+void recsys_close(recsys_engine *engine) { delete engine; }
+
+} // extern "C"
+
+//
+// Режимы запуска:
+//   projectRec                    — чтение запроса со стандартного ввода и вывод рекомендаций;
+//   projectRec --catalog <файл>   — то же, но произведения берутся из бинарного каталога
+//                                   (секция WORKS в запросе может быть пустой, её работы добавляются к каталогу);
+//   projectRec --bench            — микробенчмарки ядер (см. Bench::run);
+//   projectRec --gen              — генератор синтетических запросов и каталогов (см. Gen::run);
+//   projectRec --serve            — резидентный сервер с загруженным каталогом (см. Server::run);
+//   projectRec --loadgen          — нагрузочный клиент для сервера (см. LoadGen::run);
+//   projectRec --difftest         — сверка оптимизированных путей с эталоном (см. DiffTest::run);
+//   projectRec --recall           — полнота и задержка приближённого поиска (см. Recall::run);
+//   projectRec --eval             — оффлайн-оценка качества на отложенных лайках (см. Eval::run);
+//   projectRec --sweep            — top-k запроса для многих конфигураций весов за проход (см. Sweep::run);
+//   projectRec --train            — обучение весов объединения по логам кликов (см. Train::run).
+//
+// Основной режим, --serve и --eval принимают --weights <файл> — веса, записанные --train.
+//
+
+#ifndef RECSYS_LIBRARY
+int main(int argc, char **argv) {
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+
+    if (argc > 1 && string(argv[1]) == "--bench") return Bench::run(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--gen") return Gen::run(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--serve") return Server::run(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--loadgen") return LoadGen::run(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--difftest") return DiffTest::run(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--recall") return Recall::run(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--eval") return Eval::run(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--sweep") return Sweep::run(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--train") return Train::run(argc, argv);
+
+    string catalogPath, weightsPath, rerankPath, blocklistPath;
+    int rerankTop = 1000;
+    bool staged = false;
+    RecSys::StageBudgets budgets;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        function<string()> value = [&]() -> string { return (i + 1 < argc) ? argv[++i] : "0"; };
+        if (parseBudgetArg(arg, value, budgets)) continue;
+        if (arg == "--catalog") catalogPath = value();
+        else if (arg == "--weights") weightsPath = value();
+        else if (arg == "--rerank") rerankPath = value();
+        else if (arg == "--rerank-top") rerankTop = stoi(value());
+        else if (arg == "--staged") staged = true;
+        else if (arg == "--blocklist") blocklistPath = value();
+        else {
+            cerr << "Неизвестный аргумент " << arg << "\n";
+            return 2;
+        }
+    }
+
+    RecSys::Request request;
+    if (!readRequest(cin, request)) {
+        cerr << "Некорректные входные данные\n";
+        return 1;
+    }
+    if (!weightsPath.empty()) {
+        RecSys::Request weights;
+        if (!loadWeights(weightsPath, weights)) {
+            cerr << "Не удалось загрузить веса " << weightsPath << "\n";
+            return 1;
+        }
+        applyWeights(weights, request);
+    }
+    vector<RecSys::Work> works;
+    if (!catalogPath.empty() && !RecSys::loadCatalog(catalogPath, works)) {
+        cerr << "Не удалось загрузить каталог " << catalogPath << "\n";
+        return 1;
+    }
+    works.insert(works.end(), make_move_iterator(request.works.begin()), make_move_iterator(request.works.end()));
+
+    vector<string> blocked;
+    if (!blocklistPath.empty() && !loadIdList(blocklistPath, blocked)) {
+        cerr << "Не удалось загрузить список запретов " << blocklistPath << "\n";
+        return 1;
+    }
+    // Индексированный каталог нужен модели, конвейеру, запретам, исключениям и ограничениям по тегам (отсев
+    // при отборе за один проход), этапу разнообразия, подписям SimHash, основным тегам квот и оценке с дедлайном.
+    if (!rerankPath.empty() || staged || !blocklistPath.empty() || !request.excludedWorks.empty() ||
+        !request.requiredTags.empty() || !request.forbiddenTags.empty() || !request.diversity.empty() ||
+        request.nearDuplicateDistance >= 0 || RecSys::hasQuotas(request) || request.deadlineMs > 0) {
+        unique_ptr<RecSys::Reranker> reranker;
+        if (!rerankPath.empty()) {
+            RecSys::TreeEnsemble model;
+            if (!RecSys::loadEnsemble(rerankPath, model)) {
+                cerr << "Не удалось загрузить модель " << rerankPath << "\n";
+                return 1;
+            }
+            reranker.reset(new RecSys::Reranker { RecSys::buildQuickScorer(model), rerankTop });
+        }
+        RecSys::Catalog catalog = RecSys::buildCatalog(move(works));
+        RecSys::blockWorks(catalog, blocked);
+        if (staged) {
+            writeRecommendations(cout, RecSys::recommendStaged(request, catalog, budgets, reranker.get()));
+            return 0;
+        }
+        bool approximate = false;
+        auto finalRecs = RecSys::recommend(request, catalog, reranker.get(), nullptr, &approximate);
+        vector<pair<string, string>> fields;
+        if (request.deadlineMs > 0) fields.push_back({ "approximate", approximate ? "true" : "false" });
+        writeRecommendations(cout, finalRecs, fields);
+        return 0;
+    }
+    writeRecommendations(cout, RecSys::recommend(request, works));
     return 0;
 }
+#endif // RECSYS_LIBRARY
@@ -0,0 +1,122 @@
+// Встраиваемый интерфейс движка рекомендаций (C ABI).
+//
+// Сборка библиотеки из того же исходника, без main и режимов командной строки:
+//
+//     g++ -std=c++17 -O2 -pthread -fPIC -shared -DRECSYS_LIBRARY projectRec.cpp -o librecsys.so
+//
+// Движок создаётся один раз (каталог загружается и индексируется), после чего запросы выполняются
+// в процессе вызывающего без разбора текста: запрос передаётся структурой, результат записывается
+// в буфер вызывающего. Движок после создания не меняется, поэтому recsys_recommend можно вызывать
+// из нескольких потоков одновременно.
+//
+// Совместимость: существующие поля структур не меняются и не переставляются; новые добавляются в конец,
+// а размер структуры запроса передаётся в поле struct_size, так что старые вызывающие продолжают работать:
+// поля за пределами struct_size получают значения recsys_request_init. Меньше размера версии 1 (до seed
+// включительно) struct_size быть не может.
+#ifndef RECSYS_H
+#define RECSYS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RECSYS_API_VERSION 1
+
+typedef struct recsys_engine recsys_engine;
+
+typedef struct {
+    const char *name;
+    double value;
+} recsys_tag;
+
+typedef struct {
+    const char *id;
+    const recsys_tag *tags;
+    size_t num_tags;
+    double view_count;
+    double interaction_time;
+} recsys_work;
+
+typedef struct {
+    const char *id;
+    double similarity;
+    const char *const *liked_works;
+    size_t num_liked;
+} recsys_similar_user;
+
+typedef struct {
+    size_t struct_size;                    // sizeof(recsys_request) вызывающего (recsys_request_init)
+    const recsys_tag *profile;
+    size_t profile_len;
+    const recsys_similar_user *similar_users;
+    size_t num_similar_users;
+    int num_recommendations;
+    double random_factor;
+    int use_metrics;                       // как секция METRICS_CONFIG
+    double weight_views;
+    double weight_time;
+    double weight_tags;
+    double content_weight;                 // как секция COMBINE_WEIGHTS
+    double collab_weight;
+    const char *const *excluded_works;     // как секция EXCLUDE
+    size_t num_excluded;
+    uint64_t seed;                         // зерно рандомизации, 0 — случайное
+} recsys_request;
+
+// Работа результата: id указывает на строку каталога движка или, для лайкнутой работы вне каталога,
+// на строку из similar_users запроса; действителен, пока живы движок и запрос.
+typedef struct {
+    const char *id;
+    double score;
+} recsys_result;
+
+// Версия интерфейса библиотеки (RECSYS_API_VERSION, с которой она собрана).
+int recsys_api_version(void);
+
+// Значения по умолчанию, как у текстового запроса без необязательных секций.
+void recsys_request_init(recsys_request *request);
+
+// Движок по бинарному каталогу (формат --catalog) или по массиву работ; NULL при ошибке.
+recsys_engine *recsys_open(const char *catalog_path);
+recsys_engine *recsys_create(const recsys_work *works, size_t num_works);
+
+size_t recsys_num_works(const recsys_engine *engine);
+
+// Выполняет запрос и записывает не больше capacity результатов в out.
+// Возвращает число записанных результатов или -1, если аргументы некорректны.
+long recsys_recommend(const recsys_engine *engine, const recsys_request *request, recsys_result *out,
+                      size_t capacity);
+
+void recsys_close(recsys_engine *engine);
+
+#ifdef __cplusplus
+} // extern "C"
+
+// Обёртка для C++: владеет движком и закрывает его в деструкторе.
+namespace recsys {
+
+    class Engine {
+    public:
+        explicit Engine(const char *catalogPath) : engine(recsys_open(catalogPath)) {}
+        Engine(const recsys_work *works, size_t count) : engine(recsys_create(works, count)) {}
+        ~Engine() { recsys_close(engine); }
+        Engine(const Engine &) = delete;
+        Engine &operator=(const Engine &) = delete;
+
+        bool ok() const { return engine != nullptr; }
+        size_t works() const { return recsys_num_works(engine); }
+        long recommend(const recsys_request &request, recsys_result *out, size_t capacity) const {
+            return recsys_recommend(engine, &request, out, capacity);
+        }
+
+    private:
+        recsys_engine *engine;
+    };
+
+} // namespace recsys
+#endif
+
+#endif // RECSYS_H